@@ -59,7 +59,7 @@ void onMqttPublish(uint16_t packetId) {
 void ClientLoop(void* arg) {
   (void) arg;
   for(;;) {
-    mqttClient.loop();  // includes a yield
+    mqttClient.loop(1000);  // sleeps until there is work to do
     if (exitProgram) break;
   }
 }
@@ -81,7 +81,7 @@ int main() {
   
   while(1) {
     if (exitProgram) break;
-    std::this_thread::yield();
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
   }
   
   t.join();
@@ -0,0 +1,117 @@
+/*
+Copyright (c) 2022 Bert Melis. All rights reserved.
+
+This work is licensed under the terms of the MIT license.  
+For a copy, see <https://opensource.org/licenses/MIT> or
+the LICENSE file.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace espMqttClientInternals {
+
+/**
+ * @brief Fixed-capacity list of callbacks with an id
+ *
+ * Callbacks are stored in an array and invoked by reference, so calling them
+ * doesn't allocate or copy. A callback keeps its slot until it is removed and
+ * the slot index is returned by add() as handle, so removing by handle doesn't
+ * search. Callbacks are called in slot order; a new callback takes the first
+ * free slot. Callbacks removed while calling are only flagged and freed
+ * afterwards.
+ */
+
+template <typename F, size_t capacity>
+class Callbacks {
+  static_assert(capacity > 0 && capacity < 256, "Capacity should be between 1 and 255");
+
+ public:
+  Callbacks()
+  : _callbacks()
+  , _ids{0}
+  , _used{false}
+  , _removed{false}
+  , _count(0)
+  , _calling(0)
+  , _pending(false) {
+    // empty
+  }
+
+  // returns the handle of the callback, -1 when full
+  int add(const F& callback, uint32_t id) {
+    if (_count == capacity) return -1;
+    for (uint8_t i = 0; i < capacity; ++i) {
+      if (_used[i]) continue;
+      _callbacks[i] = callback;
+      _ids[i] = id;
+      _used[i] = true;
+      _removed[i] = false;
+      ++_count;
+      return i;
+    }
+    return -1;
+  }
+
+  // returns the handle of the first callback with id, -1 when not found
+  int find(uint32_t id) const {
+    for (uint8_t i = 0; i < capacity; ++i) {
+      if (_used[i] && !_removed[i] && _ids[i] == id) return i;
+    }
+    return -1;
+  }
+
+  // remove the callback with the handle returned by add() or find()
+  void remove(int handle) {
+    if (handle < 0 || handle >= static_cast<int>(capacity)) return;
+    if (!_used[handle] || _removed[handle]) return;
+    --_count;
+    if (_calling > 0) {
+      _removed[handle] = true;
+      _pending = true;
+    } else {
+      _free(handle);
+    }
+  }
+
+  bool empty() const {
+    return _count == 0;
+  }
+
+  bool calling() const {
+    return _calling > 0;
+  }
+
+  template <typename... Args>
+  void call(Args&&... args) {
+    ++_calling;
+    for (uint8_t i = 0; i < capacity; ++i) {
+      if (_used[i] && !_removed[i] && _callbacks[i]) _callbacks[i](args...);
+    }
+    if (--_calling == 0 && _pending) {
+      _pending = false;
+      for (uint8_t i = 0; i < capacity; ++i) {
+        if (_removed[i]) _free(i);
+      }
+    }
+  }
+
+ private:
+  F _callbacks[capacity];
+  uint32_t _ids[capacity];
+  bool _used[capacity];
+  bool _removed[capacity];
+  uint8_t _count;
+  uint8_t _calling;
+  bool _pending;
+
+  void _free(uint8_t i) {
+    _callbacks[i] = nullptr;
+    _used[i] = false;
+    _removed[i] = false;
+  }
+};
+
+}  // end namespace espMqttClientInternals
@@ -20,6 +20,14 @@ the LICENSE file.
 #define EMC_TX_BUFFER_SIZE 1440
 #endif
 
+#ifndef EMC_TX_MAX_GATHER
+#define EMC_TX_MAX_GATHER 16
+#endif
+
+#ifndef EMC_TX_COALESCE
+#define EMC_TX_COALESCE 0
+#endif
+
 #ifndef EMC_MAX_TOPIC_LENGTH
 #define EMC_MAX_TOPIC_LENGTH 128
 #endif
@@ -57,10 +65,35 @@ the LICENSE file.
 #define EMC_MULTIPLE_CALLBACKS 0
 #endif
 
+#ifndef EMC_MAX_CALLBACKS
+#define EMC_MAX_CALLBACKS 4
+#endif
+
 #ifndef EMC_USE_WATCHDOG
 #define EMC_USE_WATCHDOG 0
 #endif
 
+#ifndef EMC_OUTBOX_INDEX_SIZE
+#define EMC_OUTBOX_INDEX_SIZE 64
+#endif
+
+#ifndef EMC_ROUTER_INDEX_SIZE
+#define EMC_ROUTER_INDEX_SIZE 64
+#endif
+
+#ifndef EMC_MAX_PACKET_ID
+  #if defined(__linux__)
+    // full packet id range, in-use bitmap takes 8 KiB
+    #define EMC_MAX_PACKET_ID 65535
+  #else
+    #define EMC_MAX_PACKET_ID 2047
+  #endif
+#endif
+
+#ifndef EMC_MESSAGE_POOL_CACHE
+#define EMC_MESSAGE_POOL_CACHE 2
+#endif
+
 #ifndef EMC_USE_MEMPOOL
 #define EMC_USE_MEMPOOL 0
 #endif
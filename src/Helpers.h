@@ -38,6 +38,7 @@ the LICENSE file.
   #include <chrono>  // NOLINT [build/c++11]
   #include <thread>  // NOLINT [build/c++11] for yield()
   #define millis() std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count()
+  #define micros() std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count()
   #define EMC_GET_FREE_MEMORY() 1000000000
   #define EMC_YIELD() std::this_thread::yield()
   #define EMC_GENERATE_CLIENTID(x) snprintf(x, EMC_CLIENTID_LENGTH, "Client%04d%04d%04d", rand()%10000, rand()%10000, rand()%10000)
@@ -35,9 +35,16 @@ the LICENSE file.
     #define emc_log_w(...)
   #endif
 #else
-  // when building for PC, always show debug statements as part of testing suite
-  #include <iostream>
-  #define emc_log_i(...) std::cout << "[I] " << __FILE__ ":" << __LINE__ << ": "; printf(__VA_ARGS__); std::cout << std::endl
-  #define emc_log_e(...) std::cout << "[E] " << __FILE__ ":" << __LINE__ << ": "; printf(__VA_ARGS__); std::cout << std::endl
-  #define emc_log_w(...) std::cout << "[W] " << __FILE__ ":" << __LINE__ << ": "; printf(__VA_ARGS__); std::cout << std::endl
+  #if defined(DEBUG_ESP_MQTT_CLIENT)
+  // when building for PC, show debug statements as part of testing suite
+    #include <iostream>
+    #define emc_log_i(...) std::cout << "[I] " << __FILE__ ":" << __LINE__ << ": "; printf(__VA_ARGS__); std::cout << std::endl
+    #define emc_log_e(...) std::cout << "[E] " << __FILE__ ":" << __LINE__ << ": "; printf(__VA_ARGS__); std::cout << std::endl
+    #define emc_log_w(...) std::cout << "[W] " << __FILE__ ":" << __LINE__ << ": "; printf(__VA_ARGS__); std::cout << std::endl
+  #else
+  // Logging is disabled, eg. when benchmarking
+    #define emc_log_i(...)
+    #define emc_log_e(...)
+    #define emc_log_w(...)
+  #endif
 #endif
@@ -8,6 +8,12 @@ the LICENSE file.
 
 #include "MqttClient.h"
 
+#if defined(__linux__)
+  #include <poll.h>
+  #include <unistd.h>
+  #include <sys/eventfd.h>
+#endif
+
 using espMqttClientInternals::Packet;
 using espMqttClientInternals::PacketType;
 using espMqttClientTypes::DisconnectReason;
@@ -21,6 +27,8 @@ MqttClient::MqttClient(espMqttClientTypes::UseInternalTask useInternalTask, uint
 , _onSubscribeCallback(nullptr)
 , _onUnsubscribeCallback(nullptr)
 , _onMessageCallback(nullptr)
+, _onMessageViewCallback(nullptr)
+, _onMessageCompleteCallback(nullptr)
 , _onPublishCallback(nullptr)
 , _onErrorCallback(nullptr)
 , _clientId(nullptr)
@@ -38,21 +46,44 @@ MqttClient::MqttClient(espMqttClientTypes::UseInternalTask useInternalTask, uint
 , _willQos(0)
 , _willRetain(false)
 , _timeout(EMC_TX_TIMEOUT)
+, _maxInflight(0)
+, _txFlushDelay(0)
+, _maxMessageSize(4096)
+, _rxBudgetBytes(4 * EMC_RX_BUFFER_SIZE)
+, _rxBudgetPackets(0)
+, _rxBudgetTime(0)
+, _allocateMessage(nullptr)
+, _releaseMessage(nullptr)
 , _state(State::disconnected)
 , _generatedClientId{0}
-, _packetId(0)
+, _packetIds()
 #if defined(ARDUINO_ARCH_ESP32)
 , _xSemaphore(nullptr)
 , _taskHandle(nullptr)
+#elif defined(__linux__)
+, _wakeFd(-1)
+, _waiting(false)
 #endif
 , _rxBuffer{0}
+, _rxLength(0)
 , _outbox()
+, _inflight(0)
 , _bytesSent(0)
+#if EMC_TX_COALESCE
+, _txBuffer{0}
+, _txLength(0)
+, _txSince(0)
+#endif
 , _parser()
+, _rxStats{0, 0, 0, 0, 0, 0}
+, _messagePool()
+, _message(nullptr)
 , _lastClientActivity(0)
 , _lastServerActivity(0)
 , _pingSent(false)
 , _disconnectReason(DisconnectReason::TCP_DISCONNECTED)
+, _releases(nullptr)
+, _lastRelease(nullptr)
 #if defined(ARDUINO_ARCH_ESP32) && ARDUHAL_LOG_LEVEL >= ARDUHAL_LOG_LEVEL_INFO
 , _highWaterMark(4294967295)
 #endif
@@ -77,6 +108,12 @@ MqttClient::MqttClient(espMqttClientTypes::UseInternalTask useInternalTask, uint
   (void) useInternalTask;
   (void) priority;
   (void) core;
+#endif
+#if defined(__linux__)
+  _wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (_wakeFd < 0) {
+    emc_log_e("Error %d: \"%s\" creating eventfd", errno, strerror(errno));
+  }
 #endif
   _clientId = _generatedClientId;
 }
@@ -84,6 +121,8 @@ MqttClient::MqttClient(espMqttClientTypes::UseInternalTask useInternalTask, uint
 MqttClient::~MqttClient() {
   disconnect(true);
   _clearQueue(2);
+  _callReleases(_takeReleases());
+  _dropMessage();
 #if defined(ARDUINO_ARCH_ESP32)
   vSemaphoreDelete(_xSemaphore);
   if (_useInternalTask == espMqttClientTypes::UseInternalTask::YES) {
@@ -92,6 +131,8 @@ MqttClient::~MqttClient() {
     #endif
     vTaskDelete(_taskHandle);
   }
+#elif defined(__linux__)
+  if (_wakeFd >= 0) ::close(_wakeFd);
 #endif
 }
 
@@ -109,6 +150,8 @@ bool MqttClient::connect() {
   bool result = false;
   if (_state == State::disconnected) {
     EMC_SEMAPHORE_TAKE();
+    // packets kept from the previous session are resent after CONNECT
+    _outbox.resetCurrent(QOS2_LANE);
     if (_addPacketFront(_cleanSession,
                         _username,
                         _password,
@@ -133,6 +176,7 @@ bool MqttClient::connect() {
       EMC_SEMAPHORE_TAKE();
     }
     EMC_SEMAPHORE_GIVE();
+    _wakeup();
   }
   return result;
 }
@@ -140,15 +184,44 @@ bool MqttClient::connect() {
 bool MqttClient::disconnect(bool force) {
   if (force && _state != State::disconnected && _state != State::disconnectingTcp1 && _state != State::disconnectingTcp2) {
     _setState(State::disconnectingTcp1);
+    _wakeup();
     return true;
   }
   if (!force && _state == State::connected) {
     _setState(State::disconnectingMqtt1);
+    _wakeup();
     return true;
   }
   return false;
 }
 
+uint16_t MqttClient::subscribe(const char* topic, uint8_t qos, espMqttClientTypes::OnMessageCallback callback) {
+  uint16_t packetId = 0;
+  if (_state != State::connected) {
+    return packetId;
+  }
+  EMC_SEMAPHORE_TAKE();
+  // add the route first so retained messages are routed too
+  espMqttClientInternals::TopicRouter::Route* route = _router.add(topic, callback);
+  if (!route) {
+    emc_log_e("Could not add route");
+  } else {
+    packetId = _getNextPacketId();
+    if (packetId == 0) {
+      emc_log_e("No free packet id for SUBSCRIBE packet");
+      _router.remove(topic, route);
+    } else if (!_addPacket(packetId, topic, qos)) {
+      emc_log_e("Could not create SUBSCRIBE packet");
+      _packetIds.release(packetId);
+      _router.remove(topic, route);
+      packetId = 0;
+    }
+  }
+  EMC_SEMAPHORE_GIVE();
+  _wakeup();
+  return packetId;
+}
+
 uint16_t MqttClient::publish(const char* topic, uint8_t qos, bool retain, const uint8_t* payload, size_t length) {
   #if !EMC_ALLOW_NOT_CONNECTED_PUBLISH
   if (_state != State::connected) {
@@ -157,16 +230,15 @@ uint16_t MqttClient::publish(const char* topic, uint8_t qos, bool retain, const
   #endif
     return 0;
   }
+  uint16_t packetId = 0;
   EMC_SEMAPHORE_TAKE();
-  uint16_t packetId = (qos > 0) ? _getNextPacketId() : 1;
-  if (!_addPacket(packetId, topic, payload, length, qos, retain)) {
-    emc_log_e("Could not create PUBLISH packet");
-    EMC_SEMAPHORE_GIVE();
-    _onError(packetId, Error::OUT_OF_MEMORY);
-    EMC_SEMAPHORE_TAKE();
+  Error error = _queuePublish(packetId, topic, qos, retain, payload, length);
+  EMC_SEMAPHORE_GIVE();
+  _wakeup();
+  if (error != Error::SUCCESS) {
+    _onError(packetId, error);
     packetId = 0;
   }
-  EMC_SEMAPHORE_GIVE();
   return packetId;
 }
 
@@ -183,23 +255,137 @@ uint16_t MqttClient::publish(const char* topic, uint8_t qos, bool retain, espMqt
   #endif
     return 0;
   }
+  uint16_t packetId = 0;
   EMC_SEMAPHORE_TAKE();
-  uint16_t packetId = (qos > 0) ? _getNextPacketId() : 1;
-  if (!_addPacket(packetId, topic, callback, length, qos, retain)) {
-    emc_log_e("Could not create PUBLISH packet");
-    EMC_SEMAPHORE_GIVE();
-    _onError(packetId, Error::OUT_OF_MEMORY);
+  Error error = _queuePublish(packetId, topic, qos, retain, callback, length);
+  EMC_SEMAPHORE_GIVE();
+  _wakeup();
+  if (error != Error::SUCCESS) {
+    _onError(packetId, error);
+    packetId = 0;
+  }
+  return packetId;
+}
+
+uint16_t MqttClient::publish(const char* topic, uint8_t qos, bool retain, const uint8_t* payload, size_t length, espMqttClientTypes::PayloadReleaseCallback releaseCallback) {
+  #if !EMC_ALLOW_NOT_CONNECTED_PUBLISH
+  if (_state != State::connected) {
+  #else
+  if (_state > State::connected) {
+  #endif
+    return 0;
+  }
+  uint16_t packetId = 0;
+  Error error = Error::OUT_OF_MEMORY;
+  // the packet only queues the callback, it is called when the lock is given up
+  PendingRelease* release = new(std::nothrow) PendingRelease{payload, releaseCallback, nullptr};
+  if (release) {
+    espMqttClientTypes::PayloadReleaseCallback deferred = [this, release](const uint8_t* p) {
+      (void) p;
+      _deferRelease(release);
+    };
     EMC_SEMAPHORE_TAKE();
+    error = _queuePublish(packetId, topic, qos, retain, payload, length, deferred);
+    EMC_SEMAPHORE_GIVE();
+    _wakeup();
+    if (error != Error::SUCCESS) delete release;
+  }
+  if (error != Error::SUCCESS) {
+    _onError(packetId, error);
     packetId = 0;
   }
-  EMC_SEMAPHORE_GIVE();
   return packetId;
 }
 
+size_t MqttClient::publishBatch(const espMqttClientTypes::PublishMessage* messages, size_t count, uint16_t* packetIds) {
+  size_t queued = 0;
+  #if !EMC_ALLOW_NOT_CONNECTED_PUBLISH
+  if (_state == State::connected) {
+  #else
+  if (_state <= State::connected) {
+  #endif
+    uint16_t packetId = 0;
+    Error error = Error::SUCCESS;
+    // all messages are queued under a single lock, stop at the first message that fails
+    EMC_SEMAPHORE_TAKE();
+    while (queued < count) {
+      const espMqttClientTypes::PublishMessage& message = messages[queued];
+      error = _queuePublish(packetId, message.topic, message.qos, message.retain, message.payload, message.length);
+      if (error != Error::SUCCESS) break;
+      if (packetIds) packetIds[queued] = packetId;
+      ++queued;
+    }
+    EMC_SEMAPHORE_GIVE();
+    _wakeup();
+    if (error != Error::SUCCESS) {
+      _onError(packetId, error);
+    }
+  }
+  if (packetIds) {
+    for (size_t i = queued; i < count; ++i) {
+      packetIds[i] = 0;
+    }
+  }
+  return queued;
+}
+
+size_t MqttClient::publishMany(const char* const* topics, size_t count, uint8_t qos, bool retain, const uint8_t* payload, size_t length, uint16_t* packetIds) {
+  size_t queued = 0;
+  #if !EMC_ALLOW_NOT_CONNECTED_PUBLISH
+  if (_state == State::connected && count > 0) {
+  #else
+  if (_state <= State::connected && count > 0) {
+  #endif
+    uint16_t packetId = 0;
+    Error error = Error::SUCCESS;
+    EMC_SEMAPHORE_TAKE();
+    // one copy of the payload, every packet holds a reference
+    espMqttClientInternals::SharedPayload* shared = espMqttClientInternals::SharedPayload::create(payload, length);
+    if (!shared) {
+      emc_log_e("Could not create shared payload");
+      error = Error::OUT_OF_MEMORY;
+    } else {
+      while (queued < count) {
+        shared->retain();
+        error = _queuePublish(packetId, topics[queued], qos, retain, shared->data(), length, [shared](const uint8_t* p) {
+          (void) p;
+          shared->release();
+        });
+        if (error != Error::SUCCESS) {
+          shared->release();  // release callback isn't called for packets that failed
+          break;
+        }
+        if (packetIds) packetIds[queued] = packetId;
+        ++queued;
+      }
+      shared->release();
+    }
+    EMC_SEMAPHORE_GIVE();
+    _wakeup();
+    if (error != Error::SUCCESS) {
+      _onError(packetId, error);
+    }
+  }
+  if (packetIds) {
+    for (size_t i = queued; i < count; ++i) {
+      packetIds[i] = 0;
+    }
+  }
+  return queued;
+}
+
+void MqttClient::releaseMessage(uint8_t* payload) {
+  EMC_SEMAPHORE_TAKE();
+  _freeMessage(payload);
+  EMC_SEMAPHORE_GIVE();
+}
+
 void MqttClient::clearQueue(bool deleteSessionData) {
   EMC_SEMAPHORE_TAKE();
   _clearQueue(deleteSessionData ? 2 : 0);
+  PendingRelease* releases = _takeReleases();
   EMC_SEMAPHORE_GIVE();
+  _callReleases(releases);
 }
 
 const char* MqttClient::getClientId() const {
@@ -214,7 +400,15 @@ size_t MqttClient::queueSize() {
   return ret;
 }
 
+espMqttClientTypes::RxStats MqttClient::getRxStats() {
+  EMC_SEMAPHORE_TAKE();
+  espMqttClientTypes::RxStats stats = _rxStats;
+  EMC_SEMAPHORE_GIVE();
+  return stats;
+}
+
 void MqttClient::loop() {
+  PendingRelease* releases = nullptr;
   switch (_state) {
     case State::disconnected:
       #if defined(ARDUINO_ARCH_ESP32)
@@ -236,6 +430,8 @@ void MqttClient::loop() {
     case State::connectingTcp2:
       if (_transport->connected()) {
         _parser.reset();
+        _rxLength = 0;
+        _dropMessage();
         _lastClientActivity = _lastServerActivity = millis();
         _setState(State::connectingMqtt);
       }  else if (_transport->disconnected()) {  // sync: implemented as "not connected"; async: depending on state of pcb in underlying lib
@@ -250,6 +446,7 @@ void MqttClient::loop() {
         _sendPacket();
         _checkIncoming();
         _checkPing();
+        releases = _takeReleases();
         EMC_SEMAPHORE_GIVE();
       } else {
         _setState(State::disconnectingTcp1);
@@ -272,6 +469,8 @@ void MqttClient::loop() {
         _checkIncoming();
         _checkPing();
         _checkTimeout();
+        _checkFlush();
+        releases = _takeReleases();
         EMC_SEMAPHORE_GIVE();
       } else {
         _setState(State::disconnectingTcp1);
@@ -294,6 +493,8 @@ void MqttClient::loop() {
       _checkIncoming();
       _checkPing();
       _checkTimeout();
+      _checkFlush();
+      releases = _takeReleases();
       EMC_SEMAPHORE_GIVE();
       break;
     case State::disconnectingTcp1:
@@ -304,8 +505,12 @@ void MqttClient::loop() {
       if (_transport->disconnected()) {
         EMC_SEMAPHORE_TAKE();
         _clearQueue(0);
+        releases = _takeReleases();
         EMC_SEMAPHORE_GIVE();
         _bytesSent = 0;
+        #if EMC_TX_COALESCE
+        _txLength = 0;
+        #endif
         _setState(State::disconnected);
         if (_onDisconnectCallback) {
           _onDisconnectCallback(_disconnectReason);
@@ -314,6 +519,7 @@ void MqttClient::loop() {
       break;
     // all cases covered, no default case
   }
+  _callReleases(releases);
   EMC_YIELD();
   #if defined(ARDUINO_ARCH_ESP32) && ARDUHAL_LOG_LEVEL >= ARDUHAL_LOG_LEVEL_INFO
   size_t waterMark = uxTaskGetStackHighWaterMark(NULL);
@@ -324,6 +530,74 @@ void MqttClient::loop() {
   #endif
 }
 
+#if defined(__linux__)
+void MqttClient::loop(uint32_t timeout) {
+  pollfd fds[2];
+  EMC_SEMAPHORE_TAKE();
+  // announce the wait before looking for work so a concurrent publish() always wakes us
+  _waiting = true;
+  timeout = std::min(timeout, _nextTimeout());
+  fds[0].fd = _transport->fd();  // negative when not connected, ignored by poll()
+  fds[0].events = POLLIN | (_wantsWrite() ? POLLOUT : 0);
+  fds[0].revents = 0;
+  EMC_SEMAPHORE_GIVE();
+  fds[1].fd = _wakeFd;
+  fds[1].events = POLLIN;
+  fds[1].revents = 0;
+  if (timeout > 0) {
+    int ret = ::poll(fds, 2, timeout > INT32_MAX ? -1 : static_cast<int>(timeout));
+    if (ret < 0 && errno != EINTR) {
+      emc_log_e("Error %d: \"%s\" polling", errno, strerror(errno));
+    }
+    if (fds[1].revents & POLLIN) {
+      uint64_t count;
+      ssize_t drained = ::read(_wakeFd, &count, sizeof(count));
+      (void) drained;
+    }
+  }
+  _waiting = false;
+  loop();
+}
+
+int MqttClient::getFd() {
+  EMC_SEMAPHORE_TAKE();
+  int fd = _transport->fd();
+  EMC_SEMAPHORE_GIVE();
+  return fd;
+}
+
+bool MqttClient::wantsRead() {
+  // while connecting, the transport may offer a descriptor that becomes readable on progress
+  return _state >= State::connectingTcp2 && _state <= State::disconnectingMqtt2;
+}
+
+bool MqttClient::wantsWrite() {
+  EMC_SEMAPHORE_TAKE();
+  bool result = _wantsWrite();
+  EMC_SEMAPHORE_GIVE();
+  return result;
+}
+
+uint32_t MqttClient::nextTimeout() {
+  EMC_SEMAPHORE_TAKE();
+  uint32_t timeout = _nextTimeout();
+  EMC_SEMAPHORE_GIVE();
+  return timeout;
+}
+
+void MqttClient::onReadable() {
+  _service(true, false);
+}
+
+void MqttClient::onWritable() {
+  _service(false, false);
+}
+
+void MqttClient::onTimer() {
+  _service(false, true);
+}
+#endif
+
 #if defined(ARDUINO_ARCH_ESP32)
 void MqttClient::_loop(MqttClient* c) {
   #if EMC_USE_WATCHDOG
@@ -346,14 +620,20 @@ inline void MqttClient::_setState(State newState) {
 }
 
 uint16_t MqttClient::_getNextPacketId() {
-  ++_packetId;
-  if (_packetId == 0) ++_packetId;
-  return _packetId;
+  return _packetIds.acquire();
+}
+
+void MqttClient::_releaseHeld() {
+  while (_outbox.size(HOLD_LANE) > 0 && (_maxInflight == 0 || _inflight < _maxInflight)) {
+    _outbox.promote(HOLD_LANE);
+    ++_inflight;
+  }
 }
 
 void MqttClient::_checkOutbox() {
-  while (_sendPacket() > 0) {
-    if (!_advanceOutbox()) {
+  _releaseHeld();
+  while (_sendPackets() > 0) {
+    if (!_outbox.getCurrent()) {
       break;
     }
   }
@@ -377,10 +657,110 @@ int MqttClient::_sendPacket() {
   return written;
 }
 
+// gather the ready packets of the send lane into a single transport write
+size_t MqttClient::_sendPackets() {
+  espMqttClientInternals::WriteBuffer buffers[EMC_TX_MAX_GATHER];
+  size_t count = 0;
+  size_t index = _bytesSent;
+  espMqttClientInternals::Outbox<OutgoingPacket, NUMBER_OF_LANES>::Iterator it = _outbox.front(SEND_LANE);
+  while (it && count < EMC_TX_MAX_GATHER) {
+    espMqttClientInternals::Packet& packet = it.get()->packet;
+    size_t available = packet.available(index);
+    if (available == 0) break;
+    buffers[count].data = packet.data(index);
+    buffers[count].size = available;
+    ++count;
+    index += available;
+    if (index < packet.size()) {
+      // a chunked payload has only its current chunk available
+      if (packet.chunked()) break;
+      continue;  // header and caller's payload
+    }
+    // nothing can follow DISCONNECT
+    if (packet.packetType() == PacketType.DISCONNECT) break;
+    index = 0;
+    ++it;
+  }
+  if (count == 0) {
+    return 0;
+  }
+
+  #if EMC_TX_COALESCE
+  size_t written = _coalesce(buffers, count);
+  #else
+  size_t written = (count == 1) ? _transport->write(buffers[0].data, buffers[0].size) : _transport->writev(buffers, count);
+  #endif
+  _lastClientActivity = millis();
+
+  // account the written bytes to the packets in order
+  size_t remaining = written;
+  for (size_t i = 0; i < count && remaining > 0; ++i) {
+    OutgoingPacket* packet = _outbox.getCurrent();
+    size_t part = std::min(remaining, buffers[i].size);
+    packet->timeSent = millis();
+    _bytesSent += part;
+    remaining -= part;
+    emc_log_i("tx %zu/%zu (%02x)", _bytesSent, packet->packet.size(), packet->packet.packetType());
+    _advanceOutbox();
+  }
+  return written;
+}
+
+// copy into the tx buffer, returns number of bytes taken
+size_t MqttClient::_coalesce(const espMqttClientInternals::WriteBuffer* buffers, size_t count) {
+  #if EMC_TX_COALESCE
+  size_t taken = 0;
+  for (size_t i = 0; i < count; ++i) {
+    size_t copied = 0;
+    while (copied < buffers[i].size) {
+      if (_txLength == EMC_TX_BUFFER_SIZE) {
+        _flushTx();
+        if (_txLength == EMC_TX_BUFFER_SIZE) return taken;
+      }
+      if (_txLength == 0) _txSince = micros();
+      size_t part = std::min(buffers[i].size - copied, static_cast<size_t>(EMC_TX_BUFFER_SIZE) - _txLength);
+      memcpy(&_txBuffer[_txLength], &buffers[i].data[copied], part);
+      _txLength += part;
+      copied += part;
+      taken += part;
+    }
+  }
+  return taken;
+  #else
+  (void) buffers;
+  (void) count;
+  return 0;
+  #endif
+}
+
+void MqttClient::_flushTx() {
+  #if EMC_TX_COALESCE
+  if (_txLength == 0) return;
+  size_t written = _transport->write(_txBuffer, _txLength);
+  if (written > _txLength) written = 0;  // transport error
+  _txLength -= written;
+  if (_txLength > 0) {
+    memmove(_txBuffer, &_txBuffer[written], _txLength);
+  } else {
+    emc_log_i("tx flush %zu", written);
+  }
+  #endif
+}
+
+void MqttClient::_checkFlush() {
+  #if EMC_TX_COALESCE
+  // without delay, buffered data is flushed at the end of every loop
+  if (_txLength > 0 && (_txFlushDelay == 0 || static_cast<uint32_t>(micros()) - _txSince >= _txFlushDelay)) {
+    _flushTx();
+  }
+  #endif
+}
+
 bool MqttClient::_advanceOutbox() {
   OutgoingPacket* packet = _outbox.getCurrent();
   if (packet && _bytesSent == packet->packet.size()) {
     if ((packet->packet.packetType()) == PacketType.DISCONNECT) {
+      _flushTx();  // the connection is closed right after DISCONNECT
       _setState(State::disconnectingTcp1);
       _disconnectReason = DisconnectReason::USER_OK;
     }
@@ -388,8 +768,9 @@ bool MqttClient::_advanceOutbox() {
       _outbox.removeCurrent();
     } else {
       // we already set 'dup' here, in case we have to retry
-      if ((packet->packet.packetType()) == PacketType.PUBLISH) packet->packet.setDup();
-      _outbox.next();
+      espMqttClientInternals::MQTTPacketType type = packet->packet.packetType();
+      if (type == PacketType.PUBLISH) packet->packet.setDup();
+      _outbox.next((type == PacketType.PUBREC || type == PacketType.PUBREL) ? QOS2_LANE : ACK_LANE);
     }
     packet = _outbox.getCurrent();
     _bytesSent = 0;
@@ -397,16 +778,35 @@ bool MqttClient::_advanceOutbox() {
   return packet;
 }
 
+// Keep reading until the transport has no more data or the rx budget is used
 void MqttClient::_checkIncoming() {
-  int32_t remainingBufferLength = _transport->read(_rxBuffer, EMC_RX_BUFFER_SIZE);
-  if (remainingBufferLength > 0) {
+  size_t bytes = 0;
+  size_t packets = 0;
+  uint32_t start = millis();
+  while (true) {
+    // append to the unparsed bytes of the previous read
+    int32_t space = EMC_RX_BUFFER_SIZE - _rxLength;
+    int32_t length = _transport->read(&_rxBuffer[_rxLength], space);
+    if (length <= 0) return;
     _lastServerActivity = millis();
-    emc_log_i("rx len %i", remainingBufferLength);
+    ++_rxStats.reads;
+    _rxStats.bytes += length;
+    emc_log_i("rx len %i", length);
+    int32_t remainingBufferLength = _rxLength + length;
+    _rxLength = 0;
     size_t bytesParsed = 0;
     size_t index = 0;
     while (remainingBufferLength > 0) {
+      if (!_parser.ready(&_rxBuffer[index], remainingBufferLength, EMC_RX_BUFFER_SIZE)) {
+        // keep the incomplete packet and append the next read
+        memmove(_rxBuffer, &_rxBuffer[index], remainingBufferLength);
+        _rxLength = remainingBufferLength;
+        break;
+      }
       espMqttClientInternals::ParserResult result = _parser.parse(&_rxBuffer[index], remainingBufferLength, &bytesParsed);
       if (result == espMqttClientInternals::ParserResult::packet) {
+        ++packets;
+        ++_rxStats.packets;
         espMqttClientInternals::MQTTPacketType packetType = _parser.getPacket().fixedHeader.packetType & 0xF0;
         if (_state == State::connectingMqtt && packetType != PacketType.CONNACK) {
           emc_log_w("Disconnecting, expected CONNACK - protocol error");
@@ -457,6 +857,21 @@ void MqttClient::_checkIncoming() {
       emc_log_i("Parsed %zu - remaining %i", bytesParsed, remainingBufferLength);
       bytesParsed = 0;
     }
+    // a short read means the transport has been drained
+    if (length < space) return;
+    bytes += length;
+    if (_rxBudgetBytes > 0 && bytes >= _rxBudgetBytes) {
+      ++_rxStats.byteBudgetHits;
+      return;
+    }
+    if (_rxBudgetPackets > 0 && packets >= _rxBudgetPackets) {
+      ++_rxStats.packetBudgetHits;
+      return;
+    }
+    if (_rxBudgetTime > 0 && millis() - start >= _rxBudgetTime) {
+      ++_rxStats.timeBudgetHits;
+      return;
+    }
   }
 }
 
@@ -487,15 +902,106 @@ void MqttClient::_checkPing() {
 }
 
 void MqttClient::_checkTimeout() {
-  espMqttClientInternals::Outbox<OutgoingPacket>::Iterator it = _outbox.front();
   // check that we're not busy sending
-  // don't check when first item hasn't been sent yet
-  if (it && _bytesSent == 0 && it.get() != _outbox.getCurrent()) {
-    if (millis() - it.get()->timeSent > _timeout) {
+  if (_bytesSent != 0) return;
+  // only the oldest packet of each waiting lane needs to be checked
+  for (uint8_t lane = ACK_LANE; lane <= QOS2_LANE; ++lane) {
+    OutgoingPacket* packet = _outbox.first(lane);
+    if (packet && millis() - packet->timeSent > _timeout) {
       emc_log_w("Packet ack timeout, retrying");
-      _outbox.resetCurrent();
+      _outbox.resetCurrent(QOS2_LANE);
+      return;
+    }
+  }
+}
+
+// there is data for the transport that is waiting for the connection to become writable
+bool MqttClient::_wantsWrite() {
+  // a non-blocking connect completes when the socket becomes writable
+  if (_state == State::connectingTcp2) return _transport->fd() >= 0;
+  if (_state < State::connectingMqtt || _state > State::disconnectingMqtt2) return false;
+  #if EMC_TX_COALESCE
+  if (_txLength > 0 && _txFlushDelay == 0) return true;
+  #endif
+  OutgoingPacket* packet = _outbox.getCurrent();
+  return packet && packet->packet.available(_bytesSent) > 0;
+}
+
+// time in ms until loop() has to run again without network activity, 0 when it has to run now
+uint32_t MqttClient::_nextTimeout() {
+  switch (_state) {
+    case State::disconnected:
+      return UINT32_MAX;
+    case State::connectingTcp2:
+      // wait for the transport to become writable, if it can tell us
+      return _transport->fd() >= 0 ? UINT32_MAX : 0;
+    case State::connectingMqtt:
+    case State::connected:
+    case State::disconnectingMqtt1:
+    case State::disconnectingMqtt2:
+      break;
+    default:
+      return 0;
+  }
+  if (!_transport->connected()) return 0;
+  if (_state == State::disconnectingMqtt1 && _outbox.empty()) return 0;
+  if (_transport->pending() > 0) return 0;
+  uint32_t now = millis();
+  uint32_t timeout = UINT32_MAX;
+  auto until = [&timeout, now](uint32_t deadline) {
+    int32_t remaining = static_cast<int32_t>(deadline - now);
+    timeout = std::min(timeout, remaining > 0 ? static_cast<uint32_t>(remaining) : 0);
+  };
+  if (_keepAlive > 0) {
+    until(_lastServerActivity + 2 * _keepAlive + 1);
+    if (!_pingSent) {
+      until(_lastClientActivity + _keepAlive + 1);
+      until(_lastServerActivity + _keepAlive + 1);
     }
   }
+  for (uint8_t lane = ACK_LANE; lane <= QOS2_LANE; ++lane) {
+    OutgoingPacket* packet = _outbox.first(lane);
+    if (packet) until(packet->timeSent + _timeout + 1);
+  }
+  #if EMC_TX_COALESCE
+  if (_txLength > 0 && _txFlushDelay > 0) {
+    uint32_t waited = static_cast<uint32_t>(micros()) - _txSince;
+    timeout = std::min(timeout, waited >= _txFlushDelay ? 0 : (_txFlushDelay - waited + 999) / 1000);
+  }
+  #endif
+  return timeout;
+}
+
+// handle only the requested work while connected, other states are handled by the full loop()
+void MqttClient::_service(bool incoming, bool timers) {
+  if ((_state != State::connected && _state != State::disconnectingMqtt2) || !_transport->connected()) {
+    loop();
+    return;
+  }
+  EMC_SEMAPHORE_TAKE();
+  // data buffered by the transport doesn't make the descriptor readable
+  if (incoming || _transport->pending() > 0) _checkIncoming();
+  if (timers) {
+    _checkPing();
+    _checkTimeout();
+  }
+  _checkOutbox();  // also sends the acknowledgements for incoming packets
+  _checkFlush();
+  PendingRelease* releases = _takeReleases();
+  EMC_SEMAPHORE_GIVE();
+  _callReleases(releases);
+}
+
+// wake up loop(timeout) after adding work from another thread
+void MqttClient::_wakeup() {
+  #if defined(__linux__)
+  if (_waiting && _wakeFd >= 0) {
+    uint64_t one = 1;
+    if (::write(_wakeFd, &one, sizeof(one)) < 0) {
+      emc_log_e("Error %d: \"%s\" waking up loop", errno, strerror(errno));
+    }
+  }
+  #endif
 }
 
 void MqttClient::_onConnack() {
@@ -532,14 +1038,9 @@ void MqttClient::_onPublish() {
       }
     }
   } else if (qos == 2) {
-    espMqttClientInternals::Outbox<OutgoingPacket>::Iterator it = _outbox.front();
-    while (it) {
-      if ((it.get()->packet.packetType()) == PacketType.PUBREC && it.get()->packet.packetId() == packetId) {
-        callback = false;
-        emc_log_e("QoS2 packet previously delivered");
-        break;
-      }
-      ++it;
+    if (_outbox.find(OutgoingPacket::key(PacketType.PUBREC, packetId))) {
+      callback = false;
+      emc_log_e("QoS2 packet previously delivered");
     }
     if (p.payload.index + p.payload.length == p.payload.total) {
       if (!_addPacket(PacketType.PUBREC, packetId)) {
@@ -547,35 +1048,146 @@ void MqttClient::_onPublish() {
       }
     }
   }
-  if (callback && _onMessageCallback) {
+  if (callback) {
+    _routeMessage({qos, dup, retain, packetId});
+  }
+  if (callback && _onMessageCompleteCallback && _reassembleMessage({qos, dup, retain, packetId})) {
+    return;
+  }
+  if (callback && (_onMessageCallback || _onMessageViewCallback)) {
+    // only copy the topic into a c-string when a callback needs it
+    const char* topic = nullptr;
+    if (_onMessageCallback) {
+      topic = _parser.topic();
+      if (!topic) {
+        emc_log_e("Could not copy topic");
+      }
+    }
+    EMC_SEMAPHORE_GIVE();
+    if (_onMessageViewCallback) {
+      _onMessageViewCallback({qos, dup, retain, packetId},
+                             {p.variableHeader.topic, p.variableHeader.topicLength},
+                             p.payload.data,
+                             p.payload.length,
+                             p.payload.index,
+                             p.payload.total);
+    }
+    if (topic) {
+      _onMessageCallback({qos, dup, retain, packetId},
+                         topic,
+                         p.payload.data,
+                         p.payload.length,
+                         p.payload.index,
+                         p.payload.total);
+    }
+    EMC_SEMAPHORE_TAKE();
+  }
+}
+
+// Hand the message to the callbacks of the matching subscriptions
+void MqttClient::_routeMessage(const espMqttClientTypes::MessageProperties& properties) {
+  const espMqttClientInternals::IncomingPacket& p = _parser.getPacket();
+  espMqttClientInternals::TopicRouter::Route* route = _router.match(p.variableHeader.topic, p.variableHeader.topicLength);
+  const char* topic = route ? _parser.topic() : nullptr;
+  if (route && !topic) {
+    emc_log_e("Could not copy topic");
+  } else if (route) {
     EMC_SEMAPHORE_GIVE();
-    _onMessageCallback({qos, dup, retain, packetId},
-                       p.variableHeader.topic,
-                       p.payload.data,
-                       p.payload.length,
-                       p.payload.index,
-                       p.payload.total);
+    for (; route; route = route->nextMatch) {
+      if (route->removed) continue;
+      route->callback(properties, topic, p.payload.data, p.payload.length, p.payload.index, p.payload.total);
+    }
     EMC_SEMAPHORE_TAKE();
   }
+  _router.release();
+}
+
+// Copy the payload into a single buffer and hand it over to onMessageComplete once complete.
+// Returns false when the message is delivered in fragments instead.
+bool MqttClient::_reassembleMessage(const espMqttClientTypes::MessageProperties& properties) {
+  const espMqttClientInternals::IncomingPacket& p = _parser.getPacket();
+  if (p.payload.index == 0) {
+    _dropMessage();
+    if (p.payload.total > _maxMessageSize) return false;
+    if (p.payload.total > 0) {
+      _message = _allocateMessage ? _allocateMessage(p.payload.total) : _messagePool.allocate(p.payload.total);
+      if (!_message) {
+        emc_log_w("Could not allocate message, delivering fragments");
+        return false;
+      }
+    }
+  } else if (!_message) {
+    return false;
+  }
+  if (p.payload.length > 0) {
+    memcpy(&_message[p.payload.index], p.payload.data, p.payload.length);
+  }
+  if (p.payload.index + p.payload.length == p.payload.total) {
+    uint8_t* message = _message;
+    _message = nullptr;
+    const char* topic = _parser.topic();
+    if (!topic) {
+      emc_log_e("Could not copy topic");
+      _freeMessage(message);
+      return true;
+    }
+    EMC_SEMAPHORE_GIVE();
+    _onMessageCompleteCallback(properties, topic, message, p.payload.total);
+    EMC_SEMAPHORE_TAKE();
+  }
+  return true;
+}
+
+void MqttClient::_freeMessage(uint8_t* payload) {
+  if (!payload) return;
+  if (_releaseMessage) {
+    _releaseMessage(payload);
+  } else {
+    _messagePool.release(payload);
+  }
+}
+
+void MqttClient::_dropMessage() {
+  _freeMessage(_message);
+  _message = nullptr;
+}
+
+// called from the Packet destructor, under the lock
+void MqttClient::_deferRelease(PendingRelease* release) {
+  if (_lastRelease) {
+    _lastRelease->next = release;
+  } else {
+    _releases = release;
+  }
+  _lastRelease = release;
+}
+
+// take the payloads to release under the lock, call them with _callReleases after giving it up
+MqttClient::PendingRelease* MqttClient::_takeReleases() {
+  PendingRelease* releases = _releases;
+  _releases = _lastRelease = nullptr;
+  return releases;
+}
+
+// the callbacks may use the client, eg. to publish the returned buffer again
+void MqttClient::_callReleases(PendingRelease* releases) {
+  while (releases) {
+    PendingRelease* release = releases;
+    releases = release->next;
+    if (release->callback) release->callback(release->payload);
+    delete release;
+  }
 }
 
 void MqttClient::_onPuback() {
   bool callback = false;
   uint16_t idToMatch = _parser.getPacket().variableHeader.fixed.packetId;
-  espMqttClientInternals::Outbox<OutgoingPacket>::Iterator it = _outbox.front();
-  while (it) {
-    // PUBACKs come in the order PUBs are sent. So we only check the first PUB packet in outbox
-    // if it doesn't match the ID, return
-    if ((it.get()->packet.packetType()) == PacketType.PUBLISH) {
-      if (it.get()->packet.packetId() == idToMatch) {
-        callback = true;
-        _outbox.remove(it);
-        break;
-      }
-      emc_log_w("Received out of order PUBACK");
-      break;
-    }
-    ++it;
+  espMqttClientInternals::Outbox<OutgoingPacket, NUMBER_OF_LANES>::Iterator it = _outbox.find(OutgoingPacket::key(PacketType.PUBLISH, idToMatch));
+  if (it) {
+    callback = true;
+    _outbox.remove(it);
+    _packetIds.release(idToMatch);
+    if (_inflight > 0) --_inflight;
   }
   if (callback) {
     if (_onPublishCallback) {
@@ -591,23 +1203,15 @@ void MqttClient::_onPuback() {
 void MqttClient::_onPubrec() {
   bool success = false;
   uint16_t idToMatch = _parser.getPacket().variableHeader.fixed.packetId;
-  espMqttClientInternals::Outbox<OutgoingPacket>::Iterator it = _outbox.front();
-  while (it) {
-    // PUBRECs come in the order PUBs are sent. So we only check the first PUB packet in outbox
-    // if it doesn't match the ID, return
-    if ((it.get()->packet.packetType()) == PacketType.PUBLISH) {
-      if (it.get()->packet.packetId() == idToMatch) {
-        if (!_addPacket(PacketType.PUBREL, idToMatch)) {
-          emc_log_e("Could not create PUBREL packet");
-        }
-        _outbox.remove(it);
-        success = true;
-        break;
-      }
-      emc_log_w("Received out of order PUBREC");
-      break;
+  espMqttClientInternals::Outbox<OutgoingPacket, NUMBER_OF_LANES>::Iterator it = _outbox.find(OutgoingPacket::key(PacketType.PUBLISH, idToMatch));
+  if (it) {
+    if (!_addPacket(PacketType.PUBREL, idToMatch)) {
+      emc_log_e("Could not create PUBREL packet");
+      _packetIds.release(idToMatch);
+      if (_inflight > 0) --_inflight;
     }
-    ++it;
+    _outbox.remove(it);
+    success = true;
   }
   if (!success) {
     emc_log_w("No matching PUBLISH packet found");
@@ -617,23 +1221,13 @@ void MqttClient::_onPubrec() {
 void MqttClient::_onPubrel() {
   bool success = false;
   uint16_t idToMatch = _parser.getPacket().variableHeader.fixed.packetId;
-  espMqttClientInternals::Outbox<OutgoingPacket>::Iterator it = _outbox.front();
-  while (it) {
-    // PUBRELs come in the order PUBRECs are sent. So we only check the first PUBREC packet in outbox
-    // if it doesn't match the ID, return
-    if ((it.get()->packet.packetType()) == PacketType.PUBREC) {
-      if (it.get()->packet.packetId() == idToMatch) {
-        if (!_addPacket(PacketType.PUBCOMP, idToMatch)) {
-          emc_log_e("Could not create PUBCOMP packet");
-        }
-        _outbox.remove(it);
-        success = true;
-        break;
-      }
-      emc_log_w("Received out of order PUBREL");
-      break;
+  espMqttClientInternals::Outbox<OutgoingPacket, NUMBER_OF_LANES>::Iterator it = _outbox.find(OutgoingPacket::key(PacketType.PUBREC, idToMatch));
+  if (it) {
+    if (!_addPacket(PacketType.PUBCOMP, idToMatch)) {
+      emc_log_e("Could not create PUBCOMP packet");
     }
-    ++it;
+    _outbox.remove(it);
+    success = true;
   }
   if (!success) {
     emc_log_w("No matching PUBREC packet found");
@@ -642,21 +1236,13 @@ void MqttClient::_onPubrel() {
 
 void MqttClient::_onPubcomp() {
   bool callback = false;
-  espMqttClientInternals::Outbox<OutgoingPacket>::Iterator it = _outbox.front();
   uint16_t idToMatch = _parser.getPacket().variableHeader.fixed.packetId;
-  while (it) {
-    // PUBCOMPs come in the order PUBRELs are sent. So we only check the first PUBREL packet in outbox
-    // if it doesn't match the ID, return
-    if ((it.get()->packet.packetType()) == PacketType.PUBREL) {
-      if (it.get()->packet.packetId() == idToMatch) {
-        callback = true;
-        _outbox.remove(it);
-        break;
-      }
-      emc_log_w("Received out of order PUBCOMP");
-      break;
-    }
-    ++it;
+  espMqttClientInternals::Outbox<OutgoingPacket, NUMBER_OF_LANES>::Iterator it = _outbox.find(OutgoingPacket::key(PacketType.PUBREL, idToMatch));
+  if (it) {
+    callback = true;
+    _outbox.remove(it);
+    _packetIds.release(idToMatch);
+    if (_inflight > 0) --_inflight;
   }
   if (callback) {
     if (_onPublishCallback) {
@@ -672,14 +1258,11 @@ void MqttClient::_onPubcomp() {
 void MqttClient::_onSuback() {
   bool callback = false;
   uint16_t idToMatch = _parser.getPacket().variableHeader.fixed.packetId;
-  espMqttClientInternals::Outbox<OutgoingPacket>::Iterator it = _outbox.front();
-  while (it) {
-    if (((it.get()->packet.packetType()) == PacketType.SUBSCRIBE) && it.get()->packet.packetId() == idToMatch) {
-      callback = true;
-      _outbox.remove(it);
-      break;
-    }
-    ++it;
+  espMqttClientInternals::Outbox<OutgoingPacket, NUMBER_OF_LANES>::Iterator it = _outbox.find(OutgoingPacket::key(PacketType.SUBSCRIBE, idToMatch));
+  if (it) {
+    callback = true;
+    _outbox.remove(it);
+    _packetIds.release(idToMatch);
   }
   if (callback) {
     if (_onSubscribeCallback) {
@@ -694,15 +1277,12 @@ void MqttClient::_onSuback() {
 
 void MqttClient::_onUnsuback() {
   bool callback = false;
-  espMqttClientInternals::Outbox<OutgoingPacket>::Iterator it = _outbox.front();
   uint16_t idToMatch = _parser.getPacket().variableHeader.fixed.packetId;
-  while (it) {
-    if (it.get()->packet.packetId() == idToMatch) {
-      callback = true;
-      _outbox.remove(it);
-      break;
-    }
-    ++it;
+  espMqttClientInternals::Outbox<OutgoingPacket, NUMBER_OF_LANES>::Iterator it = _outbox.find(OutgoingPacket::key(PacketType.UNSUBSCRIBE, idToMatch));
+  if (it) {
+    callback = true;
+    _outbox.remove(it);
+    _packetIds.release(idToMatch);
   }
   if (callback) {
     if (_onUnsubscribeCallback) {
@@ -717,7 +1297,7 @@ void MqttClient::_onUnsuback() {
 
 void MqttClient::_clearQueue(int clearData) {
   emc_log_i("clearing queue (clear session: %d)", clearData);
-  espMqttClientInternals::Outbox<OutgoingPacket>::Iterator it = _outbox.front();
+  espMqttClientInternals::Outbox<OutgoingPacket, NUMBER_OF_LANES>::Iterator it = _outbox.front();
   if (clearData == 0) {
     // keep PUB (qos > 0, aka packetID != 0), PUBREC and PUBREL
     // Spec only mentions PUB and PUBREL but this lib implements method B from point 4.3.3 (Fig. 4.3)
@@ -746,6 +1326,31 @@ void MqttClient::_clearQueue(int clearData) {
       _outbox.remove(it);
     }
   }
+  _restoreSession();
+}
+
+// rebuild inflight count and used packet ids from the packets that are kept
+void MqttClient::_restoreSession() {
+  _inflight = 0;
+  _packetIds.reset();
+  espMqttClientInternals::Outbox<OutgoingPacket, NUMBER_OF_LANES>::Iterator it = _outbox.front();
+  while (it) {
+    espMqttClientInternals::MQTTPacketType type = it.get()->packet.packetType();
+    if (type == PacketType.PUBREL ||
+       (type == PacketType.PUBLISH && it.get()->packet.packetId() != 0)) {
+      ++_inflight;
+    }
+    // PUBREC (and PUBACK, PUBCOMP) carry ids assigned by the server
+    if (type == PacketType.PUBLISH ||
+        type == PacketType.PUBREL ||
+        type == PacketType.SUBSCRIBE ||
+        type == PacketType.UNSUBSCRIBE) {
+      _packetIds.mark(it.get()->packet.packetId());
+    }
+    ++it;
+  }
+  // held back packets are not yet in flight
+  _inflight -= _outbox.size(HOLD_LANE);
 }
 
 void MqttClient::_onError(uint16_t packetId, espMqttClientTypes::Error error) {
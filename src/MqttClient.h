@@ -13,13 +13,18 @@ the LICENSE file.
 
 #include <atomic>
 #include <utility>
+#include <type_traits>
 
 #include "Helpers.h"
 #include "Config.h"
 #include "TypeDefs.h"
 #include "Logging.h"
 #include "Outbox.h"
+#include "TopicRouter.h"
 #include "Packets/Packet.h"
+#include "Packets/PacketIds.h"
+#include "Packets/SharedPayload.h"
+#include "Packets/MessagePool.h"
 #include "Packets/Parser.h"
 #include "Transport/Transport.h"
 
@@ -30,7 +35,7 @@ class MqttClient {
   bool disconnected() const;
   bool connect();
   bool disconnect(bool force = false);
-  template <typename... Args>
+  template <typename... Args, typename = typename std::enable_if<sizeof...(Args) % 2 == 0>::type>
   uint16_t subscribe(const char* topic, uint8_t qos, Args&&... args) {
     uint16_t packetId = 0;
     if (_state != State::connected) {
@@ -38,11 +43,15 @@ class MqttClient {
     } else {
       EMC_SEMAPHORE_TAKE();
       packetId = _getNextPacketId();
-      if (!_addPacket(packetId, topic, qos, std::forward<Args>(args) ...)) {
+      if (packetId == 0) {
+        emc_log_e("No free packet id for SUBSCRIBE packet");
+      } else if (!_addPacket(packetId, topic, qos, std::forward<Args>(args) ...)) {
         emc_log_e("Could not create SUBSCRIBE packet");
+        _packetIds.release(packetId);
         packetId = 0;
       }
       EMC_SEMAPHORE_GIVE();
+      _wakeup();
     }
     return packetId;
   }
@@ -54,21 +63,44 @@ class MqttClient {
     } else {
       EMC_SEMAPHORE_TAKE();
       packetId = _getNextPacketId();
-      if (!_addPacket(packetId, topic, std::forward<Args>(args) ...)) {
+      if (packetId == 0) {
+        emc_log_e("No free packet id for UNSUBSCRIBE packet");
+      } else if (!_addPacket(packetId, topic, std::forward<Args>(args) ...)) {
         emc_log_e("Could not create UNSUBSCRIBE packet");
+        _packetIds.release(packetId);
         packetId = 0;
+      } else {
+        _removeRoutes(topic, std::forward<Args>(args) ...);
       }
       EMC_SEMAPHORE_GIVE();
+      _wakeup();
     }
     return packetId;
   }
+  uint16_t subscribe(const char* topic, uint8_t qos, espMqttClientTypes::OnMessageCallback callback);
   uint16_t publish(const char* topic, uint8_t qos, bool retain, const uint8_t* payload, size_t length);
   uint16_t publish(const char* topic, uint8_t qos, bool retain, const char* payload);
   uint16_t publish(const char* topic, uint8_t qos, bool retain, espMqttClientTypes::PayloadCallback callback, size_t length);
+  uint16_t publish(const char* topic, uint8_t qos, bool retain, const uint8_t* payload, size_t length, espMqttClientTypes::PayloadReleaseCallback releaseCallback);
+  size_t publishBatch(const espMqttClientTypes::PublishMessage* messages, size_t count, uint16_t* packetIds = nullptr);
+  size_t publishMany(const char* const* topics, size_t count, uint8_t qos, bool retain, const uint8_t* payload, size_t length, uint16_t* packetIds = nullptr);
+  void releaseMessage(uint8_t* payload);
   void clearQueue(bool deleteSessionData = false);  // Not MQTT compliant and may cause unpredictable results when `deleteSessionData` = true!
   const char* getClientId() const;
   size_t queueSize();  // No const because of mutex
+  espMqttClientTypes::RxStats getRxStats();  // No const because of mutex
   void loop();
+  #if defined(__linux__)
+  void loop(uint32_t timeout);  // wait up to timeout ms for network activity or a timer before running loop()
+  // integration in an external event loop, instead of calling loop()
+  int getFd();
+  bool wantsRead();
+  bool wantsWrite();
+  uint32_t nextTimeout();
+  void onReadable();
+  void onWritable();
+  void onTimer();
+  #endif
 
  protected:
   explicit MqttClient(espMqttClientTypes::UseInternalTask useInternalTask, uint8_t priority = 1, uint8_t core = 1);
@@ -80,6 +112,8 @@ class MqttClient {
   espMqttClientTypes::OnSubscribeCallback _onSubscribeCallback;
   espMqttClientTypes::OnUnsubscribeCallback _onUnsubscribeCallback;
   espMqttClientTypes::OnMessageCallback _onMessageCallback;
+  espMqttClientTypes::OnMessageViewCallback _onMessageViewCallback;
+  espMqttClientTypes::OnMessageCompleteCallback _onMessageCompleteCallback;
   espMqttClientTypes::OnPublishCallback _onPublishCallback;
   espMqttClientTypes::OnErrorCallback _onErrorCallback;
   typedef void(*mqttClientHook)(void*);
@@ -98,6 +132,14 @@ class MqttClient {
   uint8_t _willQos;
   bool _willRetain;
   uint32_t _timeout;
+  uint16_t _maxInflight;
+  uint32_t _txFlushDelay;
+  size_t _maxMessageSize;
+  size_t _rxBudgetBytes;
+  size_t _rxBudgetPackets;
+  uint32_t _rxBudgetTime;
+  espMqttClientTypes::PayloadAllocateCallback _allocateMessage;
+  espMqttClientTypes::PayloadReleaseCallback _releaseMessage;
 
   // state is protected to allow state changes by the transport system, defined in child classes
   // eg. to allow AsyncTCP
@@ -117,7 +159,7 @@ class MqttClient {
 
  private:
   char _generatedClientId[EMC_CLIENTID_LENGTH];
-  uint16_t _packetId;
+  espMqttClientInternals::PacketIds _packetIds;
 
 #if defined(ARDUINO_ARCH_ESP32)
   SemaphoreHandle_t _xSemaphore;
@@ -127,9 +169,12 @@ class MqttClient {
   std::atomic<bool> _xSemaphore = false;
 #elif defined(__linux__)
   std::mutex mtx;
+  int _wakeFd;  // eventfd to wake up loop(timeout)
+  std::atomic<bool> _waiting;
 #endif
 
   uint8_t _rxBuffer[EMC_RX_BUFFER_SIZE];
+  size_t _rxLength;  // unparsed bytes kept at the start of _rxBuffer
   struct OutgoingPacket {
     uint32_t timeSent;
     espMqttClientInternals::Packet packet;
@@ -137,21 +182,59 @@ class MqttClient {
     OutgoingPacket(uint32_t t, espMqttClientTypes::Error& error, Args&&... args) :  // NOLINT(runtime/references)
       timeSent(t),
       packet(error, std::forward<Args>(args) ...) {}
+    // key for the outbox index: packet type and packet id, 0 when not indexable
+    static uint32_t key(espMqttClientInternals::MQTTPacketType type, uint16_t packetId) {
+      if (packetId == 0) return 0;
+      return (static_cast<uint32_t>(type) << 16) | packetId;
+    }
+    uint32_t indexKey() const {
+      return key(packet.packetType(), packet.packetId());
+    }
+  };
+  enum OutboxLane : uint8_t {
+    SEND_LANE = 0,       // packets waiting to be sent
+    ACK_LANE = 1,        // sent packets waiting for an acknowledgement
+    QOS2_LANE = 2,       // PUBREC and PUBREL waiting for PUBREL and PUBCOMP
+    HOLD_LANE = 3,       // PUBLISH qos > 0 held back by the inflight window
+    NUMBER_OF_LANES = 4
   };
-  espMqttClientInternals::Outbox<OutgoingPacket> _outbox;
+  espMqttClientInternals::Outbox<OutgoingPacket, NUMBER_OF_LANES> _outbox;
+  uint16_t _inflight;  // PUBLISH qos > 0 and PUBREL packets that are not held back
   size_t _bytesSent;
+  #if EMC_TX_COALESCE
+  uint8_t _txBuffer[EMC_TX_BUFFER_SIZE];
+  size_t _txLength;
+  uint32_t _txSince;  // micros() when the first byte was buffered
+  #endif
   espMqttClientInternals::Parser _parser;
+  espMqttClientInternals::TopicRouter _router;
+  espMqttClientTypes::RxStats _rxStats;
+  espMqttClientInternals::MessagePool _messagePool;
+  uint8_t* _message;  // incoming message being reassembled for onMessageComplete
   uint32_t _lastClientActivity;
   uint32_t _lastServerActivity;
   bool _pingSent;
   espMqttClientTypes::DisconnectReason _disconnectReason;
+  // zero-copy payloads of freed packets, handed back once the lock is given up
+  struct PendingRelease {
+    const uint8_t* payload;
+    espMqttClientTypes::PayloadReleaseCallback callback;
+    PendingRelease* next;
+  };
+  PendingRelease* _releases;
+  PendingRelease* _lastRelease;
 
   uint16_t _getNextPacketId();
 
   template <typename... Args>
   bool _addPacket(Args&&... args) {
+    return _addPacketToLane(SEND_LANE, std::forward<Args>(args) ...);
+  }
+
+  template <typename... Args>
+  bool _addPacketToLane(uint8_t lane, Args&&... args) {
     espMqttClientTypes::Error error(espMqttClientTypes::Error::SUCCESS);
-    espMqttClientInternals::Outbox<OutgoingPacket>::Iterator it = _outbox.emplace(0, error, std::forward<Args>(args) ...);
+    espMqttClientInternals::Outbox<OutgoingPacket, NUMBER_OF_LANES>::Iterator it = _outbox.emplaceInLane(lane, 0, error, std::forward<Args>(args) ...);
     if (it && error == espMqttClientTypes::Error::SUCCESS) {
       return true;
     } else {
@@ -160,10 +243,35 @@ class MqttClient {
     }
   }
 
+  template <typename Payload, typename... Args>
+  espMqttClientTypes::Error _queuePublish(uint16_t& packetId, const char* topic, uint8_t qos, bool retain, Payload payload, size_t length, Args&&... args) {  // NOLINT(runtime/references)
+    packetId = (qos > 0) ? _getNextPacketId() : 1;
+    if (packetId == 0) {
+      emc_log_e("No free packet id for PUBLISH packet");
+      return espMqttClientTypes::Error::OUT_OF_PACKET_IDS;
+    }
+    if (!_addPublish(qos, packetId, topic, payload, length, qos, retain, std::forward<Args>(args) ...)) {
+      emc_log_e("Could not create PUBLISH packet");
+      if (qos > 0) _packetIds.release(packetId);
+      return espMqttClientTypes::Error::OUT_OF_MEMORY;
+    }
+    return espMqttClientTypes::Error::SUCCESS;
+  }
+
+  template <typename... Args>
+  bool _addPublish(uint8_t qos, Args&&... args) {
+    if (qos == 0) return _addPacket(std::forward<Args>(args) ...);
+    // hold back when the inflight window is full, behind packets that are already held back
+    bool hold = _maxInflight > 0 && (_inflight >= _maxInflight || _outbox.size(HOLD_LANE) > 0);
+    if (!_addPacketToLane(hold ? HOLD_LANE : SEND_LANE, std::forward<Args>(args) ...)) return false;
+    if (!hold) ++_inflight;
+    return true;
+  }
+
   template <typename... Args>
   bool _addPacketFront(Args&&... args) {
     espMqttClientTypes::Error error(espMqttClientTypes::Error::SUCCESS);
-    espMqttClientInternals::Outbox<OutgoingPacket>::Iterator it = _outbox.emplaceFront(0, error, std::forward<Args>(args) ...);
+    espMqttClientInternals::Outbox<OutgoingPacket, NUMBER_OF_LANES>::Iterator it = _outbox.emplaceFront(0, error, std::forward<Args>(args) ...);
     if (it && error == espMqttClientTypes::Error::SUCCESS) {
       return true;
     } else {
@@ -172,15 +280,37 @@ class MqttClient {
     }
   }
 
+  void _releaseHeld();
   void _checkOutbox();
   int _sendPacket();
+  size_t _sendPackets();
+  size_t _coalesce(const espMqttClientInternals::WriteBuffer* buffers, size_t count);
+  void _flushTx();
+  void _checkFlush();
   bool _advanceOutbox();
   void _checkIncoming();
   void _checkPing();
   void _checkTimeout();
+  bool _wantsWrite();
+  uint32_t _nextTimeout();
+  void _wakeup();
+  void _service(bool incoming, bool timers);
 
   void _onConnack();
   void _onPublish();
+  void _routeMessage(const espMqttClientTypes::MessageProperties& properties);
+  void _removeRoutes() {}
+  template <typename... Args>
+  void _removeRoutes(const char* topic, Args&&... args) {
+    _router.remove(topic);
+    _removeRoutes(std::forward<Args>(args) ...);
+  }
+  bool _reassembleMessage(const espMqttClientTypes::MessageProperties& properties);
+  void _freeMessage(uint8_t* payload);
+  void _dropMessage();
+  void _deferRelease(PendingRelease* release);
+  PendingRelease* _takeReleases();
+  static void _callReleases(PendingRelease* releases);
   void _onPuback();
   void _onPubrec();
   void _onPubrel();
@@ -191,6 +321,7 @@ class MqttClient {
   void _clearQueue(int clearData);  // 0: keep session,
                                     // 1: keep only PUBLISH qos > 0
                                     // 2: delete all
+  void _restoreSession();
   void _onError(uint16_t packetId, espMqttClientTypes::Error error);
 
   #if defined(ARDUINO_ARCH_ESP32)
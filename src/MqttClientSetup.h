@@ -14,8 +14,7 @@ the LICENSE file.
 #include "MqttClient.h"
 
 #if EMC_MULTIPLE_CALLBACKS
-#include <list>
-#include <utility>
+#include "Callbacks.h"
 #endif
 
 template <typename T>
@@ -78,9 +77,39 @@ class MqttClientSetup : public MqttClient {
     return static_cast<T&>(*this);
   }
 
+  T& setMaxInflight(uint16_t maxInflight) {
+    _maxInflight = maxInflight;
+    return static_cast<T&>(*this);
+  }
+
+  T& setTxFlushDelay(uint32_t flushDelay) {
+    _txFlushDelay = flushDelay;
+    return static_cast<T&>(*this);
+  }
+
+  T& setRxBudget(size_t maxBytes, size_t maxPackets = 0, uint32_t maxTime = 0) {
+    _rxBudgetBytes = maxBytes;
+    _rxBudgetPackets = maxPackets;
+    _rxBudgetTime = maxTime;
+    return static_cast<T&>(*this);
+  }
+
+  T& setMaxMessageSize(size_t maxSize) {
+    _maxMessageSize = maxSize;
+    return static_cast<T&>(*this);
+  }
+
+  T& setMessageAllocator(espMqttClientTypes::PayloadAllocateCallback allocate, espMqttClientTypes::PayloadReleaseCallback release) {
+    _allocateMessage = allocate;
+    _releaseMessage = release;
+    return static_cast<T&>(*this);
+  }
+
   T& onConnect(espMqttClientTypes::OnConnectCallback callback, uint32_t id = 0) {
     #if EMC_MULTIPLE_CALLBACKS
-    _onConnectCallbacks.emplace_back(callback, id);
+    if (_onConnectCallbacks.add(callback, id) < 0) {
+      emc_log_w("Too many callbacks");
+    }
     #else
     (void) id;
     _onConnectCallback = callback;
@@ -90,7 +119,9 @@ class MqttClientSetup : public MqttClient {
 
   T& onDisconnect(espMqttClientTypes::OnDisconnectCallback callback, uint32_t id = 0) {
     #if EMC_MULTIPLE_CALLBACKS
-    _onDisconnectCallbacks.emplace_back(callback, id);
+    if (_onDisconnectCallbacks.add(callback, id) < 0) {
+      emc_log_w("Too many callbacks");
+    }
     #else
     (void) id;
     _onDisconnectCallback = callback;
@@ -100,7 +131,9 @@ class MqttClientSetup : public MqttClient {
 
   T& onSubscribe(espMqttClientTypes::OnSubscribeCallback callback, uint32_t id = 0) {
     #if EMC_MULTIPLE_CALLBACKS
-    _onSubscribeCallbacks.emplace_back(callback, id);
+    if (_onSubscribeCallbacks.add(callback, id) < 0) {
+      emc_log_w("Too many callbacks");
+    }
     #else
     (void) id;
     _onSubscribeCallback = callback;
@@ -110,7 +143,9 @@ class MqttClientSetup : public MqttClient {
 
   T& onUnsubscribe(espMqttClientTypes::OnUnsubscribeCallback callback, uint32_t id = 0) {
     #if EMC_MULTIPLE_CALLBACKS
-    _onUnsubscribeCallbacks.emplace_back(callback, id);
+    if (_onUnsubscribeCallbacks.add(callback, id) < 0) {
+      emc_log_w("Too many callbacks");
+    }
     #else
     (void) id;
     _onUnsubscribeCallback = callback;
@@ -120,7 +155,15 @@ class MqttClientSetup : public MqttClient {
 
   T& onMessage(espMqttClientTypes::OnMessageCallback callback, uint32_t id = 0) {
     #if EMC_MULTIPLE_CALLBACKS
-    _onMessageCallbacks.emplace_back(callback, id);
+    if (_onMessageCallbacks.add(callback, id) < 0) {
+      emc_log_w("Too many callbacks");
+    }
+    // only install the dispatcher when needed, the client copies the topic for it
+    if (!_onMessageCallback) {
+      _onMessageCallback = [this](const espMqttClientTypes::MessageProperties& properties, const char* topic, const uint8_t* payload, size_t len, size_t index, size_t total) {
+        _onMessageCallbacks.call(properties, topic, payload, len, index, total);
+      };
+    }
     #else
     (void) id;
     _onMessageCallback = callback;
@@ -128,9 +171,35 @@ class MqttClientSetup : public MqttClient {
     return static_cast<T&>(*this);
   }
 
+  T& onMessageView(espMqttClientTypes::OnMessageViewCallback callback, uint32_t id = 0) {
+    #if EMC_MULTIPLE_CALLBACKS
+    if (_onMessageViewCallbacks.add(callback, id) < 0) {
+      emc_log_w("Too many callbacks");
+    }
+    // only install the dispatcher when needed, the client gives up its lock for it on every message
+    if (!_onMessageViewCallback) {
+      _onMessageViewCallback = [this](const espMqttClientTypes::MessageProperties& properties, const espMqttClientTypes::TopicView& topic, const uint8_t* payload, size_t len, size_t index, size_t total) {
+        _onMessageViewCallbacks.call(properties, topic, payload, len, index, total);
+      };
+    }
+    #else
+    (void) id;
+    _onMessageViewCallback = callback;
+    #endif
+    return static_cast<T&>(*this);
+  }
+
+  // single handler only: it takes ownership of the payload
+  T& onMessageComplete(espMqttClientTypes::OnMessageCompleteCallback callback) {
+    _onMessageCompleteCallback = callback;
+    return static_cast<T&>(*this);
+  }
+
   T& onPublish(espMqttClientTypes::OnPublishCallback callback, uint32_t id = 0) {
     #if EMC_MULTIPLE_CALLBACKS
-    _onPublishCallbacks.emplace_back(callback, id);
+    if (_onPublishCallbacks.add(callback, id) < 0) {
+      emc_log_w("Too many callbacks");
+    }
     #else
     (void) id;
     _onPublishCallback = callback;
@@ -140,62 +209,40 @@ class MqttClientSetup : public MqttClient {
 
   #if EMC_MULTIPLE_CALLBACKS
   T& removeOnConnect(uint32_t id) {
-    for (auto it = _onConnectCallbacks.begin(); it != _onConnectCallbacks.end(); ++it) {
-      if (it->second == id) {
-        _onConnectCallbacks.erase(it);
-        break;
-      }
-    }
+    _onConnectCallbacks.remove(_onConnectCallbacks.find(id));
     return static_cast<T&>(*this);
   }
 
   T& removeOnDisconnect(uint32_t id) {
-    for (auto it = _onDisconnectCallbacks.begin(); it != _onDisconnectCallbacks.end(); ++it) {
-      if (it->second == id) {
-        _onDisconnectCallbacks.erase(it);
-        break;
-      }
-    }
+    _onDisconnectCallbacks.remove(_onDisconnectCallbacks.find(id));
     return static_cast<T&>(*this);
   }
 
   T& removeOnSubscribe(uint32_t id) {
-    for (auto it = _onSubscribeCallbacks.begin(); it != _onSubscribeCallbacks.end(); ++it) {
-      if (it->second == id) {
-        _onSubscribeCallbacks.erase(it);
-        break;
-      }
-    }
+    _onSubscribeCallbacks.remove(_onSubscribeCallbacks.find(id));
     return static_cast<T&>(*this);
   }
 
   T& removeOnUnsubscribe(uint32_t id) {
-    for (auto it = _onUnsubscribeCallbacks.begin(); it != _onUnsubscribeCallbacks.end(); ++it) {
-      if (it->second == id) {
-        _onUnsubscribeCallbacks.erase(it);
-        break;
-      }
-    }
+    _onUnsubscribeCallbacks.remove(_onUnsubscribeCallbacks.find(id));
     return static_cast<T&>(*this);
   }
 
   T& removeOnMessage(uint32_t id) {
-    for (auto it = _onMessageCallbacks.begin(); it != _onMessageCallbacks.end(); ++it) {
-      if (it->second == id) {
-        _onMessageCallbacks.erase(it);
-        break;
-      }
-    }
+    _onMessageCallbacks.remove(_onMessageCallbacks.find(id));
+    // a dispatcher that is running is not replaced
+    if (_onMessageCallbacks.empty() && !_onMessageCallbacks.calling()) _onMessageCallback = nullptr;
+    return static_cast<T&>(*this);
+  }
+
+  T& removeOnMessageView(uint32_t id) {
+    _onMessageViewCallbacks.remove(_onMessageViewCallbacks.find(id));
+    if (_onMessageViewCallbacks.empty() && !_onMessageViewCallbacks.calling()) _onMessageViewCallback = nullptr;
     return static_cast<T&>(*this);
   }
 
   T& removeOnPublish(uint32_t id) {
-    for (auto it = _onPublishCallbacks.begin(); it != _onPublishCallbacks.end(); ++it) {
-      if (it->second == id) {
-        _onPublishCallbacks.erase(it);
-        break;
-      }
-    }
+    _onPublishCallbacks.remove(_onPublishCallbacks.find(id));
     return static_cast<T&>(*this);
   }
   #endif
@@ -212,22 +259,19 @@ class MqttClientSetup : public MqttClient {
   : MqttClient(useInternalTask, priority, core) {
     #if EMC_MULTIPLE_CALLBACKS
     _onConnectCallback = [this](bool sessionPresent) {
-      for (auto callback : _onConnectCallbacks) if (callback.first) callback.first(sessionPresent);
+      _onConnectCallbacks.call(sessionPresent);
     };
     _onDisconnectCallback = [this](espMqttClientTypes::DisconnectReason reason) {
-      for (auto callback : _onDisconnectCallbacks) if (callback.first) callback.first(reason);
+      _onDisconnectCallbacks.call(reason);
     };
     _onSubscribeCallback = [this](uint16_t packetId, const espMqttClientTypes::SubscribeReturncode* returncodes, size_t len) {
-      for (auto callback : _onSubscribeCallbacks) if (callback.first) callback.first(packetId, returncodes, len);
+      _onSubscribeCallbacks.call(packetId, returncodes, len);
     };
     _onUnsubscribeCallback = [this](int16_t packetId) {
-      for (auto callback : _onUnsubscribeCallbacks) if (callback.first) callback.first(packetId);
-    };
-    _onMessageCallback = [this](const espMqttClientTypes::MessageProperties& properties, const char* topic, const uint8_t* payload, size_t len, size_t index, size_t total) {
-      for (auto callback : _onMessageCallbacks) if (callback.first) callback.first(properties, topic, payload, len, index, total);
+      _onUnsubscribeCallbacks.call(packetId);
     };
     _onPublishCallback = [this](uint16_t packetId) {
-      for (auto callback : _onPublishCallbacks) if (callback.first) callback.first(packetId);
+      _onPublishCallbacks.call(packetId);
     };
     #else
     // empty
@@ -235,11 +279,12 @@ class MqttClientSetup : public MqttClient {
   }
 
   #if EMC_MULTIPLE_CALLBACKS
-  std::list<std::pair<espMqttClientTypes::OnConnectCallback, uint32_t>> _onConnectCallbacks;
-  std::list<std::pair<espMqttClientTypes::OnDisconnectCallback, uint32_t>> _onDisconnectCallbacks;
-  std::list<std::pair<espMqttClientTypes::OnSubscribeCallback, uint32_t>> _onSubscribeCallbacks;
-  std::list<std::pair<espMqttClientTypes::OnUnsubscribeCallback, uint32_t>> _onUnsubscribeCallbacks;
-  std::list<std::pair<espMqttClientTypes::OnMessageCallback, uint32_t>> _onMessageCallbacks;
-  std::list<std::pair<espMqttClientTypes::OnPublishCallback, uint32_t>> _onPublishCallbacks;
+  espMqttClientInternals::Callbacks<espMqttClientTypes::OnConnectCallback, EMC_MAX_CALLBACKS> _onConnectCallbacks;
+  espMqttClientInternals::Callbacks<espMqttClientTypes::OnDisconnectCallback, EMC_MAX_CALLBACKS> _onDisconnectCallbacks;
+  espMqttClientInternals::Callbacks<espMqttClientTypes::OnSubscribeCallback, EMC_MAX_CALLBACKS> _onSubscribeCallbacks;
+  espMqttClientInternals::Callbacks<espMqttClientTypes::OnUnsubscribeCallback, EMC_MAX_CALLBACKS> _onUnsubscribeCallbacks;
+  espMqttClientInternals::Callbacks<espMqttClientTypes::OnMessageCallback, EMC_MAX_CALLBACKS> _onMessageCallbacks;
+  espMqttClientInternals::Callbacks<espMqttClientTypes::OnMessageViewCallback, EMC_MAX_CALLBACKS> _onMessageViewCallbacks;
+  espMqttClientInternals::Callbacks<espMqttClientTypes::OnPublishCallback, EMC_MAX_CALLBACKS> _onPublishCallbacks;
   #endif
 };
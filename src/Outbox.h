@@ -9,45 +9,84 @@ the LICENSE file.
 
 #pragma once
 
+#include "Config.h"
 #if EMC_USE_MEMPOOL
   #include "MemoryPool/src/MemoryPool.h"
-  #include "Config.h"
 #endif
+#include <stdint.h>
+#include <stddef.h>
 #include <new>  // new, std::nothrow
 #include <utility>  // std::forward
 
 namespace espMqttClientInternals {
 
 /**
- * @brief Singly linked queue with builtin non-invalidating forward iterator
+ * @brief Doubly linked queue with builtin non-invalidating forward iterator
  * 
- * Queue items can only be emplaced, at front and back of the queue.
+ * Queue items are stored in lanes. New items are emplaced, at front and back,
+ * in the send lane (lane 0). The current item is always the first item of the
+ * send lane. Once handled, the current item can be moved to the back of one of
+ * the other lanes where it waits until it is removed or moved back to the send lane.
  * Remove items using an iterator or the builtin iterator.
+ *
+ * When T has a member `uint32_t indexKey() const`, items with a non-zero key
+ * are also kept in an open addressing hash index so they can be looked up with
+ * `find` in constant time. The index doubles when it gets half full. With the
+ * memory pool, the index is sized for the pool and doesn't grow.
  */
 
-template <typename T>
+// smallest power of two of at least n
+constexpr size_t outboxIndexSize(size_t n, size_t size = 2) {
+  return size >= n ? size : outboxIndexSize(n, size * 2);
+}
+
+constexpr uint8_t outboxIndexBits(size_t size) {
+  return size > 1 ? 1 + outboxIndexBits(size / 2) : 0;
+}
+
+static_assert(EMC_OUTBOX_INDEX_SIZE >= 2 && (EMC_OUTBOX_INDEX_SIZE & (EMC_OUTBOX_INDEX_SIZE - 1)) == 0,
+              "EMC_OUTBOX_INDEX_SIZE must be a power of two");
+
+template <typename T, uint8_t nrLanes = 2>
 class Outbox {
+  static_assert(nrLanes >= 2, "Outbox needs at least a send lane and one waiting lane");
+
  public:
   Outbox()
-  : _first(nullptr)
-  , _last(nullptr)
-  , _current(nullptr)
-  , _prev(nullptr)
+  : _lanes()
+  #if EMC_USE_MEMPOOL
+  , _indexTable{nullptr}
+  , _index(_indexTable)
+  , _indexSize(INDEX_TABLE_SIZE)
+  , _indexBits(outboxIndexBits(INDEX_TABLE_SIZE))
+  #else
+  , _index(nullptr)
+  , _indexSize(0)
+  , _indexBits(0)
+  #endif
+  , _indexed(0)
+  , _unindexed(0)
   #if EMC_USE_MEMPOOL
   , _memPool()
   #endif
   {}
   ~Outbox() {
-    while (_first) {
-      Node* n = _first->next;
-      #if EMC_USE_MEMPOOL
-      _first->~Node();
-      _memPool.free(_first);
-      #else
-      delete _first;
-      #endif
-      _first = n;
+    for (uint8_t lane = 0; lane < nrLanes; ++lane) {
+      Node* node = _lanes[lane].first;
+      while (node) {
+        Node* n = node->next;
+        #if EMC_USE_MEMPOOL
+        node->~Node();
+        _memPool.free(node);
+        #else
+        delete node;
+        #endif
+        node = n;
+      }
     }
+    #if !EMC_USE_MEMPOOL
+    delete[] _index;
+    #endif
   }
 
   struct Node {
@@ -55,21 +94,32 @@ class Outbox {
     template <typename... Args>
     explicit Node(Args&&... args)
     : data(std::forward<Args>(args) ...)
-    , next(nullptr) {
+    , next(nullptr)
+    , prev(nullptr)
+    , key(0)
+    , lane(0)
+    , indexed(false) {
       // empty
     }
 
     T data;
     Node* next;
+    Node* prev;
+    uint32_t key;
+    uint8_t lane;
+    bool indexed;
   };
 
+  // iterates the waiting lanes (in lane order) before the send lane
   class Iterator {
     friend class Outbox;
    public:
     void operator++() {
       if (_node) {
-        _prev = _node;
         _node = _node->next;
+        while (!_node && _outbox && ++_position < nrLanes) {
+          _node = _outbox->_lanes[(_position + 1) % nrLanes].first;
+        }
       }
     }
 
@@ -85,64 +135,36 @@ class Outbox {
 
    private:
     Node* _node = nullptr;
-    Node* _prev = nullptr;
+    const Outbox* _outbox = nullptr;
+    uint8_t _position = nrLanes;
   };
 
-  // add node to back, advance current to new if applicable
+  // add node to back of the send lane
   template <class... Args>
   Iterator emplace(Args&&... args) {
+    return emplaceInLane(0, std::forward<Args>(args) ...);
+  }
+
+  // add node to back of a lane
+  template <class... Args>
+  Iterator emplaceInLane(uint8_t lane, Args&&... args) {
     Iterator it;
-    #if EMC_USE_MEMPOOL
-    void* buf = _memPool.malloc();
-    Node* node = nullptr;
-    if (buf) {
-      node = new(buf) Node(std::forward<Args>(args) ...);
-    }
-    #else
-    Node* node = new(std::nothrow) Node(std::forward<Args>(args) ...);
-    #endif
+    if (lane >= nrLanes) return it;
+    Node* node = _createNode(std::forward<Args>(args) ...);
     if (node != nullptr) {
-      if (!_first) {
-        // queue is empty
-        _first = _current = node;
-      } else {
-        // queue has at least one item
-        _last->next = node;
-        it._prev = _last;
-      }
-      _last = node;
+      _insert(node, lane, _lanes[lane].last);
       it._node = node;
-      // point current to newly created if applicable
-      if (!_current) {
-        _current = _last;
-      }
     }
     return it;
   }
 
-  // add item to front, current points to newly created front.
+  // add item to front of the send lane, current points to newly created front.
   template <class... Args>
   Iterator emplaceFront(Args&&... args) {
     Iterator it;
-    #if EMC_USE_MEMPOOL
-    void* buf = _memPool.malloc();
-    Node* node = nullptr;
-    if (buf) {
-      node = new(buf) Node(std::forward<Args>(args) ...);
-    }
-    #else
-    Node* node = new(std::nothrow) Node(std::forward<Args>(args) ...);
-    #endif
+    Node* node = _createNode(std::forward<Args>(args) ...);
     if (node != nullptr) {
-      if (!_first) {
-        // queue is empty
-        _last = node;
-      } else {
-        // queue has at least one item
-        node->next = _first;
-      }
-      _current = _first = node;
-      _prev = nullptr;
+      _insert(node, 0, nullptr);
       it._node = node;
     }
     return it;
@@ -150,108 +172,294 @@ class Outbox {
 
   // remove node at iterator, iterator points to next
   void remove(Iterator& it) {  // NOLINT(runtime/references)
-      if (!it) return;
+    if (!it) return;
     Node* node = it._node;
-    Node* prev = it._prev;
-    Node* next = node->next;
-
-    _remove(prev, node);
-
-    it._prev = prev;
-    it._node = next;
+    ++it;
+    _remove(node);
   }
 
   // remove current node, current points to next
   void removeCurrent() {
-    _remove(_prev, _current);
+    _remove(_lanes[0].first);
+  }
+
+  // find an item with the given (non-zero) key
+  Iterator find(uint32_t key) const {
+    Iterator it;
+    if (key == 0) return it;
+    Node* n = nullptr;
+    if (_indexed > 0) {
+      for (size_t slot = _home(key); _index[slot]; slot = (slot + 1) & (_indexSize - 1)) {
+        if (_index[slot]->key == key) {
+          n = _index[slot];
+          break;
+        }
+      }
+    }
+    // only when the index could not grow
+    for (uint8_t lane = 0; !n && _unindexed > 0 && lane < nrLanes; ++lane) {
+      for (Node* node = _lanes[lane].first; node; node = node->next) {
+        if (node->key == key) {
+          n = node;
+          break;
+        }
+      }
+    }
+    if (n) {
+      it._node = n;
+      it._outbox = this;
+      it._position = (n->lane + nrLanes - 1) % nrLanes;
+    }
+    return it;
   }
 
   // Get current item or return nullptr
   T* getCurrent() const {
-    if (_current) return &(_current->data);
+    if (_lanes[0].first) return &(_lanes[0].first->data);
     return nullptr;
   }
 
-  void resetCurrent() {
-    _current = _first;
+  // move all items of lanes 1 to lastLane back in front of the send lane, keeping lane order
+  void resetCurrent(uint8_t lastLane = nrLanes - 1) {
+    if (lastLane >= nrLanes) lastLane = nrLanes - 1;
+    for (uint8_t lane = lastLane; lane > 0; --lane) {
+      Lane& from = _lanes[lane];
+      if (!from.first) continue;
+      for (Node* n = from.first; n; n = n->next) {
+        n->lane = 0;
+      }
+      from.last->next = _lanes[0].first;
+      if (_lanes[0].first) {
+        _lanes[0].first->prev = from.last;
+      } else {
+        _lanes[0].last = from.last;
+      }
+      _lanes[0].first = from.first;
+      _lanes[0].count += from.count;
+      from = Lane();
+    }
   }
 
   Iterator front() const {
     Iterator it;
-    it._node = _first;
+    it._outbox = this;
+    it._position = 0;
+    it._node = _lanes[1].first;
+    while (!it._node && ++it._position < nrLanes) {
+      it._node = _lanes[(it._position + 1) % nrLanes].first;
+    }
     return it;
   }
 
-  // Advance current item
-  void next() {
-    if (_current) {
-      _prev = _current;
-      _current = _current->next;
-    }
+  // iterates a single lane
+  Iterator front(uint8_t lane) const {
+    Iterator it;
+    if (lane < nrLanes) it._node = _lanes[lane].first;
+    return it;
+  }
+
+  // Get first item of a lane or return nullptr
+  T* first(uint8_t lane) const {
+    if (lane < nrLanes && _lanes[lane].first) return &(_lanes[lane].first->data);
+    return nullptr;
+  }
+
+  // Move current item to the back of a waiting lane
+  void next(uint8_t lane = 1) {
+    Node* node = _lanes[0].first;
+    if (!node || lane == 0 || lane >= nrLanes) return;
+    _unlink(node);
+    _insert(node, lane, _lanes[lane].last);
+  }
+
+  // Move first item of a lane to the back of the send lane
+  void promote(uint8_t lane) {
+    if (lane == 0 || lane >= nrLanes) return;
+    Node* node = _lanes[lane].first;
+    if (!node) return;
+    _unlink(node);
+    _insert(node, 0, _lanes[0].last);
   }
 
   // Outbox is empty
   bool empty() {
-    if (!_first) return true;
-    return false;
+    return size() == 0;
   }
 
   size_t size() const {
-    Node* n = _first;
     size_t count = 0;
-    while (n) {
-      n = n->next;
-      ++count;
+    for (uint8_t lane = 0; lane < nrLanes; ++lane) {
+      count += _lanes[lane].count;
     }
     return count;
   }
 
+  size_t size(uint8_t lane) const {
+    if (lane < nrLanes) return _lanes[lane].count;
+    return 0;
+  }
+
  private:
-  Node* _first;
-  Node* _last;
-  Node* _current;
-  Node* _prev;  // element just before _current
+  struct Lane {
+    Node* first = nullptr;
+    Node* last = nullptr;
+    size_t count = 0;
+  };
+  Lane _lanes[nrLanes];
+  #if EMC_USE_MEMPOOL
+  // the pool limits the number of nodes, so the index stays at most half full
+  static constexpr size_t INDEX_TABLE_SIZE = outboxIndexSize(2 * EMC_NUM_POOL_ELEMENTS > EMC_OUTBOX_INDEX_SIZE ? 2 * EMC_NUM_POOL_ELEMENTS : EMC_OUTBOX_INDEX_SIZE);
+  Node* _indexTable[INDEX_TABLE_SIZE];
+  #endif
+  Node** _index;  // linear probing, nullptr is an empty slot
+  size_t _indexSize;  // power of two
+  uint8_t _indexBits;
+  size_t _indexed;
+  size_t _unindexed;  // nodes with a key that are not in the index
   #if EMC_USE_MEMPOOL
   MemoryPool::Fixed<EMC_NUM_POOL_ELEMENTS, sizeof(Node)> _memPool;
   #endif
 
-  void _remove(Node* prev, Node* node) {
-    if (!node) return;
+  // use T::indexKey() when available, otherwise items are not indexed
+  template <typename U>
+  static auto _indexKey(const U& data, int) -> decltype(data.indexKey()) {
+    return data.indexKey();
+  }
+  template <typename U>
+  static uint32_t _indexKey(const U&, long) {  // NOLINT(runtime/int)
+    return 0;
+  }
 
-    // set current to next, node->next may be nullptr
-    if (_current == node) {
-      _current = node->next;
+  template <class... Args>
+  Node* _createNode(Args&&... args) {
+    #if EMC_USE_MEMPOOL
+    void* buf = _memPool.malloc();
+    Node* node = nullptr;
+    if (buf) {
+      node = new(buf) Node(std::forward<Args>(args) ...);
     }
-
-    if (_prev == node) {
-      _prev = prev;
+    #else
+    Node* node = new(std::nothrow) Node(std::forward<Args>(args) ...);
+    #endif
+    if (node) {
+      node->key = _indexKey(node->data, 0);
+      if (node->key != 0) {
+        node->indexed = _addToIndex(node);
+        if (!node->indexed) ++_unindexed;
+      }
     }
+    return node;
+  }
 
-    // only one element in outbox
-    if (_first == _last) {
-      _first = _last = nullptr;
+  // fibonacci hashing, the upper bits of the product are the best mixed
+  size_t _home(uint32_t key) const {
+    return static_cast<uint32_t>(key * 2654435761u) >> (32 - _indexBits);
+  }
+
+  bool _addToIndex(Node* node) {
+    #if !EMC_USE_MEMPOOL
+    if ((_indexed + 1) * 2 > _indexSize) _growIndex();
+    #endif
+    // keep an empty slot so probing always ends
+    if (_indexed + 1 >= _indexSize) return false;
+    size_t slot = _home(node->key);
+    while (_index[slot]) slot = (slot + 1) & (_indexSize - 1);
+    _index[slot] = node;
+    ++_indexed;
+    return true;
+  }
 
-    // delete first el in longer outbox
-    } else if (_first == node) {
-      _first = node->next;
+  void _removeFromIndex(Node* node) {
+    size_t mask = _indexSize - 1;
+    size_t slot = _home(node->key);
+    while (_index[slot] != node) slot = (slot + 1) & mask;
+    _index[slot] = nullptr;
+    --_indexed;
+    // move the following entries of the run back, unless that would put them before their home slot
+    for (size_t next = (slot + 1) & mask; _index[next]; next = (next + 1) & mask) {
+      size_t home = _home(_index[next]->key);
+      if (((next - home) & mask) >= ((next - slot) & mask)) {
+        _index[slot] = _index[next];
+        _index[next] = nullptr;
+        slot = next;
+      }
+    }
+  }
 
-    // delete last in longer outbox
-    } else if (_last == node) {
-      _last = prev;
-      _last->next = nullptr;
+  #if !EMC_USE_MEMPOOL
+  // on allocation failure, the index stays as it is and fills up
+  void _growIndex() {
+    size_t size = _indexSize > 0 ? _indexSize * 2 : EMC_OUTBOX_INDEX_SIZE;
+    Node** index = new(std::nothrow) Node*[size]();
+    if (!index) return;
+    Node** old = _index;
+    size_t oldSize = _indexSize;
+    _index = index;
+    _indexSize = size;
+    _indexBits = outboxIndexBits(size);
+    for (size_t i = 0; i < oldSize; ++i) {
+      if (!old[i]) continue;
+      size_t slot = _home(old[i]->key);
+      while (_index[slot]) slot = (slot + 1) & (_indexSize - 1);
+      _index[slot] = old[i];
+    }
+    delete[] old;
+  }
+  #endif
 
-    // delete somewhere in the middle
+  // insert node in lane after 'after', or at the front when 'after' is nullptr
+  void _insert(Node* node, uint8_t lane, Node* after) {
+    Lane& l = _lanes[lane];
+    node->lane = lane;
+    node->prev = after;
+    node->next = after ? after->next : l.first;
+    if (node->prev) {
+      node->prev->next = node;
     } else {
-      prev->next = node->next;
+      l.first = node;
+    }
+    if (node->next) {
+      node->next->prev = node;
+    } else {
+      l.last = node;
+    }
+    ++l.count;
+  }
+
+  void _unlink(Node* node) {
+    Lane& l = _lanes[node->lane];
+    if (node->prev) {
+      node->prev->next = node->next;
+    } else {
+      l.first = node->next;
+    }
+    if (node->next) {
+      node->next->prev = node->prev;
+    } else {
+      l.last = node->prev;
+    }
+    node->next = node->prev = nullptr;
+    --l.count;
+  }
+
+  void _remove(Node* node) {
+    if (!node) return;
+
+    _unlink(node);
+
+    if (node->indexed) {
+      _removeFromIndex(node);
+    } else if (node->key != 0) {
+      --_unindexed;
     }
 
     // finally, delete the node
-      #if EMC_USE_MEMPOOL
-      node->~Node();
-      _memPool.free(node);
-      #else
-      delete node;
-      #endif
+    #if EMC_USE_MEMPOOL
+    node->~Node();
+    _memPool.free(node);
+    #else
+    delete node;
+    #endif
   }
 };
 
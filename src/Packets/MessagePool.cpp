@@ -0,0 +1,73 @@
+/*
+Copyright (c) 2022 Bert Melis. All rights reserved.
+
+This work is licensed under the terms of the MIT license.  
+For a copy, see <https://opensource.org/licenses/MIT> or
+the LICENSE file.
+*/
+
+#include <stdlib.h>  // malloc, free
+
+#include "MessagePool.h"
+#include "../Logging.h"
+
+namespace espMqttClientInternals {
+
+MessagePool::MessagePool()
+: _free{nullptr}
+, _cached{0} {
+  // empty
+}
+
+MessagePool::~MessagePool() {
+  for (uint8_t i = 0; i < NUMBER_OF_CLASSES; ++i) {
+    while (_free[i]) {
+      Block* block = _free[i];
+      _free[i] = block->next;
+      free(block);
+    }
+  }
+}
+
+uint8_t* MessagePool::allocate(size_t size) {
+  uint8_t sizeClass = 0;
+  size_t classSize = 64;
+  while (sizeClass < NUMBER_OF_CLASSES && classSize < size) {
+    ++sizeClass;
+    classSize <<= 2;
+  }
+  Block* block = nullptr;
+  if (sizeClass == NUMBER_OF_CLASSES) {
+    sizeClass = NO_CLASS;
+    classSize = size;
+  } else if (_free[sizeClass]) {
+    block = _free[sizeClass];
+    _free[sizeClass] = block->next;
+    --_cached[sizeClass];
+  }
+  if (!block) {
+    block = reinterpret_cast<Block*>(malloc(HEADER_SIZE + classSize));
+    if (!block) {
+      emc_log_w("Alloc failed (l:%zu)", size);
+      return nullptr;
+    }
+  }
+  block->next = nullptr;
+  block->sizeClass = sizeClass;
+  return reinterpret_cast<uint8_t*>(block) + HEADER_SIZE;
+}
+
+void MessagePool::release(uint8_t* buffer) {
+  if (!buffer) return;
+  Block* block = reinterpret_cast<Block*>(buffer - HEADER_SIZE);
+  uint8_t sizeClass = block->sizeClass;
+  if (sizeClass != NO_CLASS && _cached[sizeClass] < EMC_MESSAGE_POOL_CACHE) {
+    block->next = _free[sizeClass];
+    _free[sizeClass] = block;
+    ++_cached[sizeClass];
+  } else {
+    free(block);
+  }
+}
+
+}  // end namespace espMqttClientInternals
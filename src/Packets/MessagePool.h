@@ -0,0 +1,49 @@
+/*
+Copyright (c) 2022 Bert Melis. All rights reserved.
+
+This work is licensed under the terms of the MIT license.  
+For a copy, see <https://opensource.org/licenses/MIT> or
+the LICENSE file.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "../Config.h"
+
+namespace espMqttClientInternals {
+
+/**
+ * @brief Size-classed buffers for reassembled incoming messages
+ *
+ * Buffers are rounded up to a size class (64, 256, 1k, 4k or 16k bytes).
+ * Released buffers are kept, up to EMC_MESSAGE_POOL_CACHE per size class, and
+ * handed out again. Larger buffers are allocated and freed directly.
+ * Not thread safe: use it under the client's lock.
+ */
+
+class MessagePool {
+ public:
+  MessagePool();
+  ~MessagePool();
+
+  // returns nullptr when out of memory
+  uint8_t* allocate(size_t size);
+  void release(uint8_t* buffer);
+
+ private:
+  static const uint8_t NUMBER_OF_CLASSES = 5;
+  static const uint8_t NO_CLASS = 0xFF;
+  struct Block {
+    Block* next;
+    uint8_t sizeClass;
+  };
+  // keep the buffer behind the header aligned
+  static const size_t HEADER_SIZE = (sizeof(Block) + 2 * sizeof(void*) - 1) / (2 * sizeof(void*)) * (2 * sizeof(void*));
+  Block* _free[NUMBER_OF_CLASSES];
+  uint8_t _cached[NUMBER_OF_CLASSES];
+};
+
+}  // end namespace espMqttClientInternals
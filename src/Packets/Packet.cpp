@@ -20,15 +20,21 @@ Packet::~Packet() {
   #else
   free(_data);
   #endif
+  if (_releasePayload) _releasePayload(_payload);
 }
 
 size_t Packet::available(size_t index) {
   if (index >= _size) return 0;
+  if (_payload && index < _payloadIndex) return _payloadIndex - index;
   if (!_getPayload) return _size - index;
   return _chunkedAvailable(index);
 }
 
 const uint8_t* Packet::data(size_t index) const {
+  if (_payload && index >= _payloadIndex) {
+    if (index >= _size) return nullptr;
+    return &_payload[index - _payloadIndex];
+  }
   if (!_getPayload) {
     if (!_data) return nullptr;
     if (index >= _size) return nullptr;
@@ -57,6 +63,10 @@ MQTTPacketType Packet::packetType() const {
   return static_cast<MQTTPacketType>(0);
 }
 
+bool Packet::chunked() const {
+  return static_cast<bool>(_getPayload);
+}
+
 bool Packet::removable() const {
   if (_packetId == 0) return true;
   if ((packetType() == PacketType.PUBACK) || (packetType() == PacketType.PUBCOMP)) return true;
@@ -80,7 +90,9 @@ Packet::Packet(espMqttClientTypes::Error& error,
 , _payloadIndex(0)
 , _payloadStartIndex(0)
 , _payloadEndIndex(0)
-, _getPayload(nullptr) {
+, _getPayload(nullptr)
+, _payload(nullptr)
+, _releasePayload(nullptr) {
   if (willPayload && willPayloadLength == 0) {
     size_t length = strlen(reinterpret_cast<const char*>(willPayload));
     if (length > UINT16_MAX) {
@@ -175,7 +187,9 @@ Packet::Packet(espMqttClientTypes::Error& error,
 , _payloadIndex(0)
 , _payloadStartIndex(0)
 , _payloadEndIndex(0)
-, _getPayload(nullptr) {
+, _getPayload(nullptr)
+, _payload(nullptr)
+, _releasePayload(nullptr) {
   size_t remainingLength =
     2 + strlen(topic) +  // topic length + topic
     2 +                  // packet ID
@@ -212,7 +226,9 @@ Packet::Packet(espMqttClientTypes::Error& error,
 , _payloadIndex(0)
 , _payloadStartIndex(0)
 , _payloadEndIndex(0)
-, _getPayload(payloadCallback) {
+, _getPayload(payloadCallback)
+, _payload(nullptr)
+, _releasePayload(nullptr) {
   size_t remainingLength =
     2 + strlen(topic) +  // topic length + topic
     2 +                  // packet ID
@@ -239,6 +255,46 @@ Packet::Packet(espMqttClientTypes::Error& error,
   error = espMqttClientTypes::Error::SUCCESS;
 }
 
+Packet::Packet(espMqttClientTypes::Error& error,
+               uint16_t packetId,
+               const char* topic,
+               const uint8_t* payload,
+               size_t payloadLength,
+               uint8_t qos,
+               bool retain,
+               espMqttClientTypes::PayloadReleaseCallback releaseCallback)
+: _packetId(packetId)
+, _data(nullptr)
+, _size(0)
+, _payloadIndex(0)
+, _payloadStartIndex(0)
+, _payloadEndIndex(0)
+, _getPayload(nullptr)
+, _payload(nullptr)
+, _releasePayload(nullptr) {
+  size_t remainingLength =
+    2 + strlen(topic) +  // topic length + topic
+    2 +                  // packet ID
+    payloadLength;
+
+  if (qos == 0) {
+    remainingLength -= 2;
+    _packetId = 0;
+  }
+
+  // only the header is stored, the payload is sent from the caller's buffer
+  if (!_allocate(remainingLength, true, payloadLength)) {
+    error = espMqttClientTypes::Error::OUT_OF_MEMORY;
+    return;
+  }
+
+  _payloadIndex = _fillPublishHeader(packetId, topic, remainingLength, qos, retain);
+  _payload = payload;
+  _releasePayload = releaseCallback;
+
+  error = espMqttClientTypes::Error::SUCCESS;
+}
+
 Packet::Packet(espMqttClientTypes::Error& error, uint16_t packetId, const char* topic, uint8_t qos)
 : _packetId(packetId)
 , _data(nullptr)
@@ -246,7 +302,9 @@ Packet::Packet(espMqttClientTypes::Error& error, uint16_t packetId, const char*
 , _payloadIndex(0)
 , _payloadStartIndex(0)
 , _payloadEndIndex(0)
-, _getPayload(nullptr) {
+, _getPayload(nullptr)
+, _payload(nullptr)
+, _releasePayload(nullptr) {
   SubscribeItem list[1] = {topic, qos};
   _createSubscribe(error, list, 1);
 }
@@ -258,7 +316,9 @@ Packet::Packet(espMqttClientTypes::Error& error, MQTTPacketType type, uint16_t p
 , _payloadIndex(0)
 , _payloadStartIndex(0)
 , _payloadEndIndex(0)
-, _getPayload(nullptr) {
+, _getPayload(nullptr)
+, _payload(nullptr)
+, _releasePayload(nullptr) {
   if (!_allocate(2, true)) {
     error = espMqttClientTypes::Error::OUT_OF_MEMORY;
     return;
@@ -285,7 +345,9 @@ Packet::Packet(espMqttClientTypes::Error& error, uint16_t packetId, const char*
 , _payloadIndex(0)
 , _payloadStartIndex(0)
 , _payloadEndIndex(0)
-, _getPayload(nullptr) {
+, _getPayload(nullptr)
+, _payload(nullptr)
+, _releasePayload(nullptr) {
   const char* list[1] = {topic};
   _createUnsubscribe(error, list, 1);
 }
@@ -297,7 +359,9 @@ Packet::Packet(espMqttClientTypes::Error& error, MQTTPacketType type)
 , _payloadIndex(0)
 , _payloadStartIndex(0)
 , _payloadEndIndex(0)
-, _getPayload(nullptr) {
+, _getPayload(nullptr)
+, _payload(nullptr)
+, _releasePayload(nullptr) {
   if (!_allocate(0, true)) {
     error = espMqttClientTypes::Error::OUT_OF_MEMORY;
     return;
@@ -308,7 +372,7 @@ Packet::Packet(espMqttClientTypes::Error& error, MQTTPacketType type)
 }
 
 
-bool Packet::_allocate(size_t remainingLength, bool check) {
+bool Packet::_allocate(size_t remainingLength, bool check, size_t external) {
   #if EMC_USE_MEMPOOL
   (void) check;
   #else
@@ -318,18 +382,19 @@ bool Packet::_allocate(size_t remainingLength, bool check) {
   }
   #endif
   _size = 1 + remainingLengthLength(remainingLength) + remainingLength;
+  size_t allocSize = _size - external;
   #if EMC_USE_MEMPOOL
-  _data = reinterpret_cast<uint8_t*>(_memPool.malloc(_size));
+  _data = reinterpret_cast<uint8_t*>(_memPool.malloc(allocSize));
   #else
-  _data = reinterpret_cast<uint8_t*>(malloc(_size));
+  _data = reinterpret_cast<uint8_t*>(malloc(allocSize));
   #endif
   if (!_data) {
+    emc_log_w("Alloc failed (l:%zu)", allocSize);
     _size = 0;
-    emc_log_w("Alloc failed (l:%zu)", _size);
     return false;
   }
-  emc_log_i("Alloc (l:%zu)", _size);
-  memset(_data, 0, _size);
+  emc_log_i("Alloc (l:%zu)", allocSize);
+  memset(_data, 0, allocSize);
   return true;
 }
 
@@ -36,6 +36,7 @@ class Packet {
   uint16_t packetId() const;
   MQTTPacketType packetType() const;
   bool removable() const;
+  bool chunked() const;
 
  protected:
   uint16_t _packetId;  // save as separate variable: will be accessed frequently
@@ -48,6 +49,10 @@ class Packet {
   size_t _payloadEndIndex;
   espMqttClientTypes::PayloadCallback _getPayload;
 
+  // payload that is not copied into _data
+  const uint8_t* _payload;
+  espMqttClientTypes::PayloadReleaseCallback _releasePayload;
+
   struct SubscribeItem {
     const char* topic;
     uint8_t qos;
@@ -81,6 +86,14 @@ class Packet {
          size_t payloadLength,
          uint8_t qos,
          bool retain);
+  Packet(espMqttClientTypes::Error& error,  // NOLINT(runtime/references)
+         uint16_t packetId,
+         const char* topic,
+         const uint8_t* payload,
+         size_t payloadLength,
+         uint8_t qos,
+         bool retain,
+         espMqttClientTypes::PayloadReleaseCallback releaseCallback);
   // SUBSCRIBE
   Packet(espMqttClientTypes::Error& error,  // NOLINT(runtime/references)
          uint16_t packetId,
@@ -100,7 +113,9 @@ class Packet {
   , _payloadIndex(0)
   , _payloadStartIndex(0)
   , _payloadEndIndex(0)
-  , _getPayload(nullptr) {
+  , _getPayload(nullptr)
+  , _payload(nullptr)
+  , _releasePayload(nullptr) {
     static_assert(sizeof...(Args) % 2 == 0, "Subscribe should be in topic/qos pairs");
     size_t numberTopics = 2 + (sizeof...(Args) / 2);
     SubscribeItem list[numberTopics] = {topic1, qos1, topic2, qos2, args...};
@@ -122,7 +137,9 @@ class Packet {
   , _payloadIndex(0)
   , _payloadStartIndex(0)
   , _payloadEndIndex(0)
-  , _getPayload(nullptr) {
+  , _getPayload(nullptr)
+  , _payload(nullptr)
+  , _releasePayload(nullptr) {
     size_t numberTopics = 2 + sizeof...(Args);
     const char* list[numberTopics] = {topic1, topic2, args...};
     _createUnsubscribe(error, list, numberTopics);
@@ -137,7 +154,8 @@ class Packet {
 
  private:
   // pass remainingLength = total size - header - remainingLengthLength!
-  bool _allocate(size_t remainingLength, bool check);
+  // the last 'external' bytes of the packet are not allocated
+  bool _allocate(size_t remainingLength, bool check, size_t external = 0);
 
   // fills header and returns index of next available byte in buffer
   size_t _fillPublishHeader(uint16_t packetId,
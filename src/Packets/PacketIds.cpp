@@ -0,0 +1,73 @@
+/*
+Copyright (c) 2022 Bert Melis. All rights reserved.
+
+This work is licensed under the terms of the MIT license.  
+For a copy, see <https://opensource.org/licenses/MIT> or
+the LICENSE file.
+*/
+
+#include "PacketIds.h"
+
+static_assert(EMC_MAX_PACKET_ID > 0 && EMC_MAX_PACKET_ID <= 65535, "EMC_MAX_PACKET_ID must be within 1 and 65535");
+
+namespace espMqttClientInternals {
+
+PacketIds::PacketIds()
+: _bitmap{0}
+, _last(0)
+, _used(0) {
+  reset();
+}
+
+uint16_t PacketIds::acquire() {
+  if (_used >= EMC_MAX_PACKET_ID) return 0;
+  uint32_t id = (_last < EMC_MAX_PACKET_ID) ? _last + 1u : 1u;
+  // there is at least one free id so this terminates within one round
+  while (true) {
+    size_t word = id >> 5;
+    uint32_t free = ~_bitmap[word] & (0xFFFFFFFFu << (id & 31));
+    if (free) {
+      id = (word << 5) + __builtin_ctz(free);
+      break;
+    }
+    id = (word + 1 < _nrWords) ? (word + 1) << 5 : 0;  // id 0 is never free
+  }
+  _bitmap[id >> 5] |= (1u << (id & 31));
+  ++_used;
+  _last = id;
+  return _last;
+}
+
+void PacketIds::mark(uint16_t id) {
+  if (!_valid(id) || inUse(id)) return;
+  _bitmap[id >> 5] |= (1u << (id & 31));
+  ++_used;
+}
+
+void PacketIds::release(uint16_t id) {
+  if (!_valid(id) || !inUse(id)) return;
+  _bitmap[id >> 5] &= ~(1u << (id & 31));
+  --_used;
+}
+
+bool PacketIds::inUse(uint16_t id) const {
+  if (!_valid(id)) return false;
+  return _bitmap[id >> 5] & (1u << (id & 31));
+}
+
+void PacketIds::reset() {
+  for (size_t i = 0; i < _nrWords; ++i) {
+    _bitmap[i] = 0;
+  }
+  // id 0 and ids beyond EMC_MAX_PACKET_ID are never handed out
+  _bitmap[0] = 1u;
+  uint32_t tail = (EMC_MAX_PACKET_ID + 1u) & 31;
+  if (tail) _bitmap[_nrWords - 1] |= 0xFFFFFFFFu << tail;
+  _used = 0;
+}
+
+size_t PacketIds::used() const {
+  return _used;
+}
+
+}  // end namespace espMqttClientInternals
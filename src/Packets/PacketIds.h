@@ -0,0 +1,58 @@
+/*
+Copyright (c) 2022 Bert Melis. All rights reserved.
+
+This work is licensed under the terms of the MIT license.  
+For a copy, see <https://opensource.org/licenses/MIT> or
+the LICENSE file.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "../Config.h"
+
+namespace espMqttClientInternals {
+
+/**
+ * @brief Packet id allocator backed by an in-use bitmap
+ *
+ * Ids are handed out in increasing order, wrapping from EMC_MAX_PACKET_ID back to 1,
+ * and ids that are still in use are skipped. Ids have to be released when the
+ * packet exchange they belong to is finished.
+ */
+
+class PacketIds {
+ public:
+  PacketIds();
+
+  // returns the next free id and marks it in use, returns 0 when all ids are in use
+  uint16_t acquire();
+
+  // marks id as in use, used to restore ids of packets kept in a session
+  void mark(uint16_t id);
+
+  void release(uint16_t id);
+  bool inUse(uint16_t id) const;
+
+  // releases all ids
+  void reset();
+
+  size_t used() const;
+
+ private:
+  static bool _valid(uint16_t id) {
+    #if EMC_MAX_PACKET_ID < 65535
+    return id != 0 && id <= EMC_MAX_PACKET_ID;
+    #else
+    return id != 0;
+    #endif
+  }
+  static const size_t _nrWords = EMC_MAX_PACKET_ID / 32 + 1;
+  uint32_t _bitmap[_nrWords];
+  uint16_t _last;
+  size_t _used;
+};
+
+}  // end namespace espMqttClientInternals
@@ -6,6 +6,9 @@ For a copy, see <https://opensource.org/licenses/MIT> or
 the LICENSE file.
 */
 
+#include <stdlib.h>  // malloc, free
+#include <string.h>  // memcpy
+
 #include "Parser.h"
 
 namespace espMqttClientInternals {
@@ -28,6 +31,7 @@ bool IncomingPacket::dup() const {
 void IncomingPacket::reset() {
   fixedHeader.packetType = 0;
   variableHeader.topicLength = 0;
+  variableHeader.topic = "";
   variableHeader.fixed.packetId = 0;
   payload.index = 0;
   payload.length = 0;
@@ -40,27 +44,71 @@ Parser::Parser()
 , _bytePos(0)
 , _parse(_fixedHeader)
 , _packet()
-, _payloadBuffer{0} {
+, _payloadBuffer{0}
+, _topicBuffer(nullptr)
+, _topicBufferSize(0) {
   // empty
 }
 
+Parser::~Parser() {
+  free(_topicBuffer);
+}
+
 ParserResult Parser::parse(const uint8_t* data, size_t len, size_t* bytesRead) {
   _data = data;
   _len = len;
   _bytesRead = 0;
   ParserResult result = ParserResult::awaitData;
   while (result == ParserResult::awaitData && _bytesRead < _len) {
+    if (_parse == _fixedHeader && _publishHeader(&result)) continue;
     result = _parse(this);
     ++_bytesRead;
   }
+  // the topic view points into data which is gone by the next call, keep a copy when the packet isn't finished
+  if (result != ParserResult::protocolError && _parse != _fixedHeader && _topicIsView() && !topic()) {
+    emc_log_e("Could not copy topic");
+    _parse = _fixedHeader;
+    result = ParserResult::protocolError;
+  }
   (*bytesRead) += _bytesRead;
   return result;
 }
 
+bool Parser::ready(const uint8_t* data, size_t len, size_t bufferSize) const {
+  if (_parse != _fixedHeader || len == 0) return true;
+  size_t pos = 1;
+  size_t remainingLength = 0;
+  size_t multiplier = 1;
+  do {
+    if (pos == 5) return true;  // invalid, let the parser report it
+    if (pos == len) return false;
+    remainingLength += (data[pos] & 0x7F) * multiplier;
+    multiplier *= 128;
+  } while (data[pos++] & 0x80);
+
+  size_t needed = pos + remainingLength;
+  if (needed > bufferSize && (data[0] & 0xF0) == PacketType.PUBLISH) {
+    // packet will be delivered in parts: only wait for the header
+    if (len < pos + 2) return false;
+    needed = pos + 2 + ((data[pos] << 8) | data[pos + 1]) + ((data[0] & 0x06) ? 2 : 0);
+  }
+  return needed <= len || needed > bufferSize;
+}
+
 const IncomingPacket& Parser::getPacket() const {
   return _packet;
 }
 
+const char* Parser::topic() {
+  if (_topicIsView()) {
+    if (!_reserveTopic(_packet.variableHeader.topicLength)) return nullptr;
+    memcpy(_topicBuffer, _packet.variableHeader.topic, _packet.variableHeader.topicLength);
+    _topicBuffer[_packet.variableHeader.topicLength] = 0x00;
+    _packet.variableHeader.topic = _topicBuffer;
+  }
+  return _packet.variableHeader.topic;
+}
+
 void Parser::reset() {
   _parse = _fixedHeader;
   _bytesRead = 0;
@@ -68,6 +116,77 @@ void Parser::reset() {
   _packet.reset();
 }
 
+// Make sure the topic buffer can hold a topic of the given length and its c-string delimiter.
+// The buffer is kept for later packets and only grows.
+bool Parser::_reserveTopic(size_t length) {
+  if (length < _topicBufferSize) return true;
+  size_t size = std::max(length, static_cast<size_t>(EMC_MAX_TOPIC_LENGTH)) + 1;
+  char* buffer = reinterpret_cast<char*>(malloc(size));
+  if (!buffer) return false;
+  free(_topicBuffer);
+  _topicBuffer = buffer;
+  _topicBufferSize = size;
+  return true;
+}
+
+bool Parser::_topicIsView() const {
+  return _packet.variableHeader.topicLength > 0 && _packet.variableHeader.topic != _topicBuffer;
+}
+
+// Fast path for a PUBLISH packet of which the complete header is available.
+// Returns false to fall back to the bytewise parser, which also handles all errors.
+bool Parser::_publishHeader(ParserResult* result) {
+  const uint8_t* data = &_data[_bytesRead];
+  size_t available = _len - _bytesRead;
+  uint8_t header = data[0];
+  if ((header & 0xF0) != PacketType.PUBLISH) return false;
+  uint8_t headerFlags = header & 0x0F;
+  if (headerFlags > 0x05 && headerFlags < 0x0A) return false;
+  uint8_t qos = (header & 0x06) >> 1;
+
+  size_t pos = 1;
+  size_t remainingLength = 0;
+  size_t multiplier = 1;
+  do {
+    if (pos == available || pos == 5) return false;
+    remainingLength += (data[pos] & 0x7F) * multiplier;
+    multiplier *= 128;
+  } while (data[pos++] & 0x80);
+
+  size_t idLength = (qos > 0) ? 2 : 0;
+  if (available < pos + 2) return false;
+  uint16_t topicLength = (data[pos] << 8) | data[pos + 1];
+  pos += 2;
+  // zero length topics are left to the bytewise parser
+  if (topicLength == 0) return false;
+  if (2 + topicLength + idLength > remainingLength) return false;
+  if (available < pos + topicLength + idLength) return false;
+  uint16_t packetId = 0;
+  if (qos > 0) {
+    packetId = (data[pos + topicLength] << 8) | data[pos + topicLength + 1];
+    if (packetId == 0) return false;
+  }
+
+  _packet.reset();
+  _packet.fixedHeader.packetType = header;
+  _packet.fixedHeader.remainingLength.remainingLength = remainingLength;
+  _packet.variableHeader.topicLength = topicLength;
+  _packet.variableHeader.topic = reinterpret_cast<const char*>(&data[pos]);
+  _packet.variableHeader.fixed.packetId = packetId;
+  _packet.payload.total = remainingLength - 2 - topicLength - idLength;
+  _bytesRead += pos + topicLength + idLength;
+  emc_log_i("Packet type: 0x%02x, remaining length: %zu", header, remainingLength);
+
+  if (_packet.payload.total == 0) {
+    _parse = _fixedHeader;
+    *result = ParserResult::packet;
+  } else {
+    _parse = _payloadPublish;
+    *result = ParserResult::awaitData;
+  }
+  return true;
+}
+
 ParserResult Parser::_fixedHeader(Parser* p) {
   p->_packet.reset();
   p->_packet.fixedHeader.packetType = p->_data[p->_bytesRead];
@@ -254,9 +373,23 @@ ParserResult Parser::_varHeaderTopicLength2(Parser* p) {
     - 2  // topic length bytes
     - ((p->_packet.fixedHeader.packetType & (HeaderFlag.PUBLISH_QOS1 | HeaderFlag.PUBLISH_QOS2)) ? 2 : 0);
   if (p->_packet.variableHeader.topicLength <= maxTopicLength) {
+    p->_packet.payload.total = p->_packet.fixedHeader.remainingLength.remainingLength - 2 - p->_packet.variableHeader.topicLength;
+    // point into the data when the complete topic is available, copy otherwise
+    if (p->_len - p->_bytesRead - 1 >= p->_packet.variableHeader.topicLength) {
+      if (p->_packet.variableHeader.topicLength > 0) {
+        p->_packet.variableHeader.topic = reinterpret_cast<const char*>(&p->_data[p->_bytesRead + 1]);
+      }
+      p->_bytesRead += p->_packet.variableHeader.topicLength;
+      return _varHeaderTopicComplete(p);
+    }
+    if (!p->_reserveTopic(p->_packet.variableHeader.topicLength)) {
+      emc_log_e("Could not allocate topic");
+      p->_parse = _fixedHeader;
+      return ParserResult::protocolError;
+    }
+    p->_packet.variableHeader.topic = p->_topicBuffer;
     p->_parse = _varHeaderTopic;
     p->_bytePos = 0;
-    p->_packet.payload.total = p->_packet.fixedHeader.remainingLength.remainingLength - 2 - p->_packet.variableHeader.topicLength;
     return ParserResult::awaitData;
   }
   emc_log_w("Invalid topic length: %u > %zu", p->_packet.variableHeader.topicLength, maxTopicLength);
@@ -266,19 +399,26 @@ ParserResult Parser::_varHeaderTopicLength2(Parser* p) {
 
 ParserResult Parser::_varHeaderTopic(Parser* p) {
   // no checking for character [MQTT-3.3.2-1] [MQTT-3.3.2-2]
-  p->_packet.variableHeader.topic[p->_bytePos] = static_cast<char>(p->_data[p->_bytesRead]);
-  p->_bytePos++;
-  if (p->_bytePos == p->_packet.variableHeader.topicLength || p->_bytePos == EMC_MAX_TOPIC_LENGTH) {
-    p->_packet.variableHeader.topic[p->_bytePos] = 0x00;  // add c-string delimiter
-    emc_log_i("Packet variable header topic complete");
-    if (p->_packet.fixedHeader.packetType & (HeaderFlag.PUBLISH_QOS1 | HeaderFlag.PUBLISH_QOS2)) {
-      p->_parse = _varHeaderPacketId1;
-    } else if (p->_packet.payload.total == 0) {
-      p->_parse = _fixedHeader;
-      return ParserResult::packet;
-    } else {
-      p->_parse = _payloadPublish;
-    }
+  size_t length = std::min(p->_len - p->_bytesRead, p->_packet.variableHeader.topicLength - p->_bytePos);
+  memcpy(&p->_topicBuffer[p->_bytePos], &p->_data[p->_bytesRead], length);
+  p->_bytePos += length;
+  p->_bytesRead += length - 1;  // compensate for increment in _parse-loop
+  if (p->_bytePos == p->_packet.variableHeader.topicLength) {
+    p->_topicBuffer[p->_bytePos] = 0x00;  // add c-string delimiter
+    return _varHeaderTopicComplete(p);
+  }
+  return ParserResult::awaitData;
+}
+
+ParserResult Parser::_varHeaderTopicComplete(Parser* p) {
+  emc_log_i("Packet variable header topic complete");
+  if (p->_packet.fixedHeader.packetType & (HeaderFlag.PUBLISH_QOS1 | HeaderFlag.PUBLISH_QOS2)) {
+    p->_parse = _varHeaderPacketId1;
+  } else if (p->_packet.payload.total == 0) {
+    p->_parse = _fixedHeader;
+    return ParserResult::packet;
+  } else {
+    p->_parse = _payloadPublish;
   }
   return ParserResult::awaitData;
 }
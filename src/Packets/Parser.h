@@ -29,7 +29,7 @@ struct IncomingPacket {
   } fixedHeader;
   struct __attribute__((__packed__)) {
     uint16_t topicLength;
-    char topic[EMC_MAX_TOPIC_LENGTH + 1];  // + 1 for c-string delimiter
+    const char* topic;  // not null-terminated unless empty, see Parser::topic()
     union {
       struct {
         uint8_t sessionPresent;
@@ -63,8 +63,13 @@ typedef ParserResult(*ParserFunc)(Parser*);
 class Parser {
  public:
   Parser();
+  ~Parser();
   ParserResult parse(const uint8_t* data, size_t len, size_t* bytesRead);
+  // false when more data should be collected first, to parse the next packet (or its header when the packet is larger than bufferSize) in one pass
+  bool ready(const uint8_t* data, size_t len, size_t bufferSize) const;
   const IncomingPacket& getPacket() const;
+  // null-terminated copy of the topic of the current packet, nullptr when out of memory
+  const char* topic();
   void reset();
 
  private:
@@ -76,6 +81,12 @@ class Parser {
   ParserFunc _parse;
   IncomingPacket _packet;
   uint8_t _payloadBuffer[EMC_PAYLOAD_BUFFER_SIZE];
+  char* _topicBuffer;
+  size_t _topicBufferSize;
+
+  bool _publishHeader(ParserResult* result);
+  bool _reserveTopic(size_t length);
+  bool _topicIsView() const;
 
   static ParserResult _fixedHeader(Parser* p);
   static ParserResult _remainingLengthFixed(Parser* p);
@@ -92,6 +103,7 @@ class Parser {
   static ParserResult _varHeaderTopicLength1(Parser* p);
   static ParserResult _varHeaderTopicLength2(Parser* p);
   static ParserResult _varHeaderTopic(Parser* p);
+  static ParserResult _varHeaderTopicComplete(Parser* p);
 
   static ParserResult _payloadSuback(Parser* p);
   static ParserResult _payloadPublish(Parser* p);
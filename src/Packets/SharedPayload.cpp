@@ -0,0 +1,48 @@
+/*
+Copyright (c) 2022 Bert Melis. All rights reserved.
+
+This work is licensed under the terms of the MIT license.  
+For a copy, see <https://opensource.org/licenses/MIT> or
+the LICENSE file.
+*/
+
+#include <stdlib.h>  // malloc, free
+#include <string.h>  // memcpy
+
+#include "SharedPayload.h"
+#include "../Logging.h"
+
+namespace espMqttClientInternals {
+
+SharedPayload* SharedPayload::create(const uint8_t* payload, size_t length) {
+  void* buf = malloc(sizeof(SharedPayload) + length);
+  if (!buf) {
+    emc_log_w("Alloc failed (l:%zu)", length);
+    return nullptr;
+  }
+  SharedPayload* shared = reinterpret_cast<SharedPayload*>(buf);
+  shared->_references = 1;
+  shared->_length = length;
+  if (length > 0) memcpy(shared + 1, payload, length);
+  return shared;
+}
+
+const uint8_t* SharedPayload::data() const {
+  return reinterpret_cast<const uint8_t*>(this + 1);
+}
+
+size_t SharedPayload::length() const {
+  return _length;
+}
+
+void SharedPayload::retain() {
+  ++_references;
+}
+
+void SharedPayload::release() {
+  if (--_references == 0) {
+    free(this);
+  }
+}
+
+}  // end namespace espMqttClientInternals
@@ -0,0 +1,40 @@
+/*
+Copyright (c) 2022 Bert Melis. All rights reserved.
+
+This work is licensed under the terms of the MIT license.  
+For a copy, see <https://opensource.org/licenses/MIT> or
+the LICENSE file.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace espMqttClientInternals {
+
+/**
+ * @brief Reference counted copy of a payload, shared by multiple packets
+ *
+ * The payload is stored in the same allocation as the counter.
+ * Not thread safe: use it under the client's lock.
+ */
+
+class SharedPayload {
+ public:
+  // copies payload, the returned object has a reference count of 1
+  // returns nullptr when out of memory
+  static SharedPayload* create(const uint8_t* payload, size_t length);
+
+  const uint8_t* data() const;
+  size_t length() const;
+  void retain();
+  void release();  // frees memory when the last reference is released
+
+ private:
+  SharedPayload() = default;
+  size_t _references;
+  size_t _length;
+};
+
+}  // end namespace espMqttClientInternals
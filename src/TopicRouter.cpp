@@ -0,0 +1,242 @@
+/*
+Copyright (c) 2022 Bert Melis. All rights reserved.
+
+This work is licensed under the terms of the MIT license.  
+For a copy, see <https://opensource.org/licenses/MIT> or
+the LICENSE file.
+*/
+
+#include <stdlib.h>  // malloc, free
+#include <string.h>  // memcpy, memcmp, memchr, strlen
+#include <new>  // std::nothrow
+
+#include "TopicRouter.h"
+#include "Logging.h"
+
+namespace espMqttClientInternals {
+
+TopicRouter::TopicRouter()
+: _root()
+, _index{nullptr}
+, _sweep(nullptr)
+, _nodes(0)
+, _dispatching(0) {
+  // empty
+}
+
+TopicRouter::~TopicRouter() {
+  // all nodes except the root are in the index
+  for (size_t i = 0; i < EMC_ROUTER_INDEX_SIZE; ++i) {
+    Node* node = _index[i];
+    while (node) {
+      Node* n = node->nextInIndex;
+      _free(node);
+      node = n;
+    }
+  }
+}
+
+TopicRouter::Route* TopicRouter::add(const char* filter, espMqttClientTypes::OnMessageCallback callback) {
+  // check the whole filter first, so an invalid one doesn't leave empty nodes behind
+  if (!_valid(filter) || !callback) return nullptr;
+  Node* node = &_root;
+  const char* level = filter;
+  while (true) {
+    const char* end = strchr(level, '/');
+    size_t length = end ? end - level : strlen(level);
+    node = _child(node, level, length);
+    if (!node) return nullptr;
+    if (!end) break;
+    level = end + 1;
+  }
+  Route* route = new(std::nothrow) Route{callback, node->routes, nullptr, {false}};
+  if (!route) {
+    _prune(node);
+    return nullptr;
+  }
+  node->routes = route;
+  return route;
+}
+
+void TopicRouter::remove(const char* filter, Route* route) {
+  Node* node = _findFilter(filter);
+  if (!node) return;
+  for (Route* r = node->routes; r; r = r->next) {
+    if (!route || r == route) r->removed = true;
+  }
+  if (_dispatching > 0) {
+    if (!node->sweep) {
+      node->sweep = true;
+      node->nextSweep = _sweep;
+      _sweep = node;
+    }
+    return;
+  }
+  _purge(node);
+}
+
+TopicRouter::Route* TopicRouter::match(const char* topic, size_t length) {
+  ++_dispatching;
+  Route* matches = nullptr;
+  _match(&_root, topic, topic + length, true, &matches);
+  return matches;
+}
+
+size_t TopicRouter::size() const {
+  return _nodes;
+}
+
+void TopicRouter::release() {
+  if (_dispatching == 0 || --_dispatching > 0) return;
+  while (_sweep) {
+    Node* node = _sweep;
+    _sweep = node->nextSweep;
+    node->sweep = false;
+    _purge(node);
+  }
+}
+
+uint32_t TopicRouter::_hash(const Node* parent, const char* level, size_t length) {
+  // FNV-1a over the level, mixed with the parent
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < length; ++i) {
+    hash ^= static_cast<uint8_t>(level[i]);
+    hash *= 16777619u;
+  }
+  return hash ^ (static_cast<uint32_t>(reinterpret_cast<uintptr_t>(parent)) * 2654435761u);
+}
+
+// wildcards take a whole level and '#' has to be the last level [MQTT-4.7.1-2] [MQTT-4.7.1-3]
+bool TopicRouter::_valid(const char* filter) {
+  if (!filter || filter[0] == 0) return false;
+  const char* level = filter;
+  while (true) {
+    const char* end = strchr(level, '/');
+    size_t length = end ? end - level : strlen(level);
+    if (length > UINT16_MAX) return false;
+    if (memchr(level, '#', length) && (length != 1 || end)) return false;
+    if (memchr(level, '+', length) && length != 1) return false;
+    if (!end) return true;
+    level = end + 1;
+  }
+}
+
+TopicRouter::Node* TopicRouter::_find(const Node* parent, const char* level, size_t length) const {
+  uint32_t hash = _hash(parent, level, length);
+  for (Node* n = _index[hash % EMC_ROUTER_INDEX_SIZE]; n; n = n->nextInIndex) {
+    if (n->hash == hash && n->parent == parent && n->length == length && memcmp(n->level(), level, length) == 0) {
+      return n;
+    }
+  }
+  return nullptr;
+}
+
+TopicRouter::Node* TopicRouter::_findFilter(const char* filter) const {
+  if (!filter || filter[0] == 0) return nullptr;
+  const Node* node = &_root;
+  const char* level = filter;
+  while (node) {
+    const char* end = strchr(level, '/');
+    node = _find(node, level, end ? end - level : strlen(level));
+    if (!end) break;
+    level = end + 1;
+  }
+  return const_cast<Node*>(node);
+}
+
+TopicRouter::Node* TopicRouter::_child(Node* parent, const char* level, size_t length) {
+  Node* node = _find(parent, level, length);
+  if (node) return node;
+  node = reinterpret_cast<Node*>(malloc(sizeof(Node) + length));
+  if (!node) {
+    emc_log_w("Alloc failed (l:%zu)", length);
+    _prune(parent);
+    return nullptr;
+  }
+  memset(node, 0, sizeof(Node));
+  memcpy(node + 1, level, length);
+  node->parent = parent;
+  node->hash = _hash(parent, level, length);
+  node->length = length;
+  Node*& bucket = _index[node->hash % EMC_ROUTER_INDEX_SIZE];
+  node->nextInIndex = bucket;
+  bucket = node;
+  if (length == 1 && level[0] == '+') {
+    parent->plus = node;
+  } else if (length == 1 && level[0] == '#') {
+    parent->multi = node;
+  }
+  ++parent->children;
+  ++_nodes;
+  return node;
+}
+
+// level points to the next topic level to match, or is nullptr when all levels are matched
+void TopicRouter::_match(Node* node, const char* level, const char* end, bool first, Route** matches) {
+  // wildcards don't match topics starting with '$' [MQTT-4.7.2-1]
+  bool wildcards = !(first && level && level < end && level[0] == '$');
+  // '#' also matches the parent level [MQTT-4.7.1-2]
+  if (node->multi && wildcards) _collect(node->multi, matches);
+  if (!level) {
+    _collect(node, matches);
+    return;
+  }
+  const char* separator = reinterpret_cast<const char*>(memchr(level, '/', end - level));
+  size_t length = (separator ? separator : end) - level;
+  const char* next = separator ? separator + 1 : nullptr;
+  Node* child = _find(node, level, length);
+  if (child && child != node->plus && child != node->multi) _match(child, next, end, false, matches);
+  if (node->plus && wildcards) _match(node->plus, next, end, false, matches);
+}
+
+void TopicRouter::_collect(Node* node, Route** matches) {
+  for (Route* r = node->routes; r; r = r->next) {
+    if (r->removed) continue;
+    r->nextMatch = *matches;
+    *matches = r;
+  }
+}
+
+// free removed routes of a node
+void TopicRouter::_purge(Node* node) {
+  Route** r = &node->routes;
+  while (*r) {
+    if ((*r)->removed) {
+      Route* route = *r;
+      *r = route->next;
+      delete route;
+    } else {
+      r = &(*r)->next;
+    }
+  }
+  _prune(node);
+}
+
+// free a node and its unused parents
+void TopicRouter::_prune(Node* node) {
+  while (node != &_root && !node->routes && node->children == 0 && !node->sweep) {
+    Node* parent = node->parent;
+    Node** n = &_index[node->hash % EMC_ROUTER_INDEX_SIZE];
+    while (*n && *n != node) {
+      n = &(*n)->nextInIndex;
+    }
+    if (*n) *n = node->nextInIndex;
+    if (parent->plus == node) parent->plus = nullptr;
+    if (parent->multi == node) parent->multi = nullptr;
+    --parent->children;
+    --_nodes;
+    _free(node);
+    node = parent;
+  }
+}
+
+void TopicRouter::_free(Node* node) {
+  while (node->routes) {
+    Route* r = node->routes;
+    node->routes = r->next;
+    delete r;
+  }
+  free(node);
+}
+
+}  // end namespace espMqttClientInternals
@@ -0,0 +1,88 @@
+/*
+Copyright (c) 2022 Bert Melis. All rights reserved.
+
+This work is licensed under the terms of the MIT license.  
+For a copy, see <https://opensource.org/licenses/MIT> or
+the LICENSE file.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <atomic>
+
+#include "Config.h"
+#include "TypeDefs.h"
+
+namespace espMqttClientInternals {
+
+/**
+ * @brief Trie of topic filters, one level per node, with message callbacks
+ *
+ * Exact levels are looked up in a fixed-size hash index keyed on the parent node
+ * and the level, '+' and '#' levels are kept as separate children of their parent.
+ * Matching a topic therefore costs one lookup per topic level, regardless of the
+ * number of filters.
+ *
+ * Routes returned by `match` stay valid until `release`: routes removed in between
+ * are only flagged and freed afterwards.
+ * Not thread safe: use it under the client's lock.
+ */
+
+class TopicRouter {
+ public:
+  struct Route {
+    espMqttClientTypes::OnMessageCallback callback;
+    Route* next;
+    Route* nextMatch;
+    std::atomic<bool> removed;  // written under the lock, read by the dispatcher after it gave the lock up
+  };
+
+  TopicRouter();
+  ~TopicRouter();
+
+  // returns nullptr when out of memory or when the filter is invalid, the router is unchanged then
+  Route* add(const char* filter, espMqttClientTypes::OnMessageCallback callback);
+  // remove a route of filter or, when route is nullptr, all routes of filter
+  void remove(const char* filter, Route* route = nullptr);
+  // returns the routes matching topic, linked with nextMatch
+  Route* match(const char* topic, size_t length);
+  void release();
+  // number of nodes, not counting the root
+  size_t size() const;
+
+ private:
+  struct Node {
+    Node* parent;
+    Node* nextInIndex;
+    Node* nextSweep;
+    Node* plus;   // '+' child
+    Node* multi;  // '#' child
+    Route* routes;
+    uint32_t hash;
+    uint16_t children;
+    uint16_t length;
+    bool sweep;
+    const char* level() const { return reinterpret_cast<const char*>(this + 1); }
+  };
+  Node _root;
+  Node* _index[EMC_ROUTER_INDEX_SIZE];
+  Node* _sweep;
+  size_t _nodes;
+  uint8_t _dispatching;
+
+  static uint32_t _hash(const Node* parent, const char* level, size_t length);
+  static bool _valid(const char* filter);
+  Node* _find(const Node* parent, const char* level, size_t length) const;
+  Node* _findFilter(const char* filter) const;
+  Node* _child(Node* parent, const char* level, size_t length);
+  void _match(Node* node, const char* level, const char* end, bool first, Route** matches);
+  void _collect(Node* node, Route** matches);
+  void _purge(Node* node);
+  void _prune(Node* node);
+  void _free(Node* node);
+};
+
+}  // end namespace espMqttClientInternals
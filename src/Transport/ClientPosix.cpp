@@ -14,7 +14,23 @@ namespace espMqttClientInternals {
 
 ClientPosix::ClientPosix()
 : _sockfd(-1)
-, _host() {
+, _port(0)
+, _pollFd(-1)
+, _timerFd(-1)
+, _resolveFd(-1)
+, _resolution()
+, _resolver()
+, _addresses()
+, _nextAddress(0)
+, _connects{0}
+, _connectAddress{0}
+, _numberConnects(0)
+, _cacheHostname()
+, _cache()
+, _cacheTime()
+, _fastOpen(false)
+, _fastOpenPending(false)
+, _stats{0, 0, 0, 0, 0, false, false, false} {
   // empty
 }
 
@@ -22,55 +38,108 @@ ClientPosix::~ClientPosix() {
   ClientPosix::stop();
 }
 
+// start a non-blocking connect, connected() reports when it completes
 bool ClientPosix::connect(IPAddress ip, uint16_t port) {
-  if (connected()) stop();
+  stop();
+  _port = port;
+  _cacheHostname.clear();
+  _cache.clear();
 
-  _sockfd = ::socket(AF_INET, SOCK_STREAM, 0);
-  if (_sockfd < 0) {
-    emc_log_e("Error %d: \"%s\" opening socket", errno, strerror(errno));
-  }
-
-  int flag = 1;
-  if (setsockopt(_sockfd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(int)) < 0) {
-    emc_log_e("Error %d: \"%s\" disabling nagle", errno, strerror(errno));
-  }
+  Address address;
+  memset(&address, 0, sizeof(address));
+  sockaddr_in* host = reinterpret_cast<sockaddr_in*>(&address.address);
+  host->sin_family = AF_INET;
+  host->sin_addr.s_addr = htonl(static_cast<uint32_t>(ip));
+  address.length = sizeof(sockaddr_in);
+  _addresses.assign(1, address);
+  return _startConnecting();
+}
 
-  memset(&_host, 0, sizeof(_host));
-  _host.sin_family = AF_INET;
-  _host.sin_addr.s_addr = htonl(static_cast<uint32_t>(ip));
-  _host.sin_port = ::htons(port);
+// use the cached addresses or start resolving the hostname in a separate thread
+bool ClientPosix::connect(const char* hostname, uint16_t port) {
+  stop();
+  _port = port;
 
-  int ret = ::connect(_sockfd, reinterpret_cast<sockaddr*>(&_host), sizeof(_host));
+  if (EMC_POSIX_DNS_CACHE_TIME > 0 && !_cache.empty() && _cacheHostname == hostname &&
+      std::chrono::steady_clock::now() - _cacheTime < std::chrono::milliseconds(EMC_POSIX_DNS_CACHE_TIME)) {
+    emc_log_i("Using cached addresses for '%s'", hostname);
+    _addresses = _cache;
+    return _startConnecting();
+  }
+  _cacheHostname = hostname;
+  _cache.clear();
 
-  if (ret < 0) {
-    emc_log_e("Error connecting: %d - (%d) %s", ret, errno, strerror(errno));
+  if (!_openPoll()) return false;
+  int fds[2];
+  if (::pipe2(fds, O_CLOEXEC) < 0) {
+    emc_log_e("Error %d: \"%s\" opening pipe", errno, strerror(errno));
+    _closePoll();
     return false;
   }
-
-  emc_log_i("Socket connected");
+  _resolveFd = fds[0];
+  epoll_event event;
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN;
+  event.data.fd = _resolveFd;
+  epoll_ctl(_pollFd, EPOLL_CTL_ADD, _resolveFd, &event);
+  _resolution = std::make_shared<Resolution>();
+  _resolution->hostname = hostname;
+  _resolution->done = false;
+  _resolution->fd = fds[1];
+  std::shared_ptr<Resolution> resolution = _resolution;
+  _resolver = std::thread([resolution] {
+    resolution->addresses = _resolve(resolution->hostname.c_str());
+    resolution->done = true;
+    ::close(resolution->fd);
+  });
   return true;
 }
 
-bool ClientPosix::connect(const char* hostname, uint16_t port) {
-  IPAddress ipAddress = _hostToIP(hostname);
-  if (ipAddress == IPAddress(0)) {
-    emc_log_e("No such host '%s'", hostname);
-    return false;
+size_t ClientPosix::write(const uint8_t* buf, size_t size) {
+  ssize_t ret = ::send(_sockfd, buf, size, _fastOpenPending ? MSG_DONTWAIT : 0);
+  if (ret < 0) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+      emc_log_e("Error %d: \"%s\" writing", errno, strerror(errno));
+    }
+    return 0;
   }
-  return connect(ipAddress, port);
+  return ret;
 }
 
-size_t ClientPosix::write(const uint8_t* buf, size_t size) {
-  return ::send(_sockfd, buf, size, 0);
+size_t ClientPosix::writev(const WriteBuffer* buffers, size_t count) {
+  // a short write is allowed, so surplus buffers are simply left for the next call
+  iovec iov[EMC_TX_MAX_GATHER];
+  if (count > EMC_TX_MAX_GATHER) count = EMC_TX_MAX_GATHER;
+  for (size_t i = 0; i < count; ++i) {
+    iov[i].iov_base = const_cast<uint8_t*>(buffers[i].data);
+    iov[i].iov_len = buffers[i].size;
+  }
+  msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = count;
+  ssize_t ret = ::sendmsg(_sockfd, &msg, _fastOpenPending ? MSG_DONTWAIT : 0);
+  if (ret < 0) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+      emc_log_e("Error %d: \"%s\" writing", errno, strerror(errno));
+    }
+    return 0;
+  }
+  return ret;
 }
 
 int ClientPosix::read(uint8_t* buf, size_t size) {
   int ret = ::recv(_sockfd, buf, size, MSG_DONTWAIT);
-  /*
-  if (ret < 0) {
-    emc_log_e("Error reading: %s", strerror(errno));
+  // the server answered, so the handshake is done
+  if (ret > 0 && _fastOpenPending) _checkFastOpen();
+  // close on end of stream or error so the socket doesn't keep polling readable
+  if (ret == 0 && size > 0) {
+    emc_log_i("Connection closed by peer");
+    stop();
+  } else if (ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+    emc_log_e("Error %d: \"%s\" reading", errno, strerror(errno));
+    stop();
   }
-  */
   return ret;
 }
 
@@ -79,50 +148,271 @@ void ClientPosix::stop() {
     ::close(_sockfd);
     _sockfd = -1;
   }
+  _fastOpenPending = false;
+  while (_numberConnects > 0) {
+    _closeConnect(_numberConnects - 1, true);
+  }
+  if (_resolution) {
+    // getaddrinfo can't be cancelled, the thread finishes on its own
+    if (_resolution->done) {
+      _resolver.join();
+    } else {
+      _resolver.detach();
+    }
+    _resolution.reset();
+    ::close(_resolveFd);
+    _resolveFd = -1;
+  }
+  _closePoll();
 }
 
 bool ClientPosix::connected() {
+  if (_resolution && !_checkResolved()) return false;
+  if (_numberConnects > 0) return _checkConnects();
   return _sockfd >= 0;
 }
 
 bool ClientPosix::disconnected() {
-  return _sockfd < 0;
+  return _sockfd < 0 && !_resolution && _numberConnects == 0;
+}
+
+int ClientPosix::fd() {
+  if (_pollFd >= 0) return _pollFd;
+  return _sockfd;
 }
 
-IPAddress ClientPosix::_hostToIP(const char* hostname) {
-  IPAddress returnIP(0);
+void ClientPosix::setFastOpen(bool enabled) {
+  _fastOpen = enabled;
+}
+
+espMqttClientTypes::ConnectionStats ClientPosix::getConnectionStats() const {
+  return _stats;
+}
+
+bool ClientPosix::_openPoll() {
+  _pollFd = epoll_create1(EPOLL_CLOEXEC);
+  _timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (_pollFd < 0 || _timerFd < 0) {
+    emc_log_e("Error %d: \"%s\" opening epoll", errno, strerror(errno));
+    _closePoll();
+    return false;
+  }
+  epoll_event event;
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN;
+  event.data.fd = _timerFd;
+  epoll_ctl(_pollFd, EPOLL_CTL_ADD, _timerFd, &event);
+  return true;
+}
+
+void ClientPosix::_closePoll() {
+  if (_timerFd >= 0) ::close(_timerFd);
+  if (_pollFd >= 0) ::close(_pollFd);
+  _timerFd = -1;
+  _pollFd = -1;
+}
+
+// connect to _addresses, starting with the first
+bool ClientPosix::_startConnecting() {
+  if (_pollFd < 0 && !_openPoll()) return false;
+  _nextAddress = 0;
+  if (!_startNextConnect()) {
+    emc_log_e("Could not connect to any address");
+    _closePoll();
+    return false;
+  }
+  return true;
+}
+
+// start connecting to the next address, addresses that fail right away are skipped
+// with a connect delay, the next address is started when the delay timer expires
+bool ClientPosix::_startNextConnect() {
+  while (_nextAddress < _addresses.size() && _numberConnects < EMC_POSIX_MAX_CONNECTS) {
+    size_t index = _nextAddress++;
+    Address& address = _addresses[index];
+    if (address.address.ss_family == AF_INET6) {
+      reinterpret_cast<sockaddr_in6*>(&address.address)->sin6_port = htons(_port);
+    } else {
+      reinterpret_cast<sockaddr_in*>(&address.address)->sin_port = htons(_port);
+    }
+    int sockfd = ::socket(address.address.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sockfd < 0) {
+      emc_log_e("Error %d: \"%s\" opening socket", errno, strerror(errno));
+      continue;
+    }
+    int flag = 1;
+    if (setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(int)) < 0) {
+      emc_log_e("Error %d: \"%s\" disabling nagle", errno, strerror(errno));
+    }
+    // with a cookie from a previous connection, connect() returns right away and the SYN is sent with the first write
+    // without, a normal connect is made that asks the server for a cookie
+    if (_fastOpen && setsockopt(sockfd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &flag, sizeof(int)) < 0) {
+      emc_log_w("Error %d: \"%s\" enabling fast open", errno, strerror(errno));
+    }
+    if (::connect(sockfd, reinterpret_cast<sockaddr*>(&address.address), address.length) < 0 && errno != EINPROGRESS) {
+      emc_log_e("Error connecting to address %zu: (%d) %s", index, errno, strerror(errno));
+      ::close(sockfd);
+      continue;
+    }
+    epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLOUT;
+    event.data.fd = sockfd;
+    epoll_ctl(_pollFd, EPOLL_CTL_ADD, sockfd, &event);
+    _connects[_numberConnects] = sockfd;
+    _connectAddress[_numberConnects] = index;
+    ++_numberConnects;
+    emc_log_i("Connecting to address %zu", index);
+    if (EMC_POSIX_CONNECT_DELAY > 0) {
+      itimerspec delay;
+      memset(&delay, 0, sizeof(delay));
+      delay.it_value.tv_sec = EMC_POSIX_CONNECT_DELAY / 1000;
+      delay.it_value.tv_nsec = (EMC_POSIX_CONNECT_DELAY % 1000) * 1000000L;
+      timerfd_settime(_timerFd, 0, &delay, nullptr);
+      break;
+    }
+  }
+  return _numberConnects > 0;
+}
+
+// remove a pending connect, keeping the order of the others
+void ClientPosix::_closeConnect(size_t index, bool closeSocket) {
+  if (closeSocket) {
+    ::close(_connects[index]);  // also removes it from epoll
+  } else {
+    epoll_ctl(_pollFd, EPOLL_CTL_DEL, _connects[index], nullptr);
+  }
+  for (size_t i = index + 1; i < _numberConnects; ++i) {
+    _connects[i - 1] = _connects[i];
+    _connectAddress[i - 1] = _connectAddress[i];
+  }
+  --_numberConnects;
+}
+
+// start connecting when the hostname has been resolved, false while resolving or when resolving failed
+bool ClientPosix::_checkResolved() {
+  if (!_resolution->done) return false;
+  _resolver.join();
+  _addresses = _resolution->addresses;
+  emc_log_i("Resolved '%s' to %zu addresses", _resolution->hostname.c_str(), _addresses.size());
+  _resolution.reset();
+  ::close(_resolveFd);
+  _resolveFd = -1;
+  if (_addresses.empty()) {
+    emc_log_e("No address for '%s' found", _cacheHostname.c_str());
+    _closePoll();
+    return false;
+  }
+  _cache = _addresses;
+  _cacheTime = std::chrono::steady_clock::now();
+  return _startConnecting();
+}
+
+// the first connect to complete wins, failed connects are replaced by the next address right away
+bool ClientPosix::_checkConnects() {
+  uint64_t expirations = 0;
+  if (::read(_timerFd, &expirations, sizeof(expirations)) == sizeof(expirations)) {
+    _startNextConnect();
+  }
+  pollfd fds[EMC_POSIX_MAX_CONNECTS];
+  size_t count = _numberConnects;
+  for (size_t i = 0; i < count; ++i) {
+    fds[i].fd = _connects[i];
+    fds[i].events = POLLOUT;
+    fds[i].revents = 0;
+  }
+  if (::poll(fds, count, 0) <= 0) return false;
+  bool failed = false;
+  // backwards, so closing a connect doesn't move the ones that still have to be checked
+  for (size_t i = count; i-- > 0;) {
+    if (fds[i].revents == 0) continue;
+    int error = 0;
+    socklen_t length = sizeof(error);
+    if (getsockopt(_connects[i], SOL_SOCKET, SO_ERROR, &error, &length) < 0) error = errno;
+    if (error != 0) {
+      emc_log_e("Error connecting to address %zu: (%d) %s", _connectAddress[i], error, strerror(error));
+      _closeConnect(i, true);
+      failed = true;
+      continue;
+    }
+    size_t winner = _connectAddress[i];
+    _sockfd = _connects[i];
+    _closeConnect(i, false);
+    while (_numberConnects > 0) {
+      _closeConnect(_numberConnects - 1, true);
+    }
+    _closePoll();
+    // continue with blocking writes, reads don't block because of MSG_DONTWAIT
+    fcntl(_sockfd, F_SETFL, fcntl(_sockfd, F_GETFL, 0) & ~O_NONBLOCK);
+    ++_stats.connects;
+    _stats.fastOpen = false;
+    _fastOpenPending = _fastOpen;
+    // try the address that won first on the next connect
+    if (!_cache.empty() && winner < _cache.size()) {
+      std::rotate(_cache.begin(), _cache.begin() + winner, _cache.begin() + winner + 1);
+    }
+    emc_log_i("Socket connected to address %zu", winner);
+    return true;
+  }
+  if (failed) _startNextConnect();
+  if (_numberConnects == 0) {
+    emc_log_e("Could not connect to any address");
+    _cache.clear();  // resolve again on the next connect
+    _closePoll();
+  }
+  return false;
+}
+
+// whether the server accepted the data in the SYN
+void ClientPosix::_checkFastOpen() {
+  _fastOpenPending = false;
+  tcp_info info;
+  socklen_t length = sizeof(info);
+  if (getsockopt(_sockfd, IPPROTO_TCP, TCP_INFO, &info, &length) == 0 && (info.tcpi_options & TCPI_OPT_SYN_DATA)) {
+    _stats.fastOpen = true;
+    ++_stats.fastOpenConnects;
+    emc_log_i("Connected with fast open");
+  }
+}
+
+// resolve to IPv4 and IPv6 addresses, interleaving the families and starting with the family of the first result
+std::vector<ClientPosix::Address> ClientPosix::_resolve(const char* hostname) {
+  std::vector<Address> addresses;
   struct addrinfo hints, *servinfo, *p;
-  struct sockaddr_in *h;
   int rv;
 
-// Set up request addrinfo struct
+  // Set up request addrinfo struct
   memset(&hints, 0, sizeof hints);
   hints.ai_family = AF_UNSPEC;
   hints.ai_socktype = SOCK_STREAM;
 
   emc_log_i("Looking for '%s'", hostname);
 
-// ask for host data
+  // ask for host data
   if ((rv = getaddrinfo(hostname, NULL, &hints, &servinfo)) != 0) {
     emc_log_e("getaddrinfo: %s", gai_strerror(rv));
-    return returnIP;
+    return addresses;
   }
 
-  // loop through all the results and connect to the first we can
+  std::vector<Address> families[2];
+  int firstFamily = AF_UNSPEC;
   for (p = servinfo; p != NULL; p = p->ai_next) {
-    h = (struct sockaddr_in *)p->ai_addr;
-    returnIP = ::htonl(h->sin_addr.s_addr);
-    if (returnIP != IPAddress(0)) break;
+    if ((p->ai_family != AF_INET && p->ai_family != AF_INET6) || p->ai_addrlen > sizeof(sockaddr_storage)) continue;
+    if (firstFamily == AF_UNSPEC) firstFamily = p->ai_family;
+    Address address;
+    memset(&address, 0, sizeof(address));
+    memcpy(&address.address, p->ai_addr, p->ai_addrlen);
+    address.length = p->ai_addrlen;
+    families[p->ai_family == firstFamily ? 0 : 1].push_back(address);
   }
   // Release allocated memory
   freeaddrinfo(servinfo);
 
-  if (returnIP != IPAddress(0)) {
-    emc_log_i("Host '%s' = %u", hostname, static_cast<uint32_t>(returnIP));
-  } else {
-    emc_log_e("No IP for '%s' found", hostname);
+  for (size_t i = 0; i < families[0].size() || i < families[1].size(); ++i) {
+    if (i < families[0].size()) addresses.push_back(families[0][i]);
+    if (i < families[1].size()) addresses.push_back(families[1][i]);
   }
-  return returnIP;
+  return addresses;
 }
 
 }  // namespace espMqttClientInternals
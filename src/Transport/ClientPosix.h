@@ -14,20 +14,56 @@ the LICENSE file.
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>  // NOLINT [build/c++11]
+#include <memory>
+#include <string>
+#include <thread>  // NOLINT [build/c++11]
+#include <vector>
+
 #include "Transport.h"  // includes IPAddress
+#include "../Config.h"
+#include "../TypeDefs.h"
 #include "../Logging.h"
 
 #ifndef EMC_POSIX_PEEK_SIZE
 #define EMC_POSIX_PEEK_SIZE 1500
 #endif
 
+// time in ms to reuse the resolved addresses of a hostname on reconnect, 0 to resolve every time
+#ifndef EMC_POSIX_DNS_CACHE_TIME
+#define EMC_POSIX_DNS_CACHE_TIME 60000
+#endif
+
+// time in ms before the next address is tried while a connect is pending, 0 to try all addresses at once
+#ifndef EMC_POSIX_CONNECT_DELAY
+#define EMC_POSIX_CONNECT_DELAY 250
+#endif
+
+// maximum number of connects in progress at the same time
+#ifndef EMC_POSIX_MAX_CONNECTS
+#define EMC_POSIX_MAX_CONNECTS 4
+#endif
+
+// build the TLS transport, needs OpenSSL (link with -lssl -lcrypto)
+#ifndef EMC_POSIX_TLS
+#define EMC_POSIX_TLS 0
+#endif
+
 namespace espMqttClientInternals {
 
 class ClientPosix : public Transport {
@@ -37,16 +73,59 @@ class ClientPosix : public Transport {
   bool connect(IPAddress ip, uint16_t port) override;
   bool connect(const char* hostname, uint16_t port) override;
   size_t write(const uint8_t* buf, size_t size) override;
+  size_t writev(const WriteBuffer* buffers, size_t count) override;
   int read(uint8_t* buf, size_t size) override;
   void stop() override;
   bool connected() override;
   bool disconnected() override;
+  int fd() override;
+  // send the first data in the SYN on reconnect (TCP Fast Open)
+  void setFastOpen(bool enabled);
+  espMqttClientTypes::ConnectionStats getConnectionStats() const;
 
  protected:
+  struct Address {
+    sockaddr_storage address;
+    socklen_t length;
+  };
+
+  // name resolution runs in a separate thread, shared so it can outlive the client
+  struct Resolution {
+    std::string hostname;
+    std::atomic<bool> done;
+    std::vector<Address> addresses;
+    int fd;  // write end of the pipe, closed when done
+  };
+
   int _sockfd;
-  sockaddr_in _host;
+  uint16_t _port;
+  // while connecting, one epoll instance watches the resolver, the pending connects and the delay timer
+  int _pollFd;
+  int _timerFd;
+  int _resolveFd;  // read end of the pipe, hangs up when name resolution is done
+  std::shared_ptr<Resolution> _resolution;
+  std::thread _resolver;
+  std::vector<Address> _addresses;  // addresses to connect to, in order of preference
+  size_t _nextAddress;
+  int _connects[EMC_POSIX_MAX_CONNECTS];  // sockets with a connect in progress
+  size_t _connectAddress[EMC_POSIX_MAX_CONNECTS];  // index in _addresses
+  size_t _numberConnects;
+  std::string _cacheHostname;
+  std::vector<Address> _cache;
+  std::chrono::steady_clock::time_point _cacheTime;
+  bool _fastOpen;
+  bool _fastOpenPending;  // the handshake may still be in progress, don't block on writes
+  espMqttClientTypes::ConnectionStats _stats;
 
-  IPAddress _hostToIP(const char* hostname);
+  bool _openPoll();
+  void _closePoll();
+  bool _startConnecting();
+  bool _startNextConnect();
+  void _closeConnect(size_t index, bool closeSocket);
+  bool _checkResolved();
+  bool _checkConnects();
+  void _checkFastOpen();
+  static std::vector<Address> _resolve(const char* hostname);
 };
 
 }  // namespace espMqttClientInternals
@@ -0,0 +1,364 @@
+/*
+Copyright (c) 2022 Bert Melis. All rights reserved.
+
+This work is licensed under the terms of the MIT license.  
+For a copy, see <https://opensource.org/licenses/MIT> or
+the LICENSE file.
+*/
+
+#include "ClientPosixSecure.h"
+
+#if defined(__linux__) && EMC_POSIX_TLS
+
+namespace espMqttClientInternals {
+
+ClientPosixSecure::ClientPosixSecure()
+: ClientPosix()
+, _ctx(SSL_CTX_new(TLS_client_method()))
+, _ssl(nullptr)
+, _handshakeDone(false)
+, _kernelTls(false)
+, _kernelTlsSend(false)
+, _hostname()
+, _hostIsIp(false)
+, _sessionHost()
+, _session(nullptr)
+, _handshakeStart()
+, _retryData()
+, _ahead(0) {
+  if (!_ctx) {
+    _logError("creating TLS context");
+    return;
+  }
+  SSL_CTX_set_min_proto_version(_ctx, TLS1_2_VERSION);
+  SSL_CTX_set_verify(_ctx, SSL_VERIFY_PEER, nullptr);
+  SSL_CTX_set_default_verify_paths(_ctx);
+  // a short write is returned like on a non-blocking socket, the client retries with the remaining data
+  SSL_CTX_set_mode(_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+  // keep the last session (TLS 1.2) or ticket (TLS 1.3) ourselves
+  SSL_CTX_set_session_cache_mode(_ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+  SSL_CTX_sess_set_new_cb(_ctx, _newSession);
+}
+
+ClientPosixSecure::~ClientPosixSecure() {
+  ClientPosixSecure::stop();
+  _clearSession();
+  SSL_CTX_free(_ctx);
+}
+
+bool ClientPosixSecure::connect(IPAddress ip, uint16_t port) {
+  char address[INET_ADDRSTRLEN];
+  in_addr host;
+  host.s_addr = htonl(static_cast<uint32_t>(ip));
+  inet_ntop(AF_INET, &host, address, sizeof(address));
+  _hostname = address;
+  _hostIsIp = true;
+  return ClientPosix::connect(ip, port);
+}
+
+bool ClientPosixSecure::connect(const char* hostname, uint16_t port) {
+  _hostname = hostname;
+  _hostIsIp = false;
+  return ClientPosix::connect(hostname, port);
+}
+
+size_t ClientPosixSecure::write(const uint8_t* buf, size_t size) {
+  if (!_handshakeDone || size == 0) return 0;
+  if (_kernelTlsSend) return ClientPosix::write(buf, size);
+  if (!_retryData.empty() || _ahead > 0) return _retry(size);
+  ERR_clear_error();
+  int ret = SSL_write(_ssl, buf, size);
+  if (ret > 0) return ret;
+  if (_wantsRetry(ret)) {
+    // OpenSSL wants this exact data and length again, but the client may offer it split up differently
+    _retryData.assign(buf, buf + size);
+  }
+  return 0;
+}
+
+// every buffer becomes a separate TLS record, so small buffers are merged first
+size_t ClientPosixSecure::writev(const WriteBuffer* buffers, size_t count) {
+  // the kernel encrypts straight from the buffers, without copies
+  if (_kernelTlsSend) return ClientPosix::writev(buffers, count);
+  if (!_retryData.empty() || _ahead > 0) {
+    size_t offered = 0;
+    for (size_t i = 0; i < count; ++i) offered += buffers[i].size;
+    return _retry(offered);
+  }
+  uint8_t merged[EMC_TX_BUFFER_SIZE];
+  size_t length = 0;
+  size_t total = 0;
+  for (size_t i = 0; i < count; ++i) {
+    if (length + buffers[i].size <= sizeof(merged)) {
+      memcpy(&merged[length], buffers[i].data, buffers[i].size);
+      length += buffers[i].size;
+      continue;
+    }
+    if (length > 0) {
+      size_t written = write(merged, length);
+      total += written;
+      if (written != length) return total;
+      length = 0;
+    }
+    size_t written = write(buffers[i].data, buffers[i].size);
+    total += written;
+    if (written != buffers[i].size) return total;
+  }
+  if (length > 0) total += write(merged, length);
+  return total;
+}
+
+int ClientPosixSecure::read(uint8_t* buf, size_t size) {
+  if (!_handshakeDone) return -1;
+  ERR_clear_error();
+  int ret = SSL_read(_ssl, buf, size);
+  if (ret > 0) return ret;
+  int error = SSL_get_error(_ssl, ret);
+  if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE) {
+    errno = EAGAIN;
+    return -1;
+  }
+  if (error == SSL_ERROR_ZERO_RETURN) {
+    emc_log_i("Connection closed by peer");
+    ret = 0;
+  } else {
+    _logError("reading");
+    ret = -1;
+  }
+  stop();
+  return ret;
+}
+
+void ClientPosixSecure::stop() {
+  if (_ssl) {
+    if (_handshakeDone) {
+      SSL_shutdown(_ssl);  // best effort close_notify, doesn't wait for the answer
+    }
+    SSL_free(_ssl);
+    _ssl = nullptr;
+  }
+  _handshakeDone = false;
+  _kernelTlsSend = false;
+  _retryData.clear();
+  _ahead = 0;
+  ClientPosix::stop();
+}
+
+bool ClientPosixSecure::connected() {
+  if (_handshakeDone) return _sockfd >= 0;
+  if (!ClientPosix::connected()) return false;
+  return _handshake();
+}
+
+size_t ClientPosixSecure::pending() {
+  if (!_handshakeDone) return 0;
+  return SSL_pending(_ssl);
+}
+
+void ClientPosixSecure::setInsecure() {
+  SSL_CTX_set_verify(_ctx, SSL_VERIFY_NONE, nullptr);
+}
+
+bool ClientPosixSecure::setCACert(const char* rootCA) {
+  BIO* bio = BIO_new_mem_buf(rootCA, -1);
+  X509_STORE* store = SSL_CTX_get_cert_store(_ctx);
+  size_t count = 0;
+  X509* cert = nullptr;
+  while ((cert = PEM_read_bio_X509(bio, nullptr, nullptr, nullptr)) != nullptr) {
+    if (X509_STORE_add_cert(store, cert) == 1) ++count;
+    X509_free(cert);
+  }
+  BIO_free(bio);
+  ERR_clear_error();  // end of the PEM data
+  if (count == 0) {
+    emc_log_e("No CA certificate found");
+    return false;
+  }
+  SSL_CTX_set_verify(_ctx, SSL_VERIFY_PEER, nullptr);
+  return true;
+}
+
+bool ClientPosixSecure::setCertificate(const char* clientCa) {
+  BIO* bio = BIO_new_mem_buf(clientCa, -1);
+  X509* cert = PEM_read_bio_X509(bio, nullptr, nullptr, nullptr);
+  BIO_free(bio);
+  bool result = cert && SSL_CTX_use_certificate(_ctx, cert) == 1;
+  X509_free(cert);
+  if (!result) _logError("loading client certificate");
+  return result;
+}
+
+bool ClientPosixSecure::setPrivateKey(const char* privateKey) {
+  BIO* bio = BIO_new_mem_buf(privateKey, -1);
+  EVP_PKEY* key = PEM_read_bio_PrivateKey(bio, nullptr, nullptr, nullptr);
+  BIO_free(bio);
+  bool result = key && SSL_CTX_use_PrivateKey(_ctx, key) == 1;
+  EVP_PKEY_free(key);
+  if (!result) _logError("loading private key");
+  return result;
+}
+
+void ClientPosixSecure::setKernelTls(bool enabled) {
+  _kernelTls = enabled;
+}
+
+// runs on the connected socket, the handshake is driven by connected() and watched through fd()
+bool ClientPosixSecure::_startHandshake() {
+  _ssl = _ctx ? SSL_new(_ctx) : nullptr;
+  if (!_ssl || !_openPoll()) {
+    _logError("starting handshake");
+    return false;
+  }
+  fcntl(_sockfd, F_SETFL, fcntl(_sockfd, F_GETFL, 0) | O_NONBLOCK);
+  SSL_set_fd(_ssl, _sockfd);
+  SSL_set_app_data(_ssl, this);
+  if (_kernelTls) {
+    // OpenSSL passes the keys to the kernel after the handshake and falls back to user space when it can't
+    #ifdef SSL_OP_ENABLE_KTLS
+    SSL_set_options(_ssl, SSL_OP_ENABLE_KTLS);
+    #else
+    emc_log_w("Kernel TLS needs OpenSSL 3");
+    #endif
+  }
+  if (_hostIsIp) {
+    X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(_ssl), _hostname.c_str());
+  } else {
+    SSL_set_tlsext_host_name(_ssl, _hostname.c_str());
+    SSL_set1_host(_ssl, _hostname.c_str());
+  }
+  std::string sessionHost = _hostname + ":" + std::to_string(_port);
+  if (_session && _sessionHost == sessionHost) {
+    SSL_set_session(_ssl, _session);
+  } else {
+    _clearSession();
+    _sessionHost = sessionHost;
+  }
+
+  epoll_event event;
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLOUT;
+  event.data.fd = _sockfd;
+  epoll_ctl(_pollFd, EPOLL_CTL_ADD, _sockfd, &event);
+  itimerspec timeout;
+  memset(&timeout, 0, sizeof(timeout));
+  timeout.it_value.tv_sec = EMC_POSIX_TLS_HANDSHAKE_TIMEOUT / 1000;
+  timeout.it_value.tv_nsec = (EMC_POSIX_TLS_HANDSHAKE_TIMEOUT % 1000) * 1000000L;
+  timerfd_settime(_timerFd, 0, &timeout, nullptr);
+  _handshakeStart = std::chrono::steady_clock::now();
+  return true;
+}
+
+// true when the handshake has completed, stops the connection when it fails
+bool ClientPosixSecure::_handshake() {
+  if (!_ssl && !_startHandshake()) {
+    stop();
+    return false;
+  }
+  uint64_t expirations = 0;
+  if (::read(_timerFd, &expirations, sizeof(expirations)) == sizeof(expirations)) {
+    emc_log_e("TLS handshake timeout");
+    stop();
+    return false;
+  }
+  ERR_clear_error();
+  int ret = SSL_connect(_ssl);
+  if (ret != 1) {
+    int error = SSL_get_error(_ssl, ret);
+    if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE) {
+      _waitFor(error);
+      return false;
+    }
+    long verify = SSL_get_verify_result(_ssl);  // NOLINT(runtime/int)
+    if (verify != X509_V_OK) {
+      emc_log_e("TLS certificate error: %s", X509_verify_cert_error_string(verify));
+    } else {
+      _logError("during TLS handshake");
+    }
+    // don't try to resume a session the server refuses
+    _clearSession();
+    stop();
+    return false;
+  }
+  _closePoll();
+  _handshakeDone = true;
+  _stats.handshakeTime = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - _handshakeStart).count();
+  _stats.resumed = SSL_session_reused(_ssl) == 1;
+  ++_stats.handshakes;
+  if (_stats.resumed) ++_stats.resumedHandshakes;
+  _kernelTlsSend = _kernelTls && BIO_get_ktls_send(SSL_get_wbio(_ssl));
+  _stats.kernelTls = _kernelTlsSend;
+  if (_kernelTls && !_kernelTlsSend) {
+    emc_log_w("Kernel TLS not available, encrypting in user space");
+  }
+  if (_fastOpenPending) _checkFastOpen();
+  emc_log_i("TLS connected (%s, %s) in %u us", SSL_get_version(_ssl), _stats.resumed ? "resumed" : "full handshake", _stats.handshakeTime);
+  return true;
+}
+
+// make fd() wake up when the socket is ready for the next handshake step
+void ClientPosixSecure::_waitFor(int error) {
+  epoll_event event;
+  memset(&event, 0, sizeof(event));
+  event.events = (error == SSL_ERROR_WANT_READ) ? EPOLLIN : EPOLLOUT;
+  event.data.fd = _sockfd;
+  epoll_ctl(_pollFd, EPOLL_CTL_MOD, _sockfd, &event);
+}
+
+// repeat the write OpenSSL asked for, the result is handed out to the caller as it offers the same bytes again
+size_t ClientPosixSecure::_retry(size_t size) {
+  if (!_retryData.empty()) {
+    ERR_clear_error();
+    int ret = SSL_write(_ssl, _retryData.data(), _retryData.size());
+    if (ret <= 0) {
+      _wantsRetry(ret);
+      return 0;
+    }
+    _retryData.clear();  // keeps the capacity for the next time
+    _ahead = ret;
+  }
+  size_t written = std::min(_ahead, size);
+  _ahead -= written;
+  return written;
+}
+
+// a failed write is only retried when OpenSSL waits for the socket, otherwise the connection is dropped
+bool ClientPosixSecure::_wantsRetry(int ret) {
+  int error = SSL_get_error(_ssl, ret);
+  if (error == SSL_ERROR_WANT_WRITE || error == SSL_ERROR_WANT_READ) return true;
+  _logError("writing");
+  stop();
+  return false;
+}
+
+void ClientPosixSecure::_logError(const char* action) {
+  (void) action;  // unused without logging
+  unsigned long error = ERR_get_error();  // NOLINT(runtime/int)
+  if (error != 0) {
+    char buf[128];
+    ERR_error_string_n(error, buf, sizeof(buf));
+    emc_log_e("Error %s: %s", action, buf);
+  } else {
+    emc_log_e("Error %d: \"%s\" %s", errno, strerror(errno), action);
+  }
+  ERR_clear_error();
+}
+
+void ClientPosixSecure::_clearSession() {
+  if (_session) {
+    SSL_SESSION_free(_session);
+    _session = nullptr;
+  }
+}
+
+// called by OpenSSL for every new session or ticket, the last one is kept
+int ClientPosixSecure::_newSession(SSL* ssl, SSL_SESSION* session) {
+  ClientPosixSecure* client = static_cast<ClientPosixSecure*>(SSL_get_app_data(ssl));
+  if (!client) return 0;
+  client->_clearSession();
+  client->_session = session;
+  return 1;  // we own the session now
+}
+
+}  // namespace espMqttClientInternals
+
+#endif
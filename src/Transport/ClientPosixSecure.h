@@ -0,0 +1,72 @@
+/*
+Copyright (c) 2022 Bert Melis. All rights reserved.
+
+This work is licensed under the terms of the MIT license.  
+For a copy, see <https://opensource.org/licenses/MIT> or
+the LICENSE file.
+*/
+
+#pragma once
+
+#include "ClientPosix.h"
+
+#if defined(__linux__) && EMC_POSIX_TLS
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/x509v3.h>
+
+// time in ms the TLS handshake may take before the connection is dropped
+#ifndef EMC_POSIX_TLS_HANDSHAKE_TIMEOUT
+#define EMC_POSIX_TLS_HANDSHAKE_TIMEOUT 10000
+#endif
+
+namespace espMqttClientInternals {
+
+// TLS on top of ClientPosix using OpenSSL, the session is kept to resume it on reconnect
+class ClientPosixSecure : public ClientPosix {
+ public:
+  ClientPosixSecure();
+  ~ClientPosixSecure();
+  bool connect(IPAddress ip, uint16_t port) override;
+  bool connect(const char* hostname, uint16_t port) override;
+  size_t write(const uint8_t* buf, size_t size) override;
+  size_t writev(const WriteBuffer* buffers, size_t count) override;
+  int read(uint8_t* buf, size_t size) override;
+  void stop() override;
+  bool connected() override;
+  size_t pending() override;
+  void setInsecure();
+  bool setCACert(const char* rootCA);
+  bool setCertificate(const char* clientCa);
+  bool setPrivateKey(const char* privateKey);
+  // let the kernel encrypt the outgoing data when the tls module is available
+  void setKernelTls(bool enabled);
+
+ protected:
+  SSL_CTX* _ctx;
+  SSL* _ssl;
+  bool _handshakeDone;
+  bool _kernelTls;
+  bool _kernelTlsSend;  // keys are handed to the kernel, data is written to the socket directly
+  std::string _hostname;  // name or address to verify the server certificate against
+  bool _hostIsIp;
+  std::string _sessionHost;  // hostname and port the session belongs to
+  SSL_SESSION* _session;
+  std::chrono::steady_clock::time_point _handshakeStart;
+  std::vector<uint8_t> _retryData;  // a write that has to be repeated with the same data and length
+  size_t _ahead;  // bytes of a repeated write not yet returned to the caller
+
+  bool _startHandshake();
+  bool _handshake();
+  void _waitFor(int error);
+  size_t _retry(size_t size);
+  bool _wantsRetry(int ret);
+  void _logError(const char* action);
+  void _clearSession();
+  static int _newSession(SSL* ssl, SSL_SESSION* session);
+};
+
+}  // namespace espMqttClientInternals
+
+#endif
@@ -14,15 +14,39 @@ the LICENSE file.
 
 namespace espMqttClientInternals {
 
+struct WriteBuffer {
+  const uint8_t* data;
+  size_t size;
+};
+
 class Transport {
  public:
   virtual bool connect(IPAddress ip, uint16_t port) = 0;
   virtual bool connect(const char* host, uint16_t port) = 0;
   virtual size_t write(const uint8_t* buf, size_t size) = 0;
+  // write multiple buffers in order, returns total bytes written
+  // transports that can send all buffers at once should override this
+  virtual size_t writev(const WriteBuffer* buffers, size_t count) {
+    size_t total = 0;
+    for (size_t i = 0; i < count; ++i) {
+      size_t written = write(buffers[i].data, buffers[i].size);
+      total += written;
+      if (written != buffers[i].size) break;
+    }
+    return total;
+  }
   virtual int read(uint8_t* buf, size_t size) = 0;
   virtual void stop() = 0;
   virtual bool connected() = 0;
   virtual bool disconnected() = 0;
+  // file descriptor of the underlying socket for use with poll(), -1 when not available
+  virtual int fd() {
+    return -1;
+  }
+  // bytes that can be read without fd() becoming readable, eg. decrypted data buffered by TLS
+  virtual size_t pending() {
+    return 0;
+  }
 };
 
 }  // namespace espMqttClientInternals
@@ -44,7 +44,8 @@ enum class Error : uint8_t {
   OUT_OF_MEMORY = 1,
   MAX_RETRIES = 2,
   MALFORMED_PARAMETER = 3,
-  MISC_ERROR = 4
+  MISC_ERROR = 4,
+  OUT_OF_PACKET_IDS = 5
 };
 
 const char* errorToString(Error error);
@@ -56,13 +57,50 @@ struct MessageProperties {
   uint16_t packetId;
 };
 
+struct TopicView {
+  const char* data;  // not null-terminated
+  size_t length;
+};
+
+struct RxStats {
+  uint32_t reads;             // transport reads that returned data
+  uint32_t bytes;             // bytes received
+  uint32_t packets;           // packets (or payload fragments) parsed
+  uint32_t byteBudgetHits;    // loops that stopped reading because of the byte budget
+  uint32_t packetBudgetHits;  // loops that stopped reading because of the packet budget
+  uint32_t timeBudgetHits;    // loops that stopped reading because of the time budget
+};
+
+struct ConnectionStats {
+  uint32_t connects;           // transport connections made
+  uint32_t fastOpenConnects;   // connections that sent data in the SYN (TCP Fast Open)
+  uint32_t handshakes;         // TLS handshakes
+  uint32_t resumedHandshakes;  // TLS handshakes that resumed a previous session
+  uint32_t handshakeTime;      // duration of the last TLS handshake in microseconds
+  bool fastOpen;               // the last connection sent data in the SYN
+  bool resumed;                // the last TLS handshake resumed a previous session
+  bool kernelTls;              // the last TLS connection encrypts in the kernel (kTLS)
+};
+
+struct PublishMessage {
+  const char* topic;
+  uint8_t qos;
+  bool retain;
+  const uint8_t* payload;
+  size_t length;
+};
+
 typedef std::function<void(bool sessionPresent)> OnConnectCallback;
 typedef std::function<void(DisconnectReason reason)> OnDisconnectCallback;
 typedef std::function<void(uint16_t packetId, const SubscribeReturncode* returncodes, size_t len)> OnSubscribeCallback;
 typedef std::function<void(uint16_t packetId)> OnUnsubscribeCallback;
 typedef std::function<void(const MessageProperties& properties, const char* topic, const uint8_t* payload, size_t len, size_t index, size_t total)> OnMessageCallback;
+typedef std::function<void(const MessageProperties& properties, const TopicView& topic, const uint8_t* payload, size_t len, size_t index, size_t total)> OnMessageViewCallback;
+typedef std::function<void(const MessageProperties& properties, const char* topic, uint8_t* payload, size_t len)> OnMessageCompleteCallback;
 typedef std::function<void(uint16_t packetId)> OnPublishCallback;
 typedef std::function<size_t(uint8_t* data, size_t maxSize, size_t index)> PayloadCallback;
+typedef std::function<void(const uint8_t* payload)> PayloadReleaseCallback;
+typedef std::function<uint8_t*(size_t size)> PayloadAllocateCallback;
 typedef std::function<void(uint16_t packetId, Error error)> OnErrorCallback;
 
 enum class UseInternalTask {
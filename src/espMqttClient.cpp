@@ -115,4 +115,55 @@ espMqttClient::espMqttClient()
 , _client() {
   _transport = &_client;
 }
+
+espMqttClient& espMqttClient::setFastOpen(bool enabled) {
+  _client.setFastOpen(enabled);
+  return *this;
+}
+
+espMqttClientTypes::ConnectionStats espMqttClient::getConnectionStats() const {
+  return _client.getConnectionStats();
+}
+
+#if EMC_POSIX_TLS
+espMqttClientSecure::espMqttClientSecure()
+: MqttClientSetup(espMqttClientTypes::UseInternalTask::NO)
+, _client() {
+  _transport = &_client;
+}
+
+espMqttClientSecure& espMqttClientSecure::setInsecure() {
+  _client.setInsecure();
+  return *this;
+}
+
+espMqttClientSecure& espMqttClientSecure::setCACert(const char* rootCA) {
+  _client.setCACert(rootCA);
+  return *this;
+}
+
+espMqttClientSecure& espMqttClientSecure::setCertificate(const char* clientCa) {
+  _client.setCertificate(clientCa);
+  return *this;
+}
+
+espMqttClientSecure& espMqttClientSecure::setPrivateKey(const char* privateKey) {
+  _client.setPrivateKey(privateKey);
+  return *this;
+}
+
+espMqttClientSecure& espMqttClientSecure::setKernelTls(bool enabled) {
+  _client.setKernelTls(enabled);
+  return *this;
+}
+
+espMqttClientSecure& espMqttClientSecure::setFastOpen(bool enabled) {
+  _client.setFastOpen(enabled);
+  return *this;
+}
+
+espMqttClientTypes::ConnectionStats espMqttClientSecure::getConnectionStats() const {
+  return _client.getConnectionStats();
+}
+#endif
 #endif
@@ -16,6 +16,7 @@ the LICENSE file.
 #include "Transport/ClientSecureSync.h"
 #elif defined(__linux__)
 #include "Transport/ClientPosix.h"
+#include "Transport/ClientPosixSecure.h"
 #endif
 
 #include "MqttClientSetup.h"
@@ -74,8 +75,27 @@ class espMqttClientSecure : public MqttClientSetup<espMqttClientSecure> {
 class espMqttClient : public MqttClientSetup<espMqttClient> {
  public:
   espMqttClient();
+  espMqttClient& setFastOpen(bool enabled);
+  espMqttClientTypes::ConnectionStats getConnectionStats() const;
 
  protected:
   espMqttClientInternals::ClientPosix _client;
 };
+
+#if EMC_POSIX_TLS
+class espMqttClientSecure : public MqttClientSetup<espMqttClientSecure> {
+ public:
+  espMqttClientSecure();
+  espMqttClientSecure& setInsecure();
+  espMqttClientSecure& setCACert(const char* rootCA);
+  espMqttClientSecure& setCertificate(const char* clientCa);
+  espMqttClientSecure& setPrivateKey(const char* privateKey);
+  espMqttClientSecure& setKernelTls(bool enabled);
+  espMqttClientSecure& setFastOpen(bool enabled);
+  espMqttClientTypes::ConnectionStats getConnectionStats() const;
+
+ protected:
+  espMqttClientInternals::ClientPosixSecure _client;
+};
+#endif
 #endif
@@ -0,0 +1,369 @@
+/*
+Native micro-benchmarks for the hot paths of the client.
+Run with `pio test -e native-benchmark -v`. Results are printed as ns/op and heap bytes requested per op.
+*/
+
+#include <unity.h>
+#include <stdio.h>
+#include <string.h>
+#include <chrono>  // NOLINT [build/c++11]
+#include <functional>
+#include <vector>
+#include <algorithm>
+
+#include <Outbox.h>
+#include <TopicRouter.h>
+#include <Packets/Parser.h>
+#include <Packets/Packet.h>
+#include <MemoryPool/src/MemoryPool.h>
+
+using espMqttClientInternals::Outbox;
+using espMqttClientInternals::Packet;
+using espMqttClientInternals::Parser;
+using espMqttClientInternals::ParserResult;
+using espMqttClientInternals::PacketType;
+using espMqttClientInternals::TopicRouter;
+
+void setUp() {}
+void tearDown() {}
+
+// Count heap bytes requested by interposing malloc. Not available with sanitizers which interpose malloc themselves.
+#if defined(__GLIBC__) && !defined(__SANITIZE_ADDRESS__)
+  #define EMC_BENCHMARK_COUNT_ALLOCATIONS 1
+static size_t allocatedBytes = 0;
+extern "C" {
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t number, size_t size);
+void* __libc_realloc(void* ptr, size_t size);
+void* malloc(size_t size) {
+  allocatedBytes += size;
+  return __libc_malloc(size);
+}
+void* calloc(size_t number, size_t size) {
+  allocatedBytes += number * size;
+  return __libc_calloc(number, size);
+}
+void* realloc(void* ptr, size_t size) {
+  allocatedBytes += size;
+  return __libc_realloc(ptr, size);
+}
+}
+#else
+static size_t allocatedBytes = 0;
+#endif
+
+class Measurement {
+ public:
+  Measurement()
+  : _start(std::chrono::steady_clock::now())
+  , _allocated(allocatedBytes) {}
+
+  void report(const char* name, size_t operations, size_t bytes = 0) const {
+    double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - _start).count();
+    size_t allocated = allocatedBytes - _allocated;
+    printf("%-52s %10.1f ns/op %8zu B/op", name, ns / operations, allocated / operations);
+    if (bytes > 0) printf(" %8.1f MB/s", bytes / ns * 1000.0);
+    printf("\n");
+  }
+
+ private:
+  std::chrono::steady_clock::time_point _start;
+  size_t _allocated;
+};
+
+static void appendPublish(std::vector<uint8_t>* stream, size_t topicLength, uint8_t qos, size_t payloadLength, uint16_t packetId) {
+  size_t remainingLength = 2 + topicLength + (qos > 0 ? 2 : 0) + payloadLength;
+  stream->push_back(PacketType.PUBLISH | (qos << 1));
+  do {
+    uint8_t encoded = remainingLength % 128;
+    remainingLength /= 128;
+    stream->push_back(remainingLength > 0 ? encoded | 0x80 : encoded);
+  } while (remainingLength > 0);
+  stream->push_back(topicLength >> 8);
+  stream->push_back(topicLength & 0xFF);
+  for (size_t i = 0; i < topicLength; ++i) stream->push_back((i % 8 == 7) ? '/' : 'a' + (i % 26));
+  if (qos > 0) {
+    stream->push_back(packetId >> 8);
+    stream->push_back(packetId & 0xFF);
+  }
+  for (size_t i = 0; i < payloadLength; ++i) stream->push_back(i & 0xFF);
+}
+
+void test_benchmark_parser() {
+  const size_t numberPackets = 2000;
+  const size_t topicLengths[] = {8, 64, 256};
+  const uint8_t qosLevels[] = {0, 1};
+  const size_t chunks[] = {1460, 100, 16};
+  for (size_t topicLength : topicLengths) {
+    for (uint8_t qos : qosLevels) {
+      std::vector<uint8_t> stream;
+      for (size_t i = 0; i < numberPackets; ++i) appendPublish(&stream, topicLength, qos, 64, i + 1);
+      for (size_t chunk : chunks) {
+        Parser parser;
+        size_t packets = 0;
+        char name[64];
+        snprintf(name, sizeof(name), "parse publish topic %zu qos %u chunk %zu", topicLength, qos, chunk);
+        Measurement m;
+        for (size_t start = 0; start < stream.size(); start += chunk) {
+          size_t length = std::min(chunk, stream.size() - start);
+          size_t index = 0;
+          while (index < length) {
+            size_t bytesRead = 0;
+            ParserResult result = parser.parse(&stream[start + index], length - index, &bytesRead);
+            TEST_ASSERT_TRUE(result != ParserResult::protocolError);
+            index += bytesRead;
+            if (result == ParserResult::packet) {
+              const espMqttClientInternals::IncomingPacket& p = parser.getPacket();
+              if (p.payload.index + p.payload.length == p.payload.total) ++packets;
+            }
+          }
+        }
+        m.report(name, numberPackets, stream.size());
+        TEST_ASSERT_EQUAL_UINT32(numberPackets, packets);
+      }
+    }
+  }
+}
+
+void test_benchmark_packet() {
+  const size_t n = 10000;
+  espMqttClientTypes::Error error(espMqttClientTypes::Error::SUCCESS);
+  std::vector<uint8_t> payload(256, 0xAA);
+  const char* topic = "espMqttClient/benchmark/topic";
+  std::vector<Packet*> packets(n, nullptr);
+
+  auto run = [&](const char* name, std::function<Packet*(size_t)> create) {
+    Measurement m;
+    for (size_t i = 0; i < n; ++i) packets[i] = create(i);
+    for (size_t i = 0; i < n; ++i) {
+      TEST_ASSERT_NOT_NULL(packets[i]);
+      delete packets[i];
+    }
+    m.report(name, n);
+  };
+
+  run("packet CONNECT", [&](size_t) {
+    return new Packet(error, true, "user", "pass", "will", false, static_cast<uint8_t>(1), static_cast<const uint8_t*>(payload.data()), static_cast<uint16_t>(16), static_cast<uint16_t>(15), "client");
+  });
+  run("packet PUBLISH qos 0 copy 256 B", [&](size_t) {
+    return new Packet(error, static_cast<uint16_t>(0), topic, payload.data(), payload.size(), static_cast<uint8_t>(0), false);
+  });
+  run("packet PUBLISH qos 1 copy 256 B", [&](size_t i) {
+    return new Packet(error, static_cast<uint16_t>((i % 65535) + 1), topic, payload.data(), payload.size(), static_cast<uint8_t>(1), false);
+  });
+  run("packet PUBLISH qos 1 callback 256 B", [&](size_t i) {
+    return new Packet(error, static_cast<uint16_t>((i % 65535) + 1), topic, [](uint8_t* data, size_t maxSize, size_t index) -> size_t {
+      (void) index;
+      memset(data, 0xAA, maxSize);
+      return maxSize;
+    }, payload.size(), static_cast<uint8_t>(1), false);
+  });
+  run("packet PUBLISH qos 1 zero-copy 256 B", [&](size_t i) {
+    return new Packet(error, static_cast<uint16_t>((i % 65535) + 1), topic, payload.data(), payload.size(), static_cast<uint8_t>(1), false, nullptr);
+  });
+  run("packet SUBSCRIBE 1 topic", [&](size_t i) {
+    return new Packet(error, static_cast<uint16_t>((i % 65535) + 1), topic, static_cast<uint8_t>(1));
+  });
+  run("packet SUBSCRIBE 3 topics", [&](size_t i) {
+    uint8_t qos0 = 0;
+    uint8_t qos1 = 1;
+    uint8_t qos2 = 2;
+    return new Packet(error, static_cast<uint16_t>((i % 65535) + 1), topic, qos1, "a/b", qos2, "c/d", qos0);
+  });
+  run("packet UNSUBSCRIBE 1 topic", [&](size_t i) {
+    return new Packet(error, static_cast<uint16_t>((i % 65535) + 1), topic);
+  });
+  run("packet PUBACK", [&](size_t i) {
+    return new Packet(error, PacketType.PUBACK, static_cast<uint16_t>((i % 65535) + 1));
+  });
+  run("packet PINGREQ", [&](size_t) {
+    return new Packet(error, PacketType.PINGREQ);
+  });
+}
+
+struct Item {
+  explicit Item(uint32_t i) : id(i) {}
+  uint32_t id;
+  uint32_t indexKey() const { return id; }
+};
+
+void test_benchmark_outbox() {
+  const size_t depths[] = {1, 10, 100, 1000, 10000};
+  for (size_t depth : depths) {
+    #if EMC_USE_MEMPOOL
+    if (depth > EMC_NUM_POOL_ELEMENTS) continue;
+    #endif
+    const size_t rounds = depth < 1000 ? 10000 / depth : 1;
+    Outbox<Item> outbox;
+    char name[64];
+
+    // emplace, then move to the waiting lane as if sent
+    snprintf(name, sizeof(name), "outbox emplace+next depth %zu", depth);
+    Measurement emplace;
+    for (size_t r = 0; r < rounds; ++r) {
+      for (size_t i = 1; i <= depth; ++i) {
+        outbox.emplace(i);
+        outbox.next(1);
+      }
+      if (r + 1 < rounds) {
+        for (size_t i = 1; i <= depth; ++i) {
+          Outbox<Item>::Iterator it = outbox.find(i);
+          outbox.remove(it);
+        }
+      }
+    }
+    emplace.report(name, depth * rounds);
+
+    // acknowledge out of order: find by key and remove
+    snprintf(name, sizeof(name), "outbox ack find+remove depth %zu", depth);
+    Measurement ack;
+    for (size_t i = 0; i < depth; ++i) {
+      uint32_t key = ((i * 7919) % depth) + 1;
+      Outbox<Item>::Iterator it = outbox.find(key);
+      TEST_ASSERT_TRUE(static_cast<bool>(it));
+      outbox.remove(it);
+    }
+    ack.report(name, depth);
+    TEST_ASSERT_TRUE(outbox.empty());
+  }
+}
+
+// reference: check every filter, as an application without router would do
+static bool topicMatches(const char* filter, const char* topic) {
+  if (topic[0] == '$' && (filter[0] == '+' || filter[0] == '#')) return false;
+  while (*filter) {
+    if (filter[0] == '#') return true;
+    if (filter[0] == '+') {
+      while (*topic && *topic != '/') ++topic;
+      ++filter;
+    } else {
+      while (*filter && *filter != '/' && *filter == *topic) {
+        ++filter;
+        ++topic;
+      }
+      if ((*filter && *filter != '/') || (*topic && *topic != '/')) return false;
+    }
+    if (*filter == '/' && *topic == '/') {
+      ++filter;
+      ++topic;
+    } else if (*filter == '/' && filter[1] == '#' && *topic == 0) {
+      return true;
+    } else {
+      return *filter == 0 && *topic == 0;
+    }
+  }
+  return *topic == 0;
+}
+
+void test_benchmark_router() {
+  const int numberFilters = 1000;
+  const int iterations = 10000;
+  static char filters[numberFilters][32];
+  TopicRouter router;
+  espMqttClientTypes::OnMessageCallback callback = [](const espMqttClientTypes::MessageProperties& properties, const char* topic, const uint8_t* payload, size_t len, size_t index, size_t total) {
+    (void) properties;
+    (void) topic;
+    (void) payload;
+    (void) len;
+    (void) index;
+    (void) total;
+  };
+  for (int i = 0; i < numberFilters; ++i) {
+    if (i % 10 == 0) {
+      snprintf(filters[i], sizeof(filters[i]), "home/room%d/+/state", i);
+    } else if (i % 10 == 1) {
+      snprintf(filters[i], sizeof(filters[i]), "home/room%d/#", i);
+    } else {
+      snprintf(filters[i], sizeof(filters[i]), "home/room%d/sensor%d/state", i, i);
+    }
+    TEST_ASSERT_NOT_NULL(router.add(filters[i], callback));
+  }
+  const char* topics[] = {"home/room500/sensor500/state", "home/room501/x/y", "home/room510/sensor1/state", "office/room1/sensor1/state"};
+
+  size_t routerMatches = 0;
+  Measurement routerTime;
+  for (int i = 0; i < iterations; ++i) {
+    const char* topic = topics[i % 4];
+    for (TopicRouter::Route* r = router.match(topic, strlen(topic)); r; r = r->nextMatch) ++routerMatches;
+    router.release();
+  }
+  routerTime.report("router match 1000 filters", iterations);
+
+  size_t linearMatches = 0;
+  Measurement linearTime;
+  for (int i = 0; i < iterations; ++i) {
+    const char* topic = topics[i % 4];
+    for (int f = 0; f < numberFilters; ++f) {
+      if (topicMatches(filters[f], topic)) ++linearMatches;
+    }
+  }
+  linearTime.report("linear match 1000 filters (reference)", iterations);
+
+  TEST_ASSERT_EQUAL_UINT32(3 * iterations / 4, routerMatches);
+  TEST_ASSERT_EQUAL_UINT32(routerMatches, linearMatches);
+}
+
+void test_benchmark_memoryPool() {
+  const size_t n = 100000;
+  {
+    MemoryPool::Fixed<32, 64> pool;
+    Measurement m;
+    for (size_t i = 0; i < n; ++i) {
+      void* p = pool.malloc();
+      TEST_ASSERT_NOT_NULL(p);
+      pool.free(p);
+    }
+    m.report("mempool Fixed<32, 64> malloc+free", n);
+  }
+  {
+    MemoryPool::Fixed<32, 64> pool;
+    void* p[32];
+    Measurement m;
+    for (size_t r = 0; r < n / 32; ++r) {
+      for (size_t i = 0; i < 32; ++i) p[i] = pool.malloc();
+      for (size_t i = 0; i < 32; ++i) pool.free(p[i]);
+    }
+    m.report("mempool Fixed<32, 64> 32x malloc, 32x free fifo", n);
+  }
+  {
+    MemoryPool::Variable<32, 128> pool;
+    Measurement m;
+    for (size_t i = 0; i < n; ++i) {
+      void* p = pool.malloc(16 + (i % 8) * 32);
+      TEST_ASSERT_NOT_NULL(p);
+      pool.free(p);
+    }
+    m.report("mempool Variable<32, 128> malloc+free", n);
+  }
+  {
+    MemoryPool::Variable<32, 128> pool;
+    void* p[16];
+    Measurement m;
+    for (size_t r = 0; r < n / 16; ++r) {
+      for (size_t i = 0; i < 16; ++i) p[i] = pool.malloc(16 + ((r + i) % 8) * 32);
+      // free every other block first to fragment the pool
+      for (size_t i = 0; i < 16; i += 2) pool.free(p[i]);
+      for (size_t i = 1; i < 16; i += 2) pool.free(p[i]);
+    }
+    m.report("mempool Variable<32, 128> 16x malloc, 16x free mixed", n);
+  }
+  {
+    Measurement m;
+    for (size_t i = 0; i < n; ++i) {
+      void* p = malloc(16 + (i % 8) * 32);
+      TEST_ASSERT_NOT_NULL(p);
+      free(p);
+    }
+    m.report("heap malloc+free (reference)", n);
+  }
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_benchmark_parser);
+  RUN_TEST(test_benchmark_packet);
+  RUN_TEST(test_benchmark_outbox);
+  RUN_TEST(test_benchmark_router);
+  RUN_TEST(test_benchmark_memoryPool);
+  return UNITY_END();
+}
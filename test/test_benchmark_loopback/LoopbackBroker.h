@@ -0,0 +1,333 @@
+/*
+Minimal in-process MQTT 3.1.1 broker stand-in for end-to-end tests and benchmarks.
+
+Listens on loopback TCP (127.0.0.1, ephemeral port) and runs in its own thread.
+Supports CONNECT, SUBSCRIBE/UNSUBSCRIBE with + and # wildcards, PINGREQ, DISCONNECT
+and PUBLISH with the QoS 0, 1 and 2 acknowledgement flows in both directions.
+No sessions, retained messages or wills. QoS 2 messages are forwarded on receipt of PUBLISH.
+*/
+
+#pragma once
+
+#include <poll.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+class LoopbackBroker {
+ public:
+  LoopbackBroker()
+  : _listenFd(-1)
+  , _port(0)
+  , _running(false)
+  , _thread()
+  , _sessions() {}
+
+  ~LoopbackBroker() {
+    stop();
+  }
+
+  bool start() {
+    _listenFd = ::socket(AF_INET, SOCK_STREAM, 0);
+    if (_listenFd < 0) return false;
+    int flag = 1;
+    setsockopt(_listenFd, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag));
+    sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = 0;
+    socklen_t length = sizeof(address);
+    if (::bind(_listenFd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0 ||
+        ::listen(_listenFd, 4) < 0 ||
+        ::getsockname(_listenFd, reinterpret_cast<sockaddr*>(&address), &length) < 0) {
+      ::close(_listenFd);
+      _listenFd = -1;
+      return false;
+    }
+    _port = ntohs(address.sin_port);
+    _running = true;
+    _thread = std::thread([this] { _run(); });
+    return true;
+  }
+
+  void stop() {
+    _running = false;
+    if (_thread.joinable()) _thread.join();
+    _sessions.clear();
+    if (_listenFd >= 0) ::close(_listenFd);
+    _listenFd = -1;
+  }
+
+  uint16_t port() const {
+    return _port;
+  }
+
+ private:
+  struct Session {
+    explicit Session(int f)
+    : fd(f)
+    , in()
+    , out()
+    , subscriptions()
+    , nextPacketId(0) {}
+    ~Session() {
+      ::close(fd);
+    }
+    int fd;
+    std::vector<uint8_t> in;
+    std::vector<uint8_t> out;
+    std::vector<std::pair<std::string, uint8_t>> subscriptions;
+    uint16_t nextPacketId;
+  };
+
+  int _listenFd;
+  uint16_t _port;
+  std::atomic<bool> _running;
+  std::thread _thread;
+  std::vector<std::unique_ptr<Session>> _sessions;
+
+  void _run() {
+    std::vector<pollfd> fds;
+    while (_running) {
+      fds.clear();
+      fds.push_back({_listenFd, POLLIN, 0});
+      for (const std::unique_ptr<Session>& session : _sessions) {
+        fds.push_back({session->fd, static_cast<int16_t>(POLLIN | (session->out.empty() ? 0 : POLLOUT)), 0});
+      }
+      if (::poll(fds.data(), fds.size(), 10) <= 0) continue;
+      if (fds[0].revents & POLLIN) _accept();
+      // sessions accepted in this round are not in fds yet
+      for (size_t i = fds.size() - 1; i > 0; --i) {
+        Session& session = *_sessions[i - 1];
+        bool alive = true;
+        if (fds[i].revents & (POLLERR | POLLHUP)) alive = false;
+        if (alive && (fds[i].revents & POLLIN)) alive = _read(&session);
+        if (alive && (fds[i].revents & POLLOUT)) alive = _flush(&session);
+        if (!alive) _sessions.erase(_sessions.begin() + (i - 1));
+      }
+    }
+  }
+
+  void _accept() {
+    int fd = ::accept(_listenFd, nullptr, nullptr);
+    if (fd < 0) return;
+    int flag = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    _sessions.emplace_back(new Session(fd));
+  }
+
+  bool _read(Session* session) {
+    uint8_t buffer[4096];
+    ssize_t length = ::recv(session->fd, buffer, sizeof(buffer), 0);
+    if (length == 0) return false;
+    if (length < 0) return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+    session->in.insert(session->in.end(), buffer, buffer + length);
+    size_t index = 0;
+    while (session->in.size() - index >= 2) {
+      // decode remaining length
+      size_t remainingLength = 0;
+      size_t multiplier = 1;
+      size_t position = index + 1;
+      bool complete = false;
+      while (position < session->in.size() && position < index + 5) {
+        uint8_t encoded = session->in[position++];
+        remainingLength += (encoded & 0x7F) * multiplier;
+        multiplier *= 128;
+        if ((encoded & 0x80) == 0) {
+          complete = true;
+          break;
+        }
+      }
+      if (!complete) {
+        if (position == index + 5) return false;  // malformed remaining length
+        break;
+      }
+      if (session->in.size() - position < remainingLength) break;
+      if (!_handle(session, session->in[index], &session->in[position], remainingLength)) return false;
+      index = position + remainingLength;
+    }
+    session->in.erase(session->in.begin(), session->in.begin() + index);
+    return true;
+  }
+
+  bool _flush(Session* session) {
+    while (!session->out.empty()) {
+      ssize_t length = ::send(session->fd, session->out.data(), session->out.size(), MSG_NOSIGNAL);
+      if (length < 0) return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+      session->out.erase(session->out.begin(), session->out.begin() + length);
+    }
+    return true;
+  }
+
+  static uint16_t _uint16(const uint8_t* data) {
+    return (data[0] << 8) | data[1];
+  }
+
+  static void _appendUint16(std::vector<uint8_t>* buffer, uint16_t value) {
+    buffer->push_back(value >> 8);
+    buffer->push_back(value & 0xFF);
+  }
+
+  void _send(Session* session, uint8_t header, const std::vector<uint8_t>& body) {
+    std::vector<uint8_t>& out = session->out;
+    bool idle = out.empty();
+    out.push_back(header);
+    size_t remainingLength = body.size();
+    do {
+      uint8_t encoded = remainingLength % 128;
+      remainingLength /= 128;
+      out.push_back(remainingLength > 0 ? encoded | 0x80 : encoded);
+    } while (remainingLength > 0);
+    out.insert(out.end(), body.begin(), body.end());
+    if (idle) _flush(session);
+  }
+
+  void _sendAck(Session* session, uint8_t header, uint16_t packetId) {
+    std::vector<uint8_t> body;
+    _appendUint16(&body, packetId);
+    _send(session, header, body);
+  }
+
+  bool _handle(Session* session, uint8_t header, const uint8_t* data, size_t length) {
+    switch (header & 0xF0) {
+      case 0x10:  // CONNECT
+        _send(session, 0x20, {0x00, 0x00});
+        return true;
+      case 0x30:  // PUBLISH
+        return _onPublish(session, header, data, length);
+      case 0x40:  // PUBACK
+        return length == 2;
+      case 0x50:  // PUBREC
+        if (length != 2) return false;
+        _sendAck(session, 0x62, _uint16(data));
+        return true;
+      case 0x60:  // PUBREL
+        if (length != 2) return false;
+        _sendAck(session, 0x70, _uint16(data));
+        return true;
+      case 0x70:  // PUBCOMP
+        return length == 2;
+      case 0x80:  // SUBSCRIBE
+        return _onSubscribe(session, data, length);
+      case 0xA0:  // UNSUBSCRIBE
+        return _onUnsubscribe(session, data, length);
+      case 0xC0:  // PINGREQ
+        _send(session, 0xD0, {});
+        return true;
+      default:  // DISCONNECT or invalid
+        return false;
+    }
+  }
+
+  bool _onPublish(Session* session, uint8_t header, const uint8_t* data, size_t length) {
+    uint8_t qos = (header >> 1) & 0x03;
+    if (qos > 2 || length < 2) return false;
+    size_t topicLength = _uint16(data);
+    size_t index = 2 + topicLength + (qos > 0 ? 2 : 0);
+    if (index > length) return false;
+    std::string topic(reinterpret_cast<const char*>(data + 2), topicLength);
+    if (qos == 1) _sendAck(session, 0x40, _uint16(data + 2 + topicLength));
+    if (qos == 2) _sendAck(session, 0x50, _uint16(data + 2 + topicLength));
+    for (const std::unique_ptr<Session>& receiver : _sessions) {
+      for (const std::pair<std::string, uint8_t>& subscription : receiver->subscriptions) {
+        if (_matches(subscription.first, topic)) {
+          _forward(receiver.get(), topic, std::min(qos, subscription.second), data + index, length - index);
+          break;
+        }
+      }
+    }
+    return true;
+  }
+
+  void _forward(Session* session, const std::string& topic, uint8_t qos, const uint8_t* payload, size_t length) {
+    std::vector<uint8_t> body;
+    body.reserve(2 + topic.size() + 2 + length);
+    _appendUint16(&body, topic.size());
+    body.insert(body.end(), topic.begin(), topic.end());
+    if (qos > 0) {
+      session->nextPacketId = session->nextPacketId % 65535 + 1;
+      _appendUint16(&body, session->nextPacketId);
+    }
+    body.insert(body.end(), payload, payload + length);
+    _send(session, 0x30 | (qos << 1), body);
+  }
+
+  bool _onSubscribe(Session* session, const uint8_t* data, size_t length) {
+    if (length < 2) return false;
+    std::vector<uint8_t> body;
+    _appendUint16(&body, _uint16(data));
+    size_t index = 2;
+    while (index + 2 < length) {
+      size_t topicLength = _uint16(data + index);
+      if (index + 2 + topicLength >= length) return false;
+      std::string filter(reinterpret_cast<const char*>(data + index + 2), topicLength);
+      uint8_t qos = std::min<uint8_t>(data[index + 2 + topicLength], 2);
+      _removeSubscription(session, filter);
+      session->subscriptions.emplace_back(filter, qos);
+      body.push_back(qos);
+      index += 2 + topicLength + 1;
+    }
+    _send(session, 0x90, body);
+    return true;
+  }
+
+  bool _onUnsubscribe(Session* session, const uint8_t* data, size_t length) {
+    if (length < 2) return false;
+    size_t index = 2;
+    while (index + 2 <= length) {
+      size_t topicLength = _uint16(data + index);
+      if (index + 2 + topicLength > length) return false;
+      _removeSubscription(session, std::string(reinterpret_cast<const char*>(data + index + 2), topicLength));
+      index += 2 + topicLength;
+    }
+    _sendAck(session, 0xB0, _uint16(data));
+    return true;
+  }
+
+  static void _removeSubscription(Session* session, const std::string& filter) {
+    for (size_t i = 0; i < session->subscriptions.size(); ++i) {
+      if (session->subscriptions[i].first == filter) {
+        session->subscriptions.erase(session->subscriptions.begin() + i);
+        return;
+      }
+    }
+  }
+
+  static std::vector<std::string> _levels(const std::string& topic) {
+    std::vector<std::string> levels;
+    size_t start = 0;
+    size_t end = 0;
+    while ((end = topic.find('/', start)) != std::string::npos) {
+      levels.push_back(topic.substr(start, end - start));
+      start = end + 1;
+    }
+    levels.push_back(topic.substr(start));
+    return levels;
+  }
+
+  static bool _matches(const std::string& filter, const std::string& topic) {
+    if (!topic.empty() && topic[0] == '$' && !filter.empty() && (filter[0] == '+' || filter[0] == '#')) return false;
+    std::vector<std::string> filterLevels = _levels(filter);
+    std::vector<std::string> topicLevels = _levels(topic);
+    for (size_t i = 0; i < filterLevels.size(); ++i) {
+      if (filterLevels[i] == "#") return true;  // also matches the parent level
+      if (i >= topicLevels.size()) return false;
+      if (filterLevels[i] != "+" && filterLevels[i] != topicLevels[i]) return false;
+    }
+    return filterLevels.size() == topicLevels.size();
+  }
+};
@@ -0,0 +1,191 @@
+/*
+End-to-end benchmark of espMqttClient against an in-process broker over loopback TCP.
+Run with `pio test -e native-benchmark -v`. For every QoS and payload size, it reports the
+message rate and the latency percentiles, unloaded (window 1) and loaded, from publish to delivery back to the client and,
+for QoS 1 and 2, from publish to acknowledgement (PUBACK or PUBCOMP).
+*/
+
+#include <unity.h>
+#include <stdio.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>  // NOLINT [build/c++11]
+#include <mutex>  // NOLINT [build/c++11]
+#include <thread>  // NOLINT [build/c++11]
+#include <unordered_map>
+#include <vector>
+#include <espMqttClient.h>
+
+#include "LoopbackBroker.h"
+
+typedef std::chrono::steady_clock Clock;
+
+void setUp() {}
+void tearDown() {}
+
+LoopbackBroker broker;
+espMqttClient mqttClient;
+std::atomic<bool> exitProgram(false);
+std::thread t;
+
+// state of the running benchmark, shared with the callbacks on the loop thread
+struct Run {
+  std::vector<Clock::time_point> published;
+  std::vector<double> deliveryLatency;
+  std::vector<double> ackLatency;
+  std::unordered_map<uint16_t, size_t> inflight;  // packetId -> sequence number
+  std::mutex mtx;
+  std::atomic<size_t> delivered;
+  std::atomic<size_t> acked;
+  size_t sequence;  // sequence number of the message being delivered
+} run;
+
+static double microseconds(Clock::time_point from, Clock::time_point to) {
+  return std::chrono::duration<double, std::micro>(to - from).count();
+}
+
+static double percentile(std::vector<double>* values, double p) {
+  if (values->empty()) return 0;
+  size_t index = std::min(values->size() - 1, static_cast<size_t>(p / 100.0 * values->size()));
+  std::nth_element(values->begin(), values->begin() + index, values->end());
+  return (*values)[index];
+}
+
+static bool waitFor(const std::function<bool()>& condition, uint32_t timeout) {
+  uint32_t start = millis();
+  while (!condition()) {
+    if (millis() - start > timeout) return false;
+    std::this_thread::yield();
+  }
+  return true;
+}
+
+void test_connect() {
+  TEST_ASSERT_TRUE(broker.start());
+  mqttClient.setServer(IPAddress(127, 0, 0, 1), broker.port())
+            .setCleanSession(true)
+            .setKeepAlive(60);
+  mqttClient.onMessage([](const espMqttClientTypes::MessageProperties& properties, const char* topic, const uint8_t* payload, size_t len, size_t index, size_t total) {
+    (void) properties;
+    (void) topic;
+    Clock::time_point now = Clock::now();
+    if (index == 0 && len >= 4) {
+      run.sequence = (payload[0] << 24) | (payload[1] << 16) | (payload[2] << 8) | payload[3];
+    }
+    if (index + len == total && run.sequence < run.published.size()) {
+      run.deliveryLatency[run.sequence] = microseconds(run.published[run.sequence], now);
+      ++run.delivered;
+    }
+  });
+  mqttClient.onPublish([](uint16_t packetId) {
+    Clock::time_point now = Clock::now();
+    std::lock_guard<std::mutex> lock(run.mtx);
+    std::unordered_map<uint16_t, size_t>::iterator it = run.inflight.find(packetId);
+    if (it != run.inflight.end()) {
+      run.ackLatency[it->second] = microseconds(run.published[it->second], now);
+      run.inflight.erase(it);
+      ++run.acked;
+    }
+  });
+  mqttClient.connect();
+  TEST_ASSERT_TRUE(waitFor([] { return mqttClient.connected(); }, 2000));
+}
+
+static void benchmark(uint8_t qos, size_t payloadSize, size_t numberMessages, size_t window) {
+  char topic[32];
+  snprintf(topic, sizeof(topic), "benchmark/qos%u", qos);
+  std::atomic<bool> subscribed(false);
+  mqttClient.onSubscribe([&](uint16_t packetId, const espMqttClientTypes::SubscribeReturncode* returncodes, size_t len) {
+    (void) packetId;
+    (void) returncodes;
+    (void) len;
+    subscribed = true;
+  });
+  TEST_ASSERT_GREATER_THAN_UINT16(0, mqttClient.subscribe(topic, qos));
+  TEST_ASSERT_TRUE(waitFor([&] { return subscribed.load(); }, 2000));
+
+  run.published.assign(numberMessages, Clock::time_point());
+  run.deliveryLatency.assign(numberMessages, 0);
+  run.ackLatency.assign(numberMessages, 0);
+  run.inflight.clear();
+  run.delivered = 0;
+  run.acked = 0;
+  run.sequence = numberMessages;
+  std::vector<uint8_t> payload(payloadSize, 0xAA);
+
+  Clock::time_point start = Clock::now();
+  for (size_t i = 0; i < numberMessages; ++i) {
+    // limit the messages in flight so the outbox and socket buffers stay bounded
+    TEST_ASSERT_TRUE(waitFor([&] { return i - run.delivered < window; }, 5000));
+    payload[0] = i >> 24;
+    payload[1] = i >> 16;
+    payload[2] = i >> 8;
+    payload[3] = i;
+    uint16_t packetId = 0;
+    while (packetId == 0) {
+      std::lock_guard<std::mutex> lock(run.mtx);
+      run.published[i] = Clock::now();
+      packetId = mqttClient.publish(topic, qos, false, payload.data(), payload.size());
+      if (packetId != 0 && qos > 0) run.inflight[packetId] = i;
+    }
+  }
+  bool complete = waitFor([&] { return run.delivered == numberMessages && (qos == 0 || run.acked == numberMessages); }, 10000);
+  double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+  printf("qos %u payload %5zu window %2zu: %9.0f msg/s | delivery p50 %7.1f p90 %7.1f p99 %7.1f max %8.1f us",
+         qos, payloadSize, window, numberMessages / seconds,
+         percentile(&run.deliveryLatency, 50), percentile(&run.deliveryLatency, 90),
+         percentile(&run.deliveryLatency, 99), percentile(&run.deliveryLatency, 100));
+  if (qos > 0) {
+    printf(" | ack p50 %7.1f p99 %7.1f us", percentile(&run.ackLatency, 50), percentile(&run.ackLatency, 99));
+  }
+  printf("\n");
+
+  TEST_ASSERT_TRUE(complete);
+  TEST_ASSERT_EQUAL_UINT32(numberMessages, run.delivered);
+  mqttClient.unsubscribe(topic);
+}
+
+void test_qos0() {
+  benchmark(0, 16, 1000, 1);
+  benchmark(0, 16, 5000, 32);
+  benchmark(0, 256, 5000, 32);
+  benchmark(0, 4096, 2000, 32);
+}
+
+void test_qos1() {
+  benchmark(1, 16, 1000, 1);
+  benchmark(1, 16, 5000, 32);
+  benchmark(1, 256, 5000, 32);
+  benchmark(1, 4096, 2000, 32);
+}
+
+void test_qos2() {
+  benchmark(2, 16, 1000, 1);
+  benchmark(2, 16, 5000, 32);
+  benchmark(2, 256, 5000, 32);
+  benchmark(2, 4096, 2000, 32);
+}
+
+void test_disconnect() {
+  mqttClient.disconnect();
+  TEST_ASSERT_TRUE(waitFor([] { return mqttClient.disconnected(); }, 2000));
+}
+
+int main() {
+  UNITY_BEGIN();
+  t = std::thread([] {
+    while (!exitProgram) {
+      mqttClient.loop();
+    }
+  });
+  RUN_TEST(test_connect);
+  RUN_TEST(test_qos0);
+  RUN_TEST(test_qos1);
+  RUN_TEST(test_qos2);
+  RUN_TEST(test_disconnect);
+  exitProgram = true;
+  t.join();
+  broker.stop();
+  return UNITY_END();
+}
@@ -0,0 +1,93 @@
+#include <unity.h>
+#include <functional>
+
+#include <Callbacks.h>
+
+using espMqttClientInternals::Callbacks;
+
+void setUp() {}
+void tearDown() {}
+
+typedef std::function<void(int value)> Callback;
+
+void test_callbacks_call() {
+  Callbacks<Callback, 3> callbacks;
+  int sum = 0;
+  TEST_ASSERT_TRUE(callbacks.empty());
+  int handle1 = callbacks.add([&](int value) { sum += value; }, 1);
+  int handle2 = callbacks.add([&](int value) { sum += 10 * value; }, 2);
+  int handle3 = callbacks.add([&](int value) { sum += 100 * value; }, 3);
+  TEST_ASSERT_EQUAL_INT(0, handle1);
+  TEST_ASSERT_EQUAL_INT(1, handle2);
+  TEST_ASSERT_EQUAL_INT(2, handle3);
+  TEST_ASSERT_EQUAL_INT(-1, callbacks.add([&](int value) { sum += 1000 * value; }, 4));
+  TEST_ASSERT_FALSE(callbacks.empty());
+
+  callbacks.call(1);
+  TEST_ASSERT_EQUAL_INT(111, sum);
+
+  sum = 0;
+  callbacks.remove(handle1);
+  callbacks.remove(handle1);  // already removed
+  callbacks.remove(-1);  // invalid handle
+  callbacks.remove(3);  // out of range
+  callbacks.call(1);
+  TEST_ASSERT_EQUAL_INT(110, sum);
+
+  // there is room again, the free slot is reused
+  TEST_ASSERT_EQUAL_INT(0, callbacks.add([&](int value) { sum += 1000 * value; }, 4));
+  sum = 0;
+  callbacks.call(2);
+  TEST_ASSERT_EQUAL_INT(2220, sum);
+}
+
+void test_callbacks_find() {
+  Callbacks<Callback, 3> callbacks;
+  int sum = 0;
+  callbacks.add([&](int value) { sum += value; }, 7);
+  callbacks.add([&](int value) { sum += 10 * value; }, 8);
+  TEST_ASSERT_EQUAL_INT(0, callbacks.find(7));
+  TEST_ASSERT_EQUAL_INT(1, callbacks.find(8));
+  TEST_ASSERT_EQUAL_INT(-1, callbacks.find(9));
+
+  // removing by id leaves the other handle valid
+  callbacks.remove(callbacks.find(7));
+  TEST_ASSERT_EQUAL_INT(-1, callbacks.find(7));
+  callbacks.remove(callbacks.find(9));  // unknown id
+  callbacks.call(1);
+  TEST_ASSERT_EQUAL_INT(10, sum);
+  callbacks.remove(1);
+  TEST_ASSERT_TRUE(callbacks.empty());
+}
+
+void test_callbacks_removeWhileCalling() {
+  Callbacks<Callback, 3> callbacks;
+  int calls = 0;
+  callbacks.add([&](int value) {
+    (void) value;
+    ++calls;
+    TEST_ASSERT_TRUE(callbacks.calling());
+    callbacks.remove(0);
+    callbacks.remove(1);
+  }, 1);
+  callbacks.add([&](int value) {
+    (void) value;
+    ++calls;
+  }, 2);
+
+  // removed callbacks are not called anymore, even during the same call
+  callbacks.call(0);
+  TEST_ASSERT_EQUAL_INT(1, calls);
+  TEST_ASSERT_FALSE(callbacks.calling());
+  TEST_ASSERT_TRUE(callbacks.empty());
+  callbacks.call(0);
+  TEST_ASSERT_EQUAL_INT(1, calls);
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_callbacks_call);
+  RUN_TEST(test_callbacks_find);
+  RUN_TEST(test_callbacks_removeWhileCalling);
+  return UNITY_END();
+}
@@ -0,0 +1,240 @@
+#include <unity.h>
+
+#include <poll.h>
+#include <chrono>  // NOLINT [build/c++11]
+#include <Transport/ClientPosix.h>
+
+using espMqttClientInternals::ClientPosix;
+
+void setUp() {}
+void tearDown() {}
+
+class TestClient : public ClientPosix {
+ public:
+  bool connectTo(const char* const* ips, size_t count, uint16_t port) {
+    stop();
+    _port = port;
+    _addresses.clear();
+    for (size_t i = 0; i < count; ++i) {
+      Address address;
+      memset(&address, 0, sizeof(address));
+      if (strchr(ips[i], ':')) {
+        sockaddr_in6* host = reinterpret_cast<sockaddr_in6*>(&address.address);
+        host->sin6_family = AF_INET6;
+        inet_pton(AF_INET6, ips[i], &host->sin6_addr);
+        address.length = sizeof(sockaddr_in6);
+      } else {
+        sockaddr_in* host = reinterpret_cast<sockaddr_in*>(&address.address);
+        host->sin_family = AF_INET;
+        inet_pton(AF_INET, ips[i], &host->sin_addr);
+        address.length = sizeof(sockaddr_in);
+      }
+      _addresses.push_back(address);
+    }
+    return _startConnecting();
+  }
+  bool resolving() const {
+    return _resolution != nullptr;
+  }
+};
+
+// listening socket on an ephemeral port, or on the given port
+static int listenOn(int family, uint16_t* port) {
+  int fd = ::socket(family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  sockaddr_storage address;
+  memset(&address, 0, sizeof(address));
+  socklen_t length;
+  if (family == AF_INET6) {
+    sockaddr_in6* host = reinterpret_cast<sockaddr_in6*>(&address);
+    host->sin6_family = AF_INET6;
+    host->sin6_addr = in6addr_loopback;
+    host->sin6_port = htons(*port);
+    length = sizeof(sockaddr_in6);
+  } else {
+    sockaddr_in* host = reinterpret_cast<sockaddr_in*>(&address);
+    host->sin_family = AF_INET;
+    host->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    host->sin_port = htons(*port);
+    length = sizeof(sockaddr_in);
+  }
+  TEST_ASSERT_EQUAL_INT(0, ::bind(fd, reinterpret_cast<sockaddr*>(&address), length));
+  TEST_ASSERT_EQUAL_INT(0, ::listen(fd, 4));
+  TEST_ASSERT_EQUAL_INT(0, ::getsockname(fd, reinterpret_cast<sockaddr*>(&address), &length));
+  *port = ntohs(family == AF_INET6 ? reinterpret_cast<sockaddr_in6*>(&address)->sin6_port : reinterpret_cast<sockaddr_in*>(&address)->sin_port);
+  return fd;
+}
+
+// wait on the descriptor of the client like MqttClient::loop(timeout) does, returns the time it took
+static uint32_t waitConnected(TestClient* client, uint32_t timeout) {
+  auto start = std::chrono::steady_clock::now();
+  uint32_t elapsed = 0;
+  while (!client->connected() && !client->disconnected() && elapsed < timeout) {
+    pollfd pfd;
+    pfd.fd = client->fd();
+    pfd.events = POLLIN | POLLOUT;
+    pfd.revents = 0;
+    ::poll(&pfd, 1, timeout - elapsed);
+    elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+  }
+  return elapsed;
+}
+
+/*
+- the first address doesn't answer (or fails, depending on the network)
+- the second address is started after the connect delay and wins
+*/
+void test_connectRace() {
+  uint16_t port = 0;
+  int listener = listenOn(AF_INET, &port);
+  TestClient client;
+  const char* ips[] = {"10.255.255.1", "127.0.0.1"};
+
+  TEST_ASSERT_TRUE(client.connectTo(ips, 2, port));
+  uint32_t elapsed = waitConnected(&client, 2000);
+
+  TEST_ASSERT_TRUE(client.connected());
+  TEST_ASSERT_LESS_THAN_UINT32(EMC_POSIX_CONNECT_DELAY + 500, elapsed);
+  int accepted = ::accept(listener, nullptr, nullptr);
+  TEST_ASSERT_GREATER_OR_EQUAL_INT(0, accepted);
+
+  client.stop();
+  ::close(accepted);
+  ::close(listener);
+}
+
+/*
+- the first address refuses the connection
+- the next address (IPv6) is tried right away, without waiting for the connect delay
+*/
+void test_connectFailover() {
+  uint16_t port = 0;
+  int listener = listenOn(AF_INET6, &port);
+  TestClient client;
+  const char* ips[] = {"127.0.0.1", "::1"};
+
+  TEST_ASSERT_TRUE(client.connectTo(ips, 2, port));
+  uint32_t elapsed = waitConnected(&client, 2000);
+
+  TEST_ASSERT_TRUE(client.connected());
+  TEST_ASSERT_LESS_THAN_UINT32(EMC_POSIX_CONNECT_DELAY, elapsed);
+
+  client.stop();
+  ::close(listener);
+}
+
+/*
+- no address accepts the connection
+- the client ends up disconnected
+*/
+void test_connectFail() {
+  uint16_t port = 0;
+  int listener = listenOn(AF_INET, &port);
+  ::close(listener);  // port is now closed
+  TestClient client;
+  const char* ips[] = {"127.0.0.1", "::1"};
+
+  if (client.connectTo(ips, 2, port)) {
+    waitConnected(&client, 2000);
+  }
+
+  TEST_ASSERT_FALSE(client.connected());
+  TEST_ASSERT_TRUE(client.disconnected());
+}
+
+/*
+- connect to a hostname, the name is resolved
+- reconnect, the cached addresses are used
+*/
+void test_dnsCache() {
+  uint16_t port = 0;
+  int listener = listenOn(AF_INET, &port);
+  TestClient client;
+
+  TEST_ASSERT_TRUE(client.connect("localhost", port));
+  TEST_ASSERT_TRUE(client.resolving());
+  waitConnected(&client, 5000);
+  TEST_ASSERT_TRUE(client.connected());
+  client.stop();
+
+  TEST_ASSERT_TRUE(client.connect("localhost", port));
+  TEST_ASSERT_FALSE(client.resolving());
+  waitConnected(&client, 2000);
+  TEST_ASSERT_TRUE(client.connected());
+  client.stop();
+
+  ::close(listener);
+}
+
+// read what's available, waiting for it like MqttClient::loop(timeout) does
+static int readWait(TestClient* client, uint8_t* buf, size_t size, uint32_t timeout) {
+  pollfd pfd;
+  pfd.fd = client->fd();
+  pfd.events = POLLIN;
+  pfd.revents = 0;
+  ::poll(&pfd, 1, timeout);
+  return client->read(buf, size);
+}
+
+/*
+- the server supports TCP Fast Open
+- the first connection gets a cookie, the data of the reconnect is sent in the SYN
+*/
+void test_fastOpen() {
+  FILE* sysctl = fopen("/proc/sys/net/ipv4/tcp_fastopen", "r");
+  int mode = 0;
+  if (sysctl) {
+    if (fscanf(sysctl, "%d", &mode) != 1) mode = 0;
+    fclose(sysctl);
+  }
+  if ((mode & 0x3) != 0x3) {
+    TEST_IGNORE_MESSAGE("TCP Fast Open not enabled for client and server (net.ipv4.tcp_fastopen=3)");
+  }
+  uint16_t port = 0;
+  int listener = listenOn(AF_INET, &port);
+  int queue = 4;
+  TEST_ASSERT_EQUAL_INT(0, setsockopt(listener, IPPROTO_TCP, TCP_FASTOPEN, &queue, sizeof(queue)));
+  TestClient client;
+  client.setFastOpen(true);
+  const char* ips[] = {"127.0.0.1"};
+  const uint8_t request[] = {0x10, 0x00};
+  const uint8_t response[] = {0x20, 0x02, 0x00, 0x00};
+  uint8_t buf[8];
+
+  for (uint32_t connects = 1; connects <= 2; ++connects) {
+    TEST_ASSERT_TRUE(client.connectTo(ips, 1, port));
+    waitConnected(&client, 2000);
+    TEST_ASSERT_TRUE(client.connected());
+    TEST_ASSERT_EQUAL_UINT32(sizeof(request), client.write(request, sizeof(request)));
+
+    pollfd pfd;
+    pfd.fd = listener;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    ::poll(&pfd, 1, 2000);
+    int accepted = ::accept(listener, nullptr, nullptr);
+    TEST_ASSERT_GREATER_OR_EQUAL_INT(0, accepted);
+    TEST_ASSERT_EQUAL_INT(sizeof(request), ::recv(accepted, buf, sizeof(buf), 0));
+    TEST_ASSERT_EQUAL_INT(sizeof(response), ::send(accepted, response, sizeof(response), 0));
+    TEST_ASSERT_EQUAL_INT(sizeof(response), readWait(&client, buf, sizeof(buf), 2000));
+
+    TEST_ASSERT_EQUAL_UINT32(connects, client.getConnectionStats().connects);
+    client.stop();
+    ::close(accepted);
+  }
+
+  // the cookie of the first connection is used for the second
+  TEST_ASSERT_TRUE(client.getConnectionStats().fastOpen);
+  TEST_ASSERT_GREATER_OR_EQUAL_INT(1, client.getConnectionStats().fastOpenConnects);
+
+  ::close(listener);
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_connectRace);
+  RUN_TEST(test_connectFailover);
+  RUN_TEST(test_connectFail);
+  RUN_TEST(test_dnsCache);
+  RUN_TEST(test_fastOpen);
+  return UNITY_END();
+}
@@ -0,0 +1,377 @@
+#include <unity.h>
+
+#include <poll.h>
+#include <atomic>
+#include <chrono>  // NOLINT [build/c++11]
+#include <string>
+#include <vector>
+#include <thread>  // NOLINT [build/c++11]
+#include <Transport/ClientPosixSecure.h>
+
+void setUp() {}
+void tearDown() {}
+
+// the TLS transport is only built with EMC_POSIX_TLS=1 (and OpenSSL)
+#if EMC_POSIX_TLS
+
+using espMqttClientInternals::ClientPosixSecure;
+
+/*
+Minimal TLS echo server on 127.0.0.1 with a self-signed certificate for
+"localhost" and 127.0.0.1. Connections are handled one after the other.
+Session tickets are on by default so clients can resume.
+*/
+class EchoServer {
+ public:
+  EchoServer()
+  : port(0)
+  , certificate()
+  , _listener(-1)
+  , _ctx(nullptr)
+  , _running(false)
+  , _thread() {
+    EVP_PKEY_CTX* keyCtx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, nullptr);
+    EVP_PKEY* key = nullptr;
+    EVP_PKEY_keygen_init(keyCtx);
+    EVP_PKEY_CTX_set_ec_paramgen_curve_nid(keyCtx, NID_X9_62_prime256v1);
+    EVP_PKEY_keygen(keyCtx, &key);
+    EVP_PKEY_CTX_free(keyCtx);
+
+    X509* cert = X509_new();
+    X509_set_version(cert, 2);
+    ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+    X509_gmtime_adj(X509_getm_notBefore(cert), -3600);
+    X509_gmtime_adj(X509_getm_notAfter(cert), 3600);
+    X509_set_pubkey(cert, key);
+    X509_NAME* name = X509_get_subject_name(cert);
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, reinterpret_cast<const unsigned char*>("localhost"), -1, -1, 0);
+    X509_set_issuer_name(cert, name);
+    X509V3_CTX v3;
+    X509V3_set_ctx_nodb(&v3);
+    X509V3_set_ctx(&v3, cert, cert, nullptr, nullptr, 0);
+    X509_EXTENSION* extension = X509V3_EXT_conf_nid(nullptr, &v3, NID_subject_alt_name, "DNS:localhost,IP:127.0.0.1");
+    X509_add_ext(cert, extension, -1);
+    X509_EXTENSION_free(extension);
+    extension = X509V3_EXT_conf_nid(nullptr, &v3, NID_basic_constraints, "critical,CA:TRUE");
+    X509_add_ext(cert, extension, -1);
+    X509_EXTENSION_free(extension);
+    X509_sign(cert, key, EVP_sha256());
+
+    BIO* bio = BIO_new(BIO_s_mem());
+    PEM_write_bio_X509(bio, cert);
+    char* data = nullptr;
+    long length = BIO_get_mem_data(bio, &data);  // NOLINT(runtime/int)
+    certificate.assign(data, length);
+    BIO_free(bio);
+
+    _ctx = SSL_CTX_new(TLS_server_method());
+    SSL_CTX_use_certificate(_ctx, cert);
+    SSL_CTX_use_PrivateKey(_ctx, key);
+    X509_free(cert);
+    EVP_PKEY_free(key);
+
+    _listener = ::socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addressLength = sizeof(address);
+    ::bind(_listener, reinterpret_cast<sockaddr*>(&address), addressLength);
+    ::listen(_listener, 4);
+    ::getsockname(_listener, reinterpret_cast<sockaddr*>(&address), &addressLength);
+    port = ntohs(address.sin_port);
+
+    _running = true;
+    _thread = std::thread(&EchoServer::_run, this);
+  }
+
+  ~EchoServer() {
+    _running = false;
+    _thread.join();
+    ::close(_listener);
+    SSL_CTX_free(_ctx);
+  }
+
+  uint16_t port;
+  std::string certificate;  // PEM, to use as CA
+
+ private:
+  int _listener;
+  SSL_CTX* _ctx;
+  std::atomic<bool> _running;
+  std::thread _thread;
+
+  void _run() {
+    while (_running) {
+      pollfd pfd;
+      pfd.fd = _listener;
+      pfd.events = POLLIN;
+      pfd.revents = 0;
+      if (::poll(&pfd, 1, 50) <= 0) continue;
+      int fd = ::accept(_listener, nullptr, nullptr);
+      if (fd < 0) continue;
+      timeval timeout;
+      timeout.tv_sec = 0;
+      timeout.tv_usec = 50000;
+      setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+      SSL* ssl = SSL_new(_ctx);
+      SSL_set_fd(ssl, fd);
+      int ret = 0;
+      while (_running && (ret = SSL_accept(ssl)) != 1 && SSL_get_error(ssl, ret) == SSL_ERROR_WANT_READ) {}
+      if (ret == 1) {
+        uint8_t buf[256];
+        while (_running) {
+          ret = SSL_read(ssl, buf, sizeof(buf));
+          if (ret > 0) {
+            SSL_write(ssl, buf, ret);
+          } else if (SSL_get_error(ssl, ret) != SSL_ERROR_WANT_READ) {
+            break;
+          }
+        }
+      }
+      ERR_clear_error();
+      SSL_free(ssl);
+      ::close(fd);
+    }
+  }
+};
+
+static EchoServer* server = nullptr;
+
+// wait on the descriptor of the client like MqttClient::loop(timeout) does
+static void waitConnected(ClientPosixSecure* client, uint32_t timeout) {
+  auto start = std::chrono::steady_clock::now();
+  uint32_t elapsed = 0;
+  while (!client->connected() && !client->disconnected() && elapsed < timeout) {
+    pollfd pfd;
+    pfd.fd = client->fd();
+    pfd.events = POLLIN | POLLOUT;
+    pfd.revents = 0;
+    ::poll(&pfd, 1, timeout - elapsed);
+    elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+  }
+}
+
+// send a message and read the echo, this also handles the session tickets the server sends after the handshake
+static void echo(ClientPosixSecure* client) {
+  const uint8_t message[] = {0x30, 0x03, 0x00, 0x01, 0x41};
+  uint8_t buf[16];
+  TEST_ASSERT_EQUAL_UINT32(sizeof(message), client->write(message, sizeof(message)));
+  int length = -1;
+  for (int i = 0; i < 100 && length <= 0; ++i) {
+    pollfd pfd;
+    pfd.fd = client->fd();
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    ::poll(&pfd, 1, 20);
+    length = client->read(buf, sizeof(buf));
+  }
+  TEST_ASSERT_EQUAL_INT(sizeof(message), length);
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(message, buf, sizeof(message));
+}
+
+/*
+- verify the server against its certificate
+- a full handshake is made
+*/
+void test_handshake() {
+  ClientPosixSecure client;
+  TEST_ASSERT_TRUE(client.setCACert(server->certificate.c_str()));
+
+  TEST_ASSERT_TRUE(client.connect("localhost", server->port));
+  waitConnected(&client, 2000);
+
+  TEST_ASSERT_TRUE(client.connected());
+  echo(&client);
+  espMqttClientTypes::ConnectionStats stats = client.getConnectionStats();
+  TEST_ASSERT_EQUAL_UINT32(1, stats.handshakes);
+  TEST_ASSERT_EQUAL_UINT32(0, stats.resumedHandshakes);
+  TEST_ASSERT_FALSE(stats.resumed);
+  TEST_ASSERT_GREATER_THAN_UINT32(0, stats.handshakeTime);
+  client.stop();
+  TEST_ASSERT_TRUE(client.disconnected());
+}
+
+/*
+- connect and disconnect
+- reconnect, the session of the first connection is resumed
+*/
+void test_resume() {
+  ClientPosixSecure client;
+  client.setCACert(server->certificate.c_str());
+
+  for (int i = 0; i < 3; ++i) {
+    TEST_ASSERT_TRUE(client.connect("localhost", server->port));
+    waitConnected(&client, 2000);
+    TEST_ASSERT_TRUE(client.connected());
+    echo(&client);
+    client.stop();
+  }
+
+  espMqttClientTypes::ConnectionStats stats = client.getConnectionStats();
+  TEST_ASSERT_EQUAL_UINT32(3, stats.handshakes);
+  TEST_ASSERT_EQUAL_UINT32(2, stats.resumedHandshakes);
+  TEST_ASSERT_TRUE(stats.resumed);
+}
+
+/*
+- the server certificate is not trusted
+- the connection fails
+*/
+void test_untrusted() {
+  ClientPosixSecure client;
+
+  TEST_ASSERT_TRUE(client.connect("localhost", server->port));
+  waitConnected(&client, 2000);
+
+  TEST_ASSERT_FALSE(client.connected());
+  TEST_ASSERT_TRUE(client.disconnected());
+  TEST_ASSERT_EQUAL_UINT32(0, client.getConnectionStats().handshakes);
+}
+
+/*
+- connect by address, the certificate is verified against the IP address
+- without verification, the connection is also made
+*/
+void test_address() {
+  ClientPosixSecure client;
+  client.setCACert(server->certificate.c_str());
+
+  TEST_ASSERT_TRUE(client.connect(IPAddress(127, 0, 0, 1), server->port));
+  waitConnected(&client, 2000);
+  TEST_ASSERT_TRUE(client.connected());
+  echo(&client);
+  client.stop();
+
+  ClientPosixSecure insecure;
+  insecure.setInsecure();
+  TEST_ASSERT_TRUE(insecure.connect(IPAddress(127, 0, 0, 1), server->port));
+  waitConnected(&insecure, 2000);
+  TEST_ASSERT_TRUE(insecure.connected());
+  echo(&insecure);
+  insecure.stop();
+}
+
+/*
+- ask for kernel TLS, which is used when the tls module is available
+- gathered writes are echoed correctly either way
+*/
+void test_kernelTls() {
+  ClientPosixSecure client;
+  client.setCACert(server->certificate.c_str());
+  client.setKernelTls(true);
+
+  TEST_ASSERT_TRUE(client.connect("localhost", server->port));
+  waitConnected(&client, 2000);
+  TEST_ASSERT_TRUE(client.connected());
+
+  // the stats match the upper layer protocol of the socket
+  char ulp[16] = {0};
+  socklen_t length = sizeof(ulp);
+  bool kernelTls = getsockopt(client.fd(), IPPROTO_TCP, TCP_ULP, ulp, &length) == 0 && strcmp(ulp, "tls") == 0;
+  TEST_ASSERT_EQUAL(kernelTls, client.getConnectionStats().kernelTls);
+
+  uint8_t header[] = {0x30, 0xC5, 0x01, 0x00, 0x01, 0x41};
+  uint8_t payload[192];
+  for (size_t i = 0; i < sizeof(payload); ++i) payload[i] = i;
+  espMqttClientInternals::WriteBuffer buffers[] = {{header, sizeof(header)}, {payload, sizeof(payload)}};
+  TEST_ASSERT_EQUAL_UINT32(sizeof(header) + sizeof(payload), client.writev(buffers, 2));
+  uint8_t buf[sizeof(header) + sizeof(payload)];
+  size_t received = 0;
+  for (int i = 0; i < 100 && received < sizeof(buf); ++i) {
+    pollfd pfd;
+    pfd.fd = client.fd();
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    ::poll(&pfd, 1, 20);
+    int ret = client.read(&buf[received], sizeof(buf) - received);
+    if (ret > 0) received += ret;
+  }
+  TEST_ASSERT_EQUAL_UINT32(sizeof(buf), received);
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(header, buf, sizeof(header));
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(payload, &buf[sizeof(header)], sizeof(payload));
+  client.stop();
+}
+
+/*
+- fill the connection with small gathered writes until OpenSSL asks to retry
+- offer the data again split up differently, starting with fewer bytes than the write to repeat
+- all data is echoed in order, nothing is lost or sent twice
+*/
+void test_wantWrite() {
+  ClientPosixSecure client;
+  client.setCACert(server->certificate.c_str());
+
+  TEST_ASSERT_TRUE(client.connect("localhost", server->port));
+  waitConnected(&client, 2000);
+  TEST_ASSERT_TRUE(client.connected());
+  echo(&client);
+  int size = 4096;
+  setsockopt(client.fd(), SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+  setsockopt(client.fd(), SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+  // the echo is not read, so the server stops reading and the socket fills up
+  std::vector<uint8_t> stream(1 << 22);
+  for (size_t i = 0; i < stream.size(); ++i) stream[i] = i % 251;
+  size_t sent = 0;
+  while (sent + 7 <= stream.size()) {
+    espMqttClientInternals::WriteBuffer buffers[] = {{&stream[sent], 3}, {&stream[sent + 3], 4}};
+    size_t written = client.writev(buffers, 2);
+    sent += written;
+    if (written < 7) break;
+  }
+  TEST_ASSERT_TRUE(client.connected());
+  TEST_ASSERT_LESS_THAN_UINT32(stream.size() - 7, sent);
+
+  size_t end = sent + 64;
+  std::vector<uint8_t> received(end);
+  size_t length = 0;
+  bool first = true;
+  for (int i = 0; i < 5000 && length < end && client.connected(); ++i) {
+    pollfd pfd;
+    pfd.fd = client.fd();
+    pfd.events = (sent < end) ? POLLIN | POLLOUT : POLLIN;
+    pfd.revents = 0;
+    ::poll(&pfd, 1, 20);
+    int ret = 0;
+    while (length < end && (ret = client.read(&received[length], end - length)) > 0) length += ret;
+    if (sent == end) continue;
+    if (first) {
+      sent += client.write(&stream[sent], 1);
+      first = false;
+    } else if (end - sent < 5) {
+      sent += client.write(&stream[sent], end - sent);
+    } else {
+      espMqttClientInternals::WriteBuffer buffers[] = {{&stream[sent], 2}, {&stream[sent + 2], 3}};
+      sent += client.writev(buffers, 2);
+    }
+  }
+  TEST_ASSERT_TRUE(client.connected());
+  TEST_ASSERT_EQUAL_UINT32(end, sent);
+  TEST_ASSERT_EQUAL_UINT32(end, length);
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(&stream[0], &received[0], end);
+  client.stop();
+}
+
+int main() {
+  server = new EchoServer;
+  UNITY_BEGIN();
+  RUN_TEST(test_handshake);
+  RUN_TEST(test_resume);
+  RUN_TEST(test_untrusted);
+  RUN_TEST(test_address);
+  RUN_TEST(test_kernelTls);
+  RUN_TEST(test_wantWrite);
+  int result = UNITY_END();
+  delete server;
+  return result;
+}
+
+#else
+
+int main() {
+  UNITY_BEGIN();
+  return UNITY_END();
+}
+
+#endif
@@ -1,6 +1,10 @@
 #include <unity.h>
 #include <thread>
 #include <iostream>
+#include <ctime>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
 #include <espMqttClient.h>  // espMqttClient for Linux also defines millis()
 
 void setUp() {}
@@ -14,6 +18,9 @@ uint32_t onUnsubscribeCbId = 4;
 uint32_t onMessageCbId = 5;
 uint32_t onPublishCbId = 6;
 std::atomic_bool exitProgram(false);
+std::atomic_bool blockingLoop(false);
+std::atomic_bool externalLoop(false);
+int reactorWakeFd = eventfd(0, EFD_NONBLOCK);
 std::thread t;
 
 //const IPAddress broker(127,0,0,1);
@@ -186,6 +193,184 @@ void test_publish_empty() {
 
 /*
 
+- limit the number of unacknowledged messages
+- client publishes more messages than the limit at qos 1 and qos 2
+- all messages are eventually acknowledged
+
+*/
+
+void test_publish_max_inflight() {
+  std::atomic<int> publishSendMaxInflightTest(0);
+  std::atomic<int> publishWriteMaxInflightTest(0);
+  std::atomic<int> publishOutstandingMaxInflightTest(0);
+  bool written[10] = {false};
+  mqttClient.setMaxInflight(2);
+  mqttClient.onPublish([&](uint16_t packetId) mutable {
+    (void) packetId;
+    publishSendMaxInflightTest++;
+  }, onPublishCbId);
+  for (int i = 0; i < 10; i++) {
+    // the payload is only fetched when the PUBLISH is written to the broker
+    mqttClient.publish("test/test", 1 + i % 2, false, [&, i](uint8_t* data, size_t maxSize, size_t index) mutable -> size_t {
+      if (!written[i]) {
+        written[i] = true;
+        int outstanding = ++publishWriteMaxInflightTest - publishSendMaxInflightTest;
+        if (outstanding > publishOutstandingMaxInflightTest) publishOutstandingMaxInflightTest = outstanding;
+      }
+      (void) index;
+      memset(data, 't', maxSize);
+      return maxSize;
+    }, 4);
+  }
+  uint32_t start = millis();
+  while (millis() - start < 6000) {
+    if (publishSendMaxInflightTest == 10) {
+      break;
+    }
+    std::this_thread::yield();
+  }
+
+  TEST_ASSERT_TRUE(mqttClient.connected());
+  TEST_ASSERT_EQUAL_INT(10, publishSendMaxInflightTest);
+  TEST_ASSERT_EQUAL_INT(10, publishWriteMaxInflightTest);
+  // never more than 2 PUBLISH packets written but not yet acknowledged
+  TEST_ASSERT_GREATER_THAN_INT(0, publishOutstandingMaxInflightTest);
+  TEST_ASSERT_LESS_OR_EQUAL_INT(2, publishOutstandingMaxInflightTest);
+
+  mqttClient.setMaxInflight(0);
+  mqttClient.removeOnPublish(onPublishCbId);
+}
+
+void test_publish_batch() {
+  std::atomic<int> publishSendBatchTest(0);
+  mqttClient.onPublish([&](uint16_t packetId) mutable {
+    (void) packetId;
+    publishSendBatchTest++;
+  }, onPublishCbId);
+  const uint8_t payload[] = {'t', 'e', 's', 't'};
+  espMqttClientTypes::PublishMessage messages[6];
+  for (int i = 0; i < 6; i++) {
+    messages[i] = {"test/test", static_cast<uint8_t>(i % 3), false, payload, sizeof(payload)};
+  }
+  uint16_t packetIds[6];
+  size_t queued = mqttClient.publishBatch(messages, 6, packetIds);
+  TEST_ASSERT_EQUAL_UINT32(6, queued);
+  for (int i = 0; i < 6; i++) {
+    if (i % 3 == 0) {
+      TEST_ASSERT_EQUAL_UINT16(1, packetIds[i]);
+    } else {
+      TEST_ASSERT_GREATER_THAN_UINT16(1, packetIds[i]);
+    }
+  }
+  uint32_t start = millis();
+  while (millis() - start < 6000) {
+    if (publishSendBatchTest == 4) {
+      break;
+    }
+    std::this_thread::yield();
+  }
+
+  TEST_ASSERT_TRUE(mqttClient.connected());
+  TEST_ASSERT_EQUAL_INT(4, publishSendBatchTest);
+  mqttClient.removeOnPublish(onPublishCbId);
+}
+
+void test_publish_zero_copy() {
+  std::atomic<int> publishSendZeroCopyTest(0);
+  std::atomic<int> publishReleaseZeroCopyTest(0);
+  mqttClient.onPublish([&](uint16_t packetId) mutable {
+    (void) packetId;
+    publishSendZeroCopyTest++;
+  }, onPublishCbId);
+  static uint8_t payload[1000];
+  memset(payload, 'x', sizeof(payload));
+  for (int i = 0; i < 3; i++) {
+    uint16_t packetId = mqttClient.publish("test/test", i, false, payload, sizeof(payload), [&](const uint8_t* p) {
+      if (p == payload) publishReleaseZeroCopyTest++;
+    });
+    TEST_ASSERT_GREATER_THAN_UINT16(0, packetId);
+  }
+  uint32_t start = millis();
+  while (millis() - start < 6000) {
+    if (publishSendZeroCopyTest == 2 && publishReleaseZeroCopyTest == 3) {
+      break;
+    }
+    std::this_thread::yield();
+  }
+
+  TEST_ASSERT_TRUE(mqttClient.connected());
+  TEST_ASSERT_EQUAL_INT(2, publishSendZeroCopyTest);
+  TEST_ASSERT_EQUAL_INT(3, publishReleaseZeroCopyTest);
+  mqttClient.removeOnPublish(onPublishCbId);
+}
+
+/*
+
+- publish a buffer without copying it, at qos 1
+- publish it again from the release callback, which runs without the client's lock
+- the buffer is released after every acknowledgement
+
+*/
+void test_publish_zero_copy_republish() {
+  std::atomic<int> publishSendRepublishTest(0);
+  std::atomic<int> publishReleaseRepublishTest(0);
+  mqttClient.onPublish([&](uint16_t packetId) mutable {
+    (void) packetId;
+    publishSendRepublishTest++;
+  }, onPublishCbId);
+  static uint8_t payload[100];
+  memset(payload, 'z', sizeof(payload));
+  espMqttClientTypes::PayloadReleaseCallback release;
+  release = [&](const uint8_t* p) {
+    if (++publishReleaseRepublishTest < 5) {
+      mqttClient.publish("test/test", 1, false, p, sizeof(payload), release);
+    }
+  };
+  TEST_ASSERT_GREATER_THAN_UINT16(0, mqttClient.publish("test/test", 1, false, payload, sizeof(payload), release));
+  uint32_t start = millis();
+  while (millis() - start < 6000) {
+    if (publishReleaseRepublishTest == 5) {
+      break;
+    }
+    std::this_thread::yield();
+  }
+
+  TEST_ASSERT_TRUE(mqttClient.connected());
+  TEST_ASSERT_EQUAL_INT(5, publishReleaseRepublishTest);
+  TEST_ASSERT_EQUAL_INT(5, publishSendRepublishTest);
+  mqttClient.removeOnPublish(onPublishCbId);
+}
+
+void test_publish_many() {
+  std::atomic<int> publishSendManyTest(0);
+  mqttClient.onPublish([&](uint16_t packetId) mutable {
+    (void) packetId;
+    publishSendManyTest++;
+  }, onPublishCbId);
+  const char* topics[] = {"test/test1", "test/test2", "test/test3"};
+  uint8_t payload[500];
+  memset(payload, 'y', sizeof(payload));
+  uint16_t packetIds[3];
+  size_t queued = mqttClient.publishMany(topics, 3, 1, false, payload, sizeof(payload), packetIds);
+  memset(payload, 0, sizeof(payload));  // payload has been copied
+  TEST_ASSERT_EQUAL_UINT32(3, queued);
+  TEST_ASSERT_NOT_EQUAL(packetIds[0], packetIds[1]);
+  TEST_ASSERT_NOT_EQUAL(packetIds[1], packetIds[2]);
+  uint32_t start = millis();
+  while (millis() - start < 6000) {
+    if (publishSendManyTest == 3) {
+      break;
+    }
+    std::this_thread::yield();
+  }
+
+  TEST_ASSERT_TRUE(mqttClient.connected());
+  TEST_ASSERT_EQUAL_INT(3, publishSendManyTest);
+  mqttClient.removeOnPublish(onPublishCbId);
+}
+
+/*
+
 - subscribe to test/test, qos 1
 - send to test/test, qos 1
 - check if message is received at least once.
@@ -261,6 +446,321 @@ void test_receive2() {
 }
 
 
+/*
+
+- receive on test/test without topic copy
+- check if topic view matches
+
+*/
+
+void test_receive_view() {
+  std::atomic<int> publishReceiveViewTest(0);
+  mqttClient.onMessageView([&](const espMqttClientTypes::MessageProperties& properties, const espMqttClientTypes::TopicView& topic, const uint8_t* payload, size_t len, size_t index, size_t total) mutable {
+    (void) properties;
+    (void) payload;
+    (void) len;
+    (void) index;
+    (void) total;
+    if (topic.length == 9 && strncmp(topic.data, "test/test", 9) == 0) publishReceiveViewTest++;
+  }, onMessageCbId);
+  mqttClient.publish("test/test", 0, false, "view");
+  uint32_t start = millis();
+  while (millis() - start < 2000) {
+    std::this_thread::yield();
+  }
+
+  TEST_ASSERT_TRUE(mqttClient.connected());
+  TEST_ASSERT_EQUAL_INT(1, publishReceiveViewTest);
+
+  mqttClient.removeOnMessageView(onMessageCbId);
+}
+
+/*
+
+- receive a payload larger than the receive buffer in one piece
+- messages larger than the maximum size arrive in fragments
+
+*/
+
+void test_receive_complete() {
+  std::atomic<int> completeReceived(0);
+  std::atomic<int> fragmentsReceived(0);
+  std::atomic<bool> payloadOk(false);
+  uint8_t payload[300];
+  for (size_t i = 0; i < sizeof(payload); ++i) payload[i] = i & 0xFF;
+  mqttClient.setMaxMessageSize(sizeof(payload));
+  mqttClient.onMessageComplete([&](const espMqttClientTypes::MessageProperties& properties, const char* topic, uint8_t* data, size_t len) mutable {
+    (void) properties;
+    payloadOk = strcmp(topic, "test/test") == 0 && len == sizeof(payload) && memcmp(data, payload, len) == 0;
+    completeReceived++;
+    mqttClient.releaseMessage(data);
+  });
+  mqttClient.onMessage([&](const espMqttClientTypes::MessageProperties& properties, const char* topic, const uint8_t* data, size_t len, size_t index, size_t total) mutable {
+    (void) properties;
+    (void) topic;
+    (void) data;
+    (void) len;
+    (void) index;
+    (void) total;
+    fragmentsReceived++;
+  }, onMessageCbId);
+  mqttClient.publish("test/test", 0, false, payload, sizeof(payload));
+  uint32_t start = millis();
+  while (millis() - start < 2000) {
+    std::this_thread::yield();
+  }
+
+  TEST_ASSERT_TRUE(mqttClient.connected());
+  TEST_ASSERT_EQUAL_INT(1, completeReceived);
+  TEST_ASSERT_TRUE(payloadOk);
+  TEST_ASSERT_EQUAL_INT(0, fragmentsReceived);
+
+  mqttClient.setMaxMessageSize(sizeof(payload) - 1);
+  mqttClient.publish("test/test", 0, false, payload, sizeof(payload));
+  start = millis();
+  while (millis() - start < 2000) {
+    std::this_thread::yield();
+  }
+
+  TEST_ASSERT_EQUAL_INT(1, completeReceived);
+  TEST_ASSERT_GREATER_THAN_INT(1, fragmentsReceived);
+
+  mqttClient.onMessageComplete(nullptr);
+  mqttClient.removeOnMessage(onMessageCbId);
+}
+
+/*
+
+- receive a message larger than the receive buffer with a budget of one packet per loop
+- check that the budget was hit and the message arrived
+
+*/
+
+void test_receive_budget() {
+  std::atomic<size_t> bytesReceived(0);
+  uint8_t payload[300] = {0};
+  mqttClient.setRxBudget(0, 1);
+  mqttClient.onMessage([&](const espMqttClientTypes::MessageProperties& properties, const char* topic, const uint8_t* data, size_t len, size_t index, size_t total) mutable {
+    (void) properties;
+    (void) topic;
+    (void) data;
+    (void) index;
+    (void) total;
+    bytesReceived += len;
+  }, onMessageCbId);
+  espMqttClientTypes::RxStats before = mqttClient.getRxStats();
+  mqttClient.publish("test/test", 0, false, payload, sizeof(payload));
+  uint32_t start = millis();
+  while (millis() - start < 2000) {
+    std::this_thread::yield();
+  }
+  espMqttClientTypes::RxStats after = mqttClient.getRxStats();
+
+  TEST_ASSERT_TRUE(mqttClient.connected());
+  TEST_ASSERT_EQUAL_UINT32(sizeof(payload), bytesReceived);
+  TEST_ASSERT_GREATER_THAN_UINT32(before.reads, after.reads);
+  TEST_ASSERT_GREATER_THAN_UINT32(before.bytes + sizeof(payload), after.bytes);
+  TEST_ASSERT_GREATER_THAN_UINT32(before.packetBudgetHits, after.packetBudgetHits);
+
+  mqttClient.setRxBudget(4 * EMC_RX_BUFFER_SIZE);
+  mqttClient.removeOnMessage(onMessageCbId);
+}
+
+/*
+
+- subscribe to test/route/+ with a callback
+- check that only this callback gets messages on matching topics
+
+*/
+
+void test_receive_route() {
+  std::atomic<int> routeReceived(0);
+  std::atomic<int> unsubscribed(0);
+  mqttClient.onUnsubscribe([&](uint16_t packetId) mutable {
+    (void) packetId;
+    unsubscribed++;
+  }, onUnsubscribeCbId);
+  uint16_t packetId = mqttClient.subscribe("test/route/+", 0, [&](const espMqttClientTypes::MessageProperties& properties, const char* topic, const uint8_t* payload, size_t len, size_t index, size_t total) mutable {
+    (void) properties;
+    (void) payload;
+    (void) len;
+    (void) index;
+    (void) total;
+    if (strcmp(topic, "test/route/a") == 0) routeReceived++;
+  });
+  TEST_ASSERT_GREATER_THAN_UINT16(0, packetId);
+  uint32_t start = millis();
+  while (millis() - start < 1000) {
+    std::this_thread::yield();
+  }
+  mqttClient.publish("test/route/a", 0, false, "route");
+  mqttClient.publish("test/other", 0, false, "route");
+  start = millis();
+  while (millis() - start < 2000) {
+    std::this_thread::yield();
+  }
+
+  TEST_ASSERT_TRUE(mqttClient.connected());
+  TEST_ASSERT_EQUAL_INT(1, routeReceived);
+
+  mqttClient.unsubscribe("test/route/+");
+  start = millis();
+  while (millis() - start < 1000) {
+    std::this_thread::yield();
+  }
+  mqttClient.publish("test/route/a", 0, false, "route");
+  start = millis();
+  while (millis() - start < 1000) {
+    std::this_thread::yield();
+  }
+
+  TEST_ASSERT_EQUAL_INT(1, unsubscribed);
+  TEST_ASSERT_EQUAL_INT(1, routeReceived);
+
+  mqttClient.removeOnUnsubscribe(onUnsubscribeCbId);
+}
+
+/*
+
+- switch the client thread to the blocking loop(timeout)
+- the idle client doesn't use cpu
+- a publish from this thread wakes up the loop and is acknowledged well before the loop timeout
+
+*/
+
+void test_loop_timeout() {
+  std::atomic<bool> acked(false);
+  mqttClient.onPublish([&](uint16_t packetId) mutable {
+    (void) packetId;
+    acked = true;
+  }, onPublishCbId);
+  blockingLoop = true;
+  std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+  std::clock_t cpuStart = std::clock();
+  std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+  uint32_t cpuTime = (std::clock() - cpuStart) * 1000 / CLOCKS_PER_SEC;
+
+  uint32_t start = millis();
+  uint16_t packetId = mqttClient.publish("test/loop", 1, false, "loop");
+  while (!acked && millis() - start < 5000) {
+    std::this_thread::yield();
+  }
+  uint32_t ackTime = millis() - start;
+  blockingLoop = false;
+
+  TEST_ASSERT_TRUE(mqttClient.connected());
+  TEST_ASSERT_GREATER_THAN_UINT16(0, packetId);
+  TEST_ASSERT_TRUE(acked);
+  TEST_ASSERT_LESS_THAN_UINT32(1000, ackTime);
+  TEST_ASSERT_LESS_THAN_UINT32(200, cpuTime);
+
+  mqttClient.removeOnPublish(onPublishCbId);
+}
+
+/*
+
+- drive the client from a poll() based event loop using the fd, interest set and timeout
+- this thread wakes the event loop after publishing, like an async handle in libuv
+- the idle client doesn't use cpu and the publish is acknowledged
+
+*/
+
+void runExternalLoop() {
+  pollfd fds[2];
+  fds[0].fd = mqttClient.getFd();
+  fds[0].events = (mqttClient.wantsRead() ? POLLIN : 0) | (mqttClient.wantsWrite() ? POLLOUT : 0);
+  fds[0].revents = 0;
+  fds[1].fd = reactorWakeFd;
+  fds[1].events = POLLIN;
+  fds[1].revents = 0;
+  uint32_t timeout = std::min<uint32_t>(mqttClient.nextTimeout(), 5000);
+  if (::poll(fds, 2, timeout) == 0) {
+    mqttClient.onTimer();
+    return;
+  }
+  if (fds[1].revents & POLLIN) {
+    uint64_t count;
+    ssize_t drained = ::read(reactorWakeFd, &count, sizeof(count));
+    (void) drained;
+  }
+  if (fds[0].revents & (POLLIN | POLLERR | POLLHUP)) mqttClient.onReadable();
+  if (fds[0].revents & POLLOUT) mqttClient.onWritable();
+}
+
+void test_external_loop() {
+  std::atomic<bool> acked(false);
+  mqttClient.onPublish([&](uint16_t packetId) mutable {
+    (void) packetId;
+    acked = true;
+  }, onPublishCbId);
+  externalLoop = true;
+  std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+  TEST_ASSERT_GREATER_OR_EQUAL_INT(0, mqttClient.getFd());
+  TEST_ASSERT_TRUE(mqttClient.wantsRead());
+  TEST_ASSERT_GREATER_THAN_UINT32(0, mqttClient.nextTimeout());
+
+  std::clock_t cpuStart = std::clock();
+  std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+  uint32_t cpuTime = (std::clock() - cpuStart) * 1000 / CLOCKS_PER_SEC;
+
+  uint32_t start = millis();
+  uint16_t packetId = mqttClient.publish("test/loop", 1, false, "loop");
+  uint64_t one = 1;
+  TEST_ASSERT_EQUAL_INT(sizeof(one), ::write(reactorWakeFd, &one, sizeof(one)));
+  while (!acked && millis() - start < 5000) {
+    std::this_thread::yield();
+  }
+  uint32_t ackTime = millis() - start;
+  externalLoop = false;
+  TEST_ASSERT_EQUAL_INT(sizeof(one), ::write(reactorWakeFd, &one, sizeof(one)));
+
+  TEST_ASSERT_TRUE(mqttClient.connected());
+  TEST_ASSERT_GREATER_THAN_UINT16(0, packetId);
+  TEST_ASSERT_TRUE(acked);
+  TEST_ASSERT_LESS_THAN_UINT32(1000, ackTime);
+  TEST_ASSERT_LESS_THAN_UINT32(200, cpuTime);
+
+  mqttClient.removeOnPublish(onPublishCbId);
+}
+
+/*
+
+- a second client connects to an unknown host and to a closed port
+- connecting never blocks the loop and ends in a disconnect
+
+*/
+
+void test_connect_nonblocking() {
+  espMqttClient client;
+  std::atomic<int> disconnects(0);
+  client.onDisconnect([&](espMqttClientTypes::DisconnectReason reason) mutable {
+    (void) reason;
+    disconnects++;
+  });
+  uint32_t longestLoop = 0;
+  auto connectAndLoop = [&]() {
+    int expected = disconnects + 1;
+    TEST_ASSERT_TRUE(client.connect());
+    uint32_t start = millis();
+    while (disconnects < expected && millis() - start < 20000) {
+      uint32_t loopStart = millis();
+      client.loop();
+      longestLoop = std::max<uint32_t>(longestLoop, millis() - loopStart);
+    }
+  };
+
+  client.setServer("nonexistent.invalid", broker_port);
+  connectAndLoop();
+  client.setServer(IPAddress(127, 0, 0, 1), 1);
+  connectAndLoop();
+
+  TEST_ASSERT_EQUAL_INT(2, disconnects);
+  TEST_ASSERT_TRUE(client.disconnected());
+  TEST_ASSERT_LESS_THAN_UINT32(100, longestLoop);
+}
+
 /*
 
 - client unsibscribes from topic
@@ -384,7 +884,13 @@ int main() {
   UNITY_BEGIN();
   t = std::thread([] {
     while (1) {
-      mqttClient.loop();
+      if (blockingLoop) {
+        mqttClient.loop(5000);
+      } else if (externalLoop) {
+        runExternalLoop();
+      } else {
+        mqttClient.loop();
+      }
       if (exitProgram) break;
     }
   });
@@ -393,8 +899,20 @@ int main() {
   RUN_TEST(test_subscribe);
   RUN_TEST(test_publish);
   RUN_TEST(test_publish_empty);
+  RUN_TEST(test_publish_max_inflight);
+  RUN_TEST(test_publish_batch);
+  RUN_TEST(test_publish_zero_copy);
+  RUN_TEST(test_publish_zero_copy_republish);
+  RUN_TEST(test_publish_many);
   RUN_TEST(test_receive1);
   RUN_TEST(test_receive2);
+  RUN_TEST(test_receive_view);
+  RUN_TEST(test_receive_complete);
+  RUN_TEST(test_receive_budget);
+  RUN_TEST(test_receive_route);
+  RUN_TEST(test_loop_timeout);
+  RUN_TEST(test_external_loop);
+  RUN_TEST(test_connect_nonblocking);
   RUN_TEST(test_unsubscribe);
   RUN_TEST(test_disconnect);
   RUN_TEST(test_pub_before_connect);
@@ -0,0 +1,271 @@
+#include <unity.h>
+
+#include <unistd.h>
+#include <vector>
+#include <MqttClientSetup.h>
+
+void setUp() {}
+void tearDown() {}
+
+// coalescing is a compile time option, see the native-coalesce env
+#if EMC_TX_COALESCE
+
+// records every write, incoming data is queued by the test
+class MockTransport : public espMqttClientInternals::Transport {
+ public:
+  MockTransport()
+  : isConnected(false)
+  , writable(true)
+  , sent()
+  , writes()
+  , incoming() {}
+  bool connect(IPAddress ip, uint16_t port) override {
+    (void) ip;
+    (void) port;
+    isConnected = true;
+    return true;
+  }
+  bool connect(const char* host, uint16_t port) override {
+    (void) host;
+    (void) port;
+    isConnected = true;
+    return true;
+  }
+  size_t write(const uint8_t* buf, size_t size) override {
+    if (!writable || !isConnected) return 0;
+    sent.insert(sent.end(), buf, buf + size);
+    writes.push_back(size);
+    return size;
+  }
+  int read(uint8_t* buf, size_t size) override {
+    size_t length = std::min(size, incoming.size());
+    if (length == 0) return 0;
+    memcpy(buf, incoming.data(), length);
+    incoming.erase(incoming.begin(), incoming.begin() + length);
+    return length;
+  }
+  void stop() override {
+    isConnected = false;
+  }
+  bool connected() override {
+    return isConnected;
+  }
+  bool disconnected() override {
+    return !isConnected;
+  }
+  void receive(std::initializer_list<uint8_t> data) {
+    incoming.insert(incoming.end(), data);
+  }
+  void clear() {
+    sent.clear();
+    writes.clear();
+  }
+
+  bool isConnected;
+  bool writable;  // writes return 0 like a full socket
+  std::vector<uint8_t> sent;
+  std::vector<size_t> writes;
+  std::vector<uint8_t> incoming;
+};
+
+class TestClient : public MqttClientSetup<TestClient> {
+ public:
+  TestClient()
+  : MqttClientSetup(espMqttClientTypes::UseInternalTask::NO)
+  , transport() {
+    _transport = &transport;
+    setServer(IPAddress(127, 0, 0, 1), 1883);
+  }
+  MockTransport transport;
+};
+
+// split the sent data in packets, all test packets are smaller than 128 bytes
+static std::vector<std::vector<uint8_t>> packets(const std::vector<uint8_t>& data) {
+  std::vector<std::vector<uint8_t>> result;
+  size_t index = 0;
+  while (index + 2 <= data.size()) {
+    size_t length = 2 + data[index + 1];
+    TEST_ASSERT_TRUE(data[index + 1] < 128);
+    TEST_ASSERT_TRUE(index + length <= data.size());
+    result.emplace_back(data.begin() + index, data.begin() + index + length);
+    index += length;
+  }
+  TEST_ASSERT_EQUAL_UINT32(data.size(), index);
+  return result;
+}
+
+static void connect(TestClient* client, bool sessionPresent = false) {
+  client->connect();
+  for (int i = 0; i < 5; ++i) client->loop();
+  TEST_ASSERT_EQUAL_UINT8(0x10, client->transport.sent[0]);  // CONNECT is written right away
+  client->transport.receive({0x20, 0x02, static_cast<uint8_t>(sessionPresent ? 0x01 : 0x00), 0x00});
+  client->loop();
+  TEST_ASSERT_TRUE(client->connected());
+  client->transport.clear();
+}
+
+// PUBLISH "a/b" "x" qos 0 is 8 bytes
+static const size_t PUBLISH_SIZE = 8;
+
+/*
+- publish some small packets
+- they are written with a single write at the end of the loop
+*/
+void test_coalesce_merge() {
+  TestClient client;
+  connect(&client);
+
+  for (int i = 0; i < 3; ++i) {
+    TEST_ASSERT_EQUAL_UINT16(1, client.publish("a/b", 0, false, "x"));
+  }
+  client.loop();
+
+  TEST_ASSERT_EQUAL_UINT32(1, client.transport.writes.size());
+  TEST_ASSERT_EQUAL_UINT32(3 * PUBLISH_SIZE, client.transport.writes[0]);
+  TEST_ASSERT_EQUAL_UINT32(3, packets(client.transport.sent).size());
+  TEST_ASSERT_EQUAL_UINT32(0, client.queueSize());
+}
+
+/*
+- long flush delay
+- a full buffer is written right away, the rest waits
+*/
+void test_coalesce_full() {
+  TestClient client;
+  client.setTxFlushDelay(10000000);
+  connect(&client);
+
+  const size_t count = EMC_TX_BUFFER_SIZE / PUBLISH_SIZE + 2;
+  for (size_t i = 0; i < count; ++i) {
+    client.publish("a/b", 0, false, "x");
+  }
+  client.loop();
+
+  TEST_ASSERT_EQUAL_UINT32(1, client.transport.writes.size());
+  TEST_ASSERT_EQUAL_UINT32(EMC_TX_BUFFER_SIZE, client.transport.writes[0]);
+  client.loop();
+  TEST_ASSERT_EQUAL_UINT32(1, client.transport.writes.size());
+}
+
+/*
+- flush delay of 20ms
+- nothing is written until the delay has passed
+*/
+void test_coalesce_delay() {
+  TestClient client;
+  client.setTxFlushDelay(20000);
+  connect(&client);
+
+  client.publish("a/b", 0, false, "x");
+  client.loop();
+  TEST_ASSERT_EQUAL_UINT32(0, client.transport.writes.size());
+
+  usleep(30000);
+  client.loop();
+  TEST_ASSERT_EQUAL_UINT32(1, client.transport.writes.size());
+  TEST_ASSERT_EQUAL_UINT32(PUBLISH_SIZE, client.transport.writes[0]);
+}
+
+// reconnect and complete the qos 1 and 2 flows, returns the packets sent after CONNECT
+static std::vector<std::vector<uint8_t>> reconnect(TestClient* client, uint16_t id1, uint16_t id2) {
+  client->transport.writable = true;
+  client->setTxFlushDelay(0);
+  connect(client, true);
+  client->loop();
+  std::vector<std::vector<uint8_t>> result = packets(client->transport.sent);
+
+  client->transport.receive({0x40, 0x02, static_cast<uint8_t>(id1 >> 8), static_cast<uint8_t>(id1 & 0xFF)});  // PUBACK
+  client->transport.receive({0x50, 0x02, static_cast<uint8_t>(id2 >> 8), static_cast<uint8_t>(id2 & 0xFF)});  // PUBREC
+  client->loop();
+  client->transport.receive({0x70, 0x02, static_cast<uint8_t>(id2 >> 8), static_cast<uint8_t>(id2 & 0xFF)});  // PUBCOMP
+  client->loop();
+  return result;
+}
+
+static void disconnect(TestClient* client) {
+  client->transport.isConnected = false;
+  for (int i = 0; i < 5 && !client->disconnected(); ++i) client->loop();
+  TEST_ASSERT_TRUE(client->disconnected());
+}
+
+/*
+- publish qos 0, 1 and 2, everything stays in the buffer
+- the connection drops
+- after reconnecting, qos 1 and 2 are sent again, the buffered qos 0 packet is lost
+*/
+void test_coalesce_disconnect() {
+  TestClient client;
+  std::vector<uint16_t> published;
+  client.onPublish([&](uint16_t packetId) { published.push_back(packetId); });
+  client.setTxFlushDelay(10000000);
+  connect(&client);
+
+  client.publish("a/b", 0, false, "x");
+  uint16_t id1 = client.publish("a/b", 1, false, "y");
+  uint16_t id2 = client.publish("a/b", 2, false, "z");
+  client.loop();
+  TEST_ASSERT_EQUAL_UINT32(0, client.transport.writes.size());
+  disconnect(&client);
+
+  std::vector<std::vector<uint8_t>> sent = reconnect(&client, id1, id2);
+
+  TEST_ASSERT_EQUAL_UINT32(2, sent.size());
+  TEST_ASSERT_EQUAL_UINT8(0x32, sent[0][0] & 0xF6);  // PUBLISH qos 1, dup may be set
+  TEST_ASSERT_EQUAL_UINT8('y', sent[0].back());
+  TEST_ASSERT_EQUAL_UINT8(0x34, sent[1][0] & 0xF6);  // PUBLISH qos 2
+  TEST_ASSERT_EQUAL_UINT8('z', sent[1].back());
+  TEST_ASSERT_EQUAL_UINT32(2, published.size());
+  TEST_ASSERT_EQUAL_UINT32(0, client.queueSize());
+}
+
+/*
+- the transport doesn't take data, a qos 1 packet is only partly buffered
+- the connection drops
+- after reconnecting, the qos 1 packet is sent again as a whole
+*/
+void test_coalesce_disconnect_partial() {
+  TestClient client;
+  std::vector<uint16_t> published;
+  client.onPublish([&](uint16_t packetId) { published.push_back(packetId); });
+  client.setTxFlushDelay(10000000);
+  connect(&client);
+  client.transport.writable = false;
+
+  for (size_t i = 0; i < EMC_TX_BUFFER_SIZE / PUBLISH_SIZE - 1; ++i) {
+    client.publish("a/b", 0, false, "x");
+  }
+  uint16_t id1 = client.publish("a/b", 1, false, "0123456789");
+  uint16_t id2 = client.publish("a/b", 2, false, "z");
+  client.loop();
+  TEST_ASSERT_EQUAL_UINT32(0, client.transport.writes.size());
+  disconnect(&client);
+
+  std::vector<std::vector<uint8_t>> sent = reconnect(&client, id1, id2);
+
+  TEST_ASSERT_EQUAL_UINT32(2, sent.size());
+  TEST_ASSERT_EQUAL_UINT8(0x32, sent[0][0] & 0xF6);
+  TEST_ASSERT_EQUAL_UINT32(2 + 5 + 2 + 10, sent[0].size());
+  TEST_ASSERT_EQUAL_UINT8('9', sent[0].back());
+  TEST_ASSERT_EQUAL_UINT8(0x34, sent[1][0] & 0xF6);
+  TEST_ASSERT_EQUAL_UINT32(2, published.size());
+  TEST_ASSERT_EQUAL_UINT32(0, client.queueSize());
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_coalesce_merge);
+  RUN_TEST(test_coalesce_full);
+  RUN_TEST(test_coalesce_delay);
+  RUN_TEST(test_coalesce_disconnect);
+  RUN_TEST(test_coalesce_disconnect_partial);
+  return UNITY_END();
+}
+
+#else
+
+int main() {
+  UNITY_BEGIN();
+  return UNITY_END();
+}
+
+#endif
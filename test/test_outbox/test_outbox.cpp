@@ -177,6 +177,190 @@ void test_outbox_remove_consecutive() {
   TEST_ASSERT_EQUAL_UINT32(3, outbox.size());
 }
 
+struct IndexedItem {
+  explicit IndexedItem(uint32_t k) : key(k) {}
+  uint32_t indexKey() const { return key; }
+  uint32_t key;
+};
+
+void test_outbox_find() {
+  Outbox<IndexedItem> outbox;
+  for (uint32_t i = 0; i <= 20; i++) {
+    outbox.emplace(i);  // key 0 is not indexed
+  }
+  // items sharing an index bucket
+  outbox.emplace(5 + EMC_OUTBOX_INDEX_SIZE);
+  outbox.emplace(5 + 2 * EMC_OUTBOX_INDEX_SIZE);
+
+  Outbox<IndexedItem>::Iterator it = outbox.find(0);
+  TEST_ASSERT_NULL(it.get());
+
+  it = outbox.find(15);
+  TEST_ASSERT_NOT_NULL(it.get());
+  TEST_ASSERT_EQUAL_UINT32(15, it.get()->key);
+
+  outbox.remove(it);
+  // iterator points to next item in the queue
+  TEST_ASSERT_NOT_NULL(it.get());
+  TEST_ASSERT_EQUAL_UINT32(16, it.get()->key);
+  TEST_ASSERT_NULL(outbox.find(15).get());
+  TEST_ASSERT_EQUAL_UINT32(22, outbox.size());
+
+  it = outbox.find(5 + EMC_OUTBOX_INDEX_SIZE);
+  TEST_ASSERT_NOT_NULL(it.get());
+  outbox.remove(it);
+  TEST_ASSERT_NULL(outbox.find(5 + EMC_OUTBOX_INDEX_SIZE).get());
+  TEST_ASSERT_NOT_NULL(outbox.find(5).get());
+  TEST_ASSERT_NOT_NULL(outbox.find(5 + 2 * EMC_OUTBOX_INDEX_SIZE).get());
+
+  // removing via the builtin iterator also updates the index
+  outbox.next();
+  TEST_ASSERT_TRUE(outbox.find(1).get() == outbox.getCurrent());
+  outbox.removeCurrent();
+  TEST_ASSERT_NULL(outbox.find(1).get());
+  TEST_ASSERT_EQUAL_UINT32(2, outbox.getCurrent()->key);
+
+  outbox.emplaceFront(1000u);
+  TEST_ASSERT_NOT_NULL(outbox.find(1000).get());
+  TEST_ASSERT_EQUAL_UINT32(1000, outbox.getCurrent()->key);
+}
+
+void test_outbox_find_collisions() {
+  Outbox<IndexedItem> outbox;
+  #if EMC_USE_MEMPOOL
+  const uint32_t count = EMC_NUM_POOL_ELEMENTS;
+  #else
+  const uint32_t count = 1000;  // also makes the index grow
+  #endif
+  // keys 64 apart, these all shared one bucket in a chained index of 64 buckets
+  for (uint32_t i = 0; i < count; i++) {
+    outbox.emplace(1 + i * 64);
+  }
+  for (uint32_t i = 0; i < count; i++) {
+    TEST_ASSERT_NOT_NULL(outbox.find(1 + i * 64).get());
+  }
+  TEST_ASSERT_NULL(outbox.find(2).get());
+  TEST_ASSERT_NULL(outbox.find(1 + count * 64).get());
+
+  // remove from the middle of the probe runs
+  for (uint32_t i = 1; i < count; i += 2) {
+    Outbox<IndexedItem>::Iterator it = outbox.find(1 + i * 64);
+    TEST_ASSERT_NOT_NULL(it.get());
+    TEST_ASSERT_EQUAL_UINT32(1 + i * 64, it.get()->key);
+    outbox.remove(it);
+  }
+  TEST_ASSERT_EQUAL_UINT32(count - count / 2, outbox.size());
+  for (uint32_t i = 0; i < count; i++) {
+    Outbox<IndexedItem>::Iterator it = outbox.find(1 + i * 64);
+    if (i % 2) {
+      TEST_ASSERT_NULL(it.get());
+    } else {
+      TEST_ASSERT_NOT_NULL(it.get());
+      TEST_ASSERT_EQUAL_UINT32(1 + i * 64, it.get()->key);
+    }
+  }
+
+  // the freed slots are reused
+  for (uint32_t i = 1; i < count; i += 2) {
+    outbox.emplaceFront(1 + i * 64);
+  }
+  for (uint32_t i = 0; i < count; i++) {
+    TEST_ASSERT_NOT_NULL(outbox.find(1 + i * 64).get());
+  }
+
+  while (outbox.getCurrent()) {
+    uint32_t key = outbox.getCurrent()->key;
+    outbox.removeCurrent();
+    TEST_ASSERT_NULL(outbox.find(key).get());
+  }
+  TEST_ASSERT_TRUE(outbox.empty());
+}
+
+void test_outbox_lanes() {
+  Outbox<uint32_t, 3> outbox;
+  outbox.emplace(1);
+  outbox.emplace(2);
+  outbox.emplace(3);
+  outbox.emplace(4);
+  outbox.next(1);
+  outbox.next(2);
+  outbox.next(1);
+  // lane 1: 1 3, lane 2: 2, send lane: 4
+  TEST_ASSERT_EQUAL_UINT32(1, outbox.size(0));
+  TEST_ASSERT_EQUAL_UINT32(2, outbox.size(1));
+  TEST_ASSERT_EQUAL_UINT32(1, outbox.size(2));
+  TEST_ASSERT_EQUAL_UINT32(4, outbox.size());
+  TEST_ASSERT_EQUAL_UINT32(4, *(outbox.getCurrent()));
+  TEST_ASSERT_EQUAL_UINT32(1, *(outbox.first(1)));
+  TEST_ASSERT_EQUAL_UINT32(2, *(outbox.first(2)));
+
+  // iterator visits waiting lanes before the send lane
+  uint32_t expected[] = {1, 3, 2, 4};
+  size_t i = 0;
+  for (Outbox<uint32_t, 3>::Iterator it = outbox.front(); it; ++it) {
+    TEST_ASSERT_EQUAL_UINT32(expected[i++], *(it.get()));
+  }
+  TEST_ASSERT_EQUAL_UINT32(4, i);
+
+  // lane iterator stays within its lane
+  uint32_t expectedLane1[] = {1, 3};
+  i = 0;
+  for (Outbox<uint32_t, 3>::Iterator it = outbox.front(1); it; ++it) {
+    TEST_ASSERT_EQUAL_UINT32(expectedLane1[i++], *(it.get()));
+  }
+  TEST_ASSERT_EQUAL_UINT32(2, i);
+
+  // remove last item of lane 1, iterator continues in lane 2
+  Outbox<uint32_t, 3>::Iterator it = outbox.front();
+  ++it;
+  outbox.remove(it);
+  TEST_ASSERT_NOT_NULL(it.get());
+  TEST_ASSERT_EQUAL_UINT32(2, *(it.get()));
+  TEST_ASSERT_EQUAL_UINT32(1, outbox.size(1));
+
+  // waiting items return to the front of the send lane
+  outbox.resetCurrent();
+  TEST_ASSERT_EQUAL_UINT32(3, outbox.size(0));
+  TEST_ASSERT_EQUAL_UINT32(0, outbox.size(1));
+  TEST_ASSERT_EQUAL_UINT32(0, outbox.size(2));
+  TEST_ASSERT_NULL(outbox.first(1));
+  TEST_ASSERT_EQUAL_UINT32(1, *(outbox.getCurrent()));
+  outbox.removeCurrent();
+  TEST_ASSERT_EQUAL_UINT32(2, *(outbox.getCurrent()));
+  outbox.removeCurrent();
+  TEST_ASSERT_EQUAL_UINT32(4, *(outbox.getCurrent()));
+  outbox.removeCurrent();
+  TEST_ASSERT_TRUE(outbox.empty());
+}
+
+void test_outbox_promote() {
+  Outbox<uint32_t, 3> outbox;
+  outbox.emplace(1);
+  outbox.emplaceInLane(2, 2);
+  outbox.emplaceInLane(2, 3);
+  outbox.next(1);
+  // lane 1: 1, lane 2: 2 3, send lane empty
+  TEST_ASSERT_NULL(outbox.getCurrent());
+  TEST_ASSERT_EQUAL_UINT32(2, outbox.size(2));
+
+  // lane 2 is not reset
+  outbox.resetCurrent(1);
+  TEST_ASSERT_EQUAL_UINT32(1, *(outbox.getCurrent()));
+  TEST_ASSERT_EQUAL_UINT32(2, outbox.size(2));
+
+  outbox.promote(2);
+  // lane 2: 3, send lane: 1 2
+  TEST_ASSERT_EQUAL_UINT32(2, outbox.size(0));
+  TEST_ASSERT_EQUAL_UINT32(1, outbox.size(2));
+  TEST_ASSERT_EQUAL_UINT32(3, *(outbox.first(2)));
+  outbox.removeCurrent();
+  TEST_ASSERT_EQUAL_UINT32(2, *(outbox.getCurrent()));
+
+  outbox.promote(2);
+  outbox.promote(2);  // no effect on empty lane
+  TEST_ASSERT_EQUAL_UINT32(2, outbox.size(0));
+  TEST_ASSERT_EQUAL_UINT32(0, outbox.size(2));
+}
 
 int main() {
   UNITY_BEGIN();
@@ -187,5 +371,9 @@ int main() {
   RUN_TEST(test_outbox_remove2);
   RUN_TEST(test_outbox_removeCurrent);
   RUN_TEST(test_outbox_remove_consecutive);
+  RUN_TEST(test_outbox_find);
+  RUN_TEST(test_outbox_find_collisions);
+  RUN_TEST(test_outbox_lanes);
+  RUN_TEST(test_outbox_promote);
   return UNITY_END();
 }
@@ -0,0 +1,69 @@
+#include <unity.h>
+
+#include <Packets/PacketIds.h>
+
+using espMqttClientInternals::PacketIds;
+
+void setUp() {}
+void tearDown() {}
+
+void test_packetIds_sequence() {
+  PacketIds ids;
+  TEST_ASSERT_EQUAL_UINT16(1, ids.acquire());
+  TEST_ASSERT_EQUAL_UINT16(2, ids.acquire());
+  TEST_ASSERT_EQUAL_UINT16(3, ids.acquire());
+  TEST_ASSERT_TRUE(ids.inUse(2));
+  TEST_ASSERT_FALSE(ids.inUse(0));
+  TEST_ASSERT_EQUAL_UINT32(3, ids.used());
+
+  // released ids are not reused before the counter wraps
+  ids.release(2);
+  TEST_ASSERT_FALSE(ids.inUse(2));
+  TEST_ASSERT_EQUAL_UINT16(4, ids.acquire());
+  TEST_ASSERT_EQUAL_UINT32(3, ids.used());
+}
+
+void test_packetIds_wrap() {
+  PacketIds ids;
+  TEST_ASSERT_EQUAL_UINT16(1, ids.acquire());
+  TEST_ASSERT_EQUAL_UINT16(2, ids.acquire());
+  ids.mark(5);
+  for (uint32_t i = 3; i <= EMC_MAX_PACKET_ID; ++i) {
+    if (i == 5) continue;
+    TEST_ASSERT_EQUAL_UINT16(i, ids.acquire());
+    ids.release(i);
+  }
+
+  // wraps to 1, skipping the ids still in use
+  ids.release(1);
+  TEST_ASSERT_EQUAL_UINT16(1, ids.acquire());
+  TEST_ASSERT_EQUAL_UINT16(3, ids.acquire());
+  TEST_ASSERT_EQUAL_UINT16(4, ids.acquire());
+  TEST_ASSERT_EQUAL_UINT16(6, ids.acquire());
+}
+
+void test_packetIds_exhausted() {
+  PacketIds ids;
+  for (uint32_t i = 1; i <= EMC_MAX_PACKET_ID; ++i) {
+    TEST_ASSERT_EQUAL_UINT16(i, ids.acquire());
+  }
+  TEST_ASSERT_EQUAL_UINT32(EMC_MAX_PACKET_ID, ids.used());
+  TEST_ASSERT_EQUAL_UINT16(0, ids.acquire());
+
+  ids.release(EMC_MAX_PACKET_ID / 2);
+  TEST_ASSERT_EQUAL_UINT16(EMC_MAX_PACKET_ID / 2, ids.acquire());
+  TEST_ASSERT_EQUAL_UINT16(0, ids.acquire());
+
+  ids.reset();
+  TEST_ASSERT_EQUAL_UINT32(0, ids.used());
+  TEST_ASSERT_FALSE(ids.inUse(EMC_MAX_PACKET_ID / 2));
+  TEST_ASSERT_EQUAL_UINT16(EMC_MAX_PACKET_ID / 2 + 1, ids.acquire());
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_packetIds_sequence);
+  RUN_TEST(test_packetIds_wrap);
+  RUN_TEST(test_packetIds_exhausted);
+  return UNITY_END();
+}
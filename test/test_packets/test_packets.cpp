@@ -1,8 +1,10 @@
 #include <unity.h>
 
 #include <Packets/Packet.h>
+#include <Packets/SharedPayload.h>
 
 using espMqttClientInternals::Packet;
+using espMqttClientInternals::SharedPayload;
 using espMqttClientInternals::PacketType;
 
 void setUp() {}
@@ -688,6 +690,110 @@ void test_encodeChunkedPublish() {
   TEST_ASSERT_EQUAL_UINT8_ARRAY(payloadChunk, packet.data(index), available);
 }
 
+void test_encodeZeroCopyPublish() {
+  const uint8_t check[] = {
+    0b00110010,                 // header, dup, qos, retain
+    0xCF, 0x01,                 // 7 + 200 = (0x4F * 1) & 0x40 + (0x01 * 128)
+    0x00,0x03,'t','o','p',      // topic
+    0x00,0x16                   // packet Id
+  };
+  uint8_t payload[200];
+  memset(payload, 0x05, sizeof(payload));
+  const char* topic = "top";
+  uint8_t qos = 1;
+  bool retain = false;
+  size_t headerLength = 10;
+  size_t payloadLength = 200;
+  uint16_t packetId = 22;
+  const uint8_t* released = nullptr;
+  int releaseCount = 0;
+  espMqttClientTypes::Error error = espMqttClientTypes::Error::MISC_ERROR;
+
+  {
+    Packet packet(error,
+                  packetId,
+                  topic,
+                  payload,
+                  payloadLength,
+                  qos,
+                  retain,
+                  [&](const uint8_t* p) {
+                    released = p;
+                    releaseCount++;
+                  });
+
+    TEST_ASSERT_EQUAL_UINT8(espMqttClientTypes::Error::SUCCESS, error);
+    TEST_ASSERT_EQUAL_UINT32(headerLength + payloadLength, packet.size());
+    TEST_ASSERT_EQUAL_UINT16(packetId, packet.packetId());
+    TEST_ASSERT_FALSE(packet.chunked());
+
+    // header and payload are separate buffers
+    TEST_ASSERT_EQUAL_UINT32(headerLength, packet.available(0));
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(check, packet.data(0), headerLength);
+    TEST_ASSERT_EQUAL_UINT32(headerLength - 4, packet.available(4));
+    TEST_ASSERT_EQUAL_UINT32(payloadLength, packet.available(headerLength));
+    TEST_ASSERT_EQUAL_PTR(payload, packet.data(headerLength));
+    TEST_ASSERT_EQUAL_UINT32(payloadLength - 10, packet.available(headerLength + 10));
+    TEST_ASSERT_EQUAL_PTR(&payload[10], packet.data(headerLength + 10));
+    TEST_ASSERT_EQUAL_UINT32(0, packet.available(headerLength + payloadLength));
+
+    packet.setDup();
+    TEST_ASSERT_EQUAL_UINT8(check[0] | 0x08, packet.data(0)[0]);
+    TEST_ASSERT_EQUAL_INT(0, releaseCount);
+  }
+
+  // payload is released together with the packet
+  TEST_ASSERT_EQUAL_INT(1, releaseCount);
+  TEST_ASSERT_EQUAL_PTR(payload, released);
+}
+
+void test_encodeSharedPayloadPublish() {
+  const uint8_t check1[] = {
+    0b00110000,                 // header, dup, qos, retain
+    0x09,
+    0x00,0x03,'t','o','p',      // topic
+    0x01,0x02,0x03,0x04         // payload
+  };
+  const uint8_t check2[] = {
+    0b00110000,                 // header, dup, qos, retain
+    0x0A,
+    0x00,0x04,'t','o','p','2',  // topic
+  };
+  const uint8_t payload[] = {0x01, 0x02, 0x03, 0x04};
+  espMqttClientTypes::Error error = espMqttClientTypes::Error::MISC_ERROR;
+
+  SharedPayload* shared = SharedPayload::create(payload, sizeof(payload));
+  TEST_ASSERT_NOT_NULL(shared);
+  TEST_ASSERT_EQUAL_UINT32(sizeof(payload), shared->length());
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(payload, shared->data(), sizeof(payload));
+
+  shared->retain();
+  Packet* packet1 = new Packet(error, 0, "top", shared->data(), shared->length(), 0, false, [shared](const uint8_t*) {
+    shared->release();
+  });
+  TEST_ASSERT_EQUAL_UINT8(espMqttClientTypes::Error::SUCCESS, error);
+  shared->retain();
+  Packet* packet2 = new Packet(error, 0, "top2", shared->data(), shared->length(), 0, false, [shared](const uint8_t*) {
+    shared->release();
+  });
+  TEST_ASSERT_EQUAL_UINT8(espMqttClientTypes::Error::SUCCESS, error);
+  shared->release();
+
+  // both packets point to the same payload
+  TEST_ASSERT_EQUAL_UINT32(sizeof(check1), packet1->size());
+  TEST_ASSERT_EQUAL_UINT32(7, packet1->available(0));
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(check1, packet1->data(0), 7);
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(&check1[7], packet1->data(7), 4);
+  TEST_ASSERT_EQUAL_UINT32(sizeof(check2) + 4, packet2->size());
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(check2, packet2->data(0), sizeof(check2));
+  TEST_ASSERT_EQUAL_PTR(packet1->data(7), packet2->data(sizeof(check2)));
+
+  // memory is freed with the last packet, checked by the memory checker
+  delete packet1;
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(payload, packet2->data(sizeof(check2)), sizeof(payload));
+  delete packet2;
+}
+
 int main() {
   UNITY_BEGIN();
   RUN_TEST(test_encodeConnect0);
@@ -710,5 +816,7 @@ int main() {
   RUN_TEST(test_encodePingReq);
   RUN_TEST(test_encodeDisconnect);
   RUN_TEST(test_encodeChunkedPublish);
+  RUN_TEST(test_encodeZeroCopyPublish);
+  RUN_TEST(test_encodeSharedPayloadPublish);
   return UNITY_END();
 }
@@ -79,7 +79,7 @@ void test_Publish() {
   TEST_ASSERT_EQUAL_INT32(ParserResult::packet, result);
   TEST_ASSERT_EQUAL_UINT32(length, bytesRead);
   TEST_ASSERT_EQUAL_UINT8(espMqttClientInternals::PacketType.PUBLISH, parser.getPacket().fixedHeader.packetType & 0xF0);
-  TEST_ASSERT_EQUAL_STRING("a/b", parser.getPacket().variableHeader.topic);
+  TEST_ASSERT_EQUAL_STRING("a/b", parser.topic());
   TEST_ASSERT_EQUAL_UINT16(10, parser.getPacket().variableHeader.fixed.packetId);
   TEST_ASSERT_EQUAL_UINT32(0, parser.getPacket().payload.index);
   TEST_ASSERT_EQUAL_UINT32(2, parser.getPacket().payload.length);
@@ -96,7 +96,7 @@ void test_Publish() {
   result = parser.parse(stream, length, &bytesRead);
   TEST_ASSERT_EQUAL_INT32(ParserResult::packet, result);
   TEST_ASSERT_EQUAL_UINT32(length, bytesRead);
-  TEST_ASSERT_EQUAL_STRING("a/b", parser.getPacket().variableHeader.topic);
+  TEST_ASSERT_EQUAL_STRING("a/b", parser.topic());
   TEST_ASSERT_EQUAL_UINT16(10, parser.getPacket().variableHeader.fixed.packetId);
   TEST_ASSERT_EQUAL_UINT32(2, parser.getPacket().payload.index);
   TEST_ASSERT_EQUAL_UINT32(2, parser.getPacket().payload.length);
@@ -120,7 +120,7 @@ void test_Publish_empty() {
   TEST_ASSERT_EQUAL_INT32(ParserResult::packet, result0);
   TEST_ASSERT_EQUAL_UINT32(length0, bytesRead0);
   TEST_ASSERT_EQUAL_UINT8(espMqttClientInternals::PacketType.PUBLISH, parser.getPacket().fixedHeader.packetType & 0xF0);
-  TEST_ASSERT_EQUAL_STRING("a/b", parser.getPacket().variableHeader.topic);
+  TEST_ASSERT_EQUAL_STRING("a/b", parser.topic());
   TEST_ASSERT_EQUAL_UINT32(0, parser.getPacket().payload.index);
   TEST_ASSERT_EQUAL_UINT32(0, parser.getPacket().payload.length);
   TEST_ASSERT_EQUAL_UINT32(0, parser.getPacket().payload.total);
@@ -141,7 +141,7 @@ void test_Publish_empty() {
   TEST_ASSERT_EQUAL_INT32(ParserResult::packet, result1);
   TEST_ASSERT_EQUAL_UINT32(length1, bytesRead1);
   TEST_ASSERT_EQUAL_UINT8(espMqttClientInternals::PacketType.PUBLISH, parser.getPacket().fixedHeader.packetType & 0xF0);
-  TEST_ASSERT_EQUAL_STRING("a/b", parser.getPacket().variableHeader.topic);
+  TEST_ASSERT_EQUAL_STRING("a/b", parser.topic());
   TEST_ASSERT_EQUAL_UINT32(0, parser.getPacket().payload.index);
   TEST_ASSERT_EQUAL_UINT32(0, parser.getPacket().payload.length);
   TEST_ASSERT_EQUAL_UINT32(0, parser.getPacket().payload.total);
@@ -336,6 +336,136 @@ void test_longStream() {
   TEST_ASSERT_FALSE(parser.getPacket().dup());
 }
 
+void test_publishSplitHeader() {
+  // same packets as a single stream and split in every possible way
+  const uint8_t stream[] = {
+    0x32, 0x09, 0x00, 0x03, 'a', '/', 'b', 0x00, 0x0A, 0x01, 0x02,  // qos 1
+    0x30, 0x05, 0x00, 0x03, 'c', '/', 'd',                          // qos 0, no payload
+    0x40, 0x02, 0x00, 0x04                                          // puback
+  };
+  const size_t length = sizeof(stream);
+
+  for (size_t split = 0; split <= length; ++split) {
+    Parser p;
+    size_t index = 0;
+    size_t packets = 0;
+    uint8_t types[3] = {0};
+    char topics[3][4] = {{0}};
+    uint16_t ids[3] = {0};
+    size_t payloadBytes = 0;
+    // first part up to 'split', then the rest
+    size_t ends[2] = {split, length};
+    for (size_t part = 0; part < 2; ++part) {
+      while (index < ends[part]) {
+        size_t bytesRead = 0;
+        ParserResult result = p.parse(&stream[index], ends[part] - index, &bytesRead);
+        TEST_ASSERT_NOT_EQUAL(ParserResult::protocolError, result);
+        index += bytesRead;
+        if (result == ParserResult::packet) {
+          const IncomingPacket& packet = p.getPacket();
+          payloadBytes += ((packet.fixedHeader.packetType & 0xF0) == espMqttClientInternals::PacketType.PUBLISH) ? packet.payload.length : 0;
+          if (packet.payload.index + packet.payload.length < packet.payload.total) continue;  // payload continues
+          TEST_ASSERT_LESS_THAN_UINT32(3, packets);
+          types[packets] = packet.fixedHeader.packetType & 0xF0;
+          strncpy(topics[packets], packet.variableHeader.topic, 3);
+          ids[packets] = packet.variableHeader.fixed.packetId;
+          ++packets;
+        }
+      }
+    }
+    TEST_ASSERT_EQUAL_UINT32(3, packets);
+    TEST_ASSERT_EQUAL_UINT8(espMqttClientInternals::PacketType.PUBLISH, types[0]);
+    TEST_ASSERT_EQUAL_STRING("a/b", topics[0]);
+    TEST_ASSERT_EQUAL_UINT16(10, ids[0]);
+    TEST_ASSERT_EQUAL_UINT8(espMqttClientInternals::PacketType.PUBLISH, types[1]);
+    TEST_ASSERT_EQUAL_STRING("c/d", topics[1]);
+    TEST_ASSERT_EQUAL_UINT8(espMqttClientInternals::PacketType.PUBACK, types[2]);
+    TEST_ASSERT_EQUAL_UINT16(4, ids[2]);
+    TEST_ASSERT_EQUAL_UINT32(2, payloadBytes);
+  }
+}
+
+void test_publishTopicView() {
+  // complete topic in the data: view into the data
+  const uint8_t stream0[] = {
+    0x30, 0x07,                     // header, remaining length
+    0x00, 0x03, 'a', '/', 'b',      // topic
+    0x01, 0x02                      // payload
+  };
+  Parser p;
+  size_t bytesRead = 0;
+  ParserResult result = p.parse(stream0, sizeof(stream0), &bytesRead);
+  TEST_ASSERT_EQUAL_INT32(ParserResult::packet, result);
+  TEST_ASSERT_EQUAL_PTR(&stream0[4], p.getPacket().variableHeader.topic);
+  TEST_ASSERT_EQUAL_UINT16(3, p.getPacket().variableHeader.topicLength);
+  TEST_ASSERT_EQUAL_STRING("a/b", p.topic());
+
+  // topic split over two reads and longer than EMC_MAX_TOPIC_LENGTH: copied
+  const size_t topicLength = EMC_MAX_TOPIC_LENGTH + 10;
+  uint8_t stream1[5 + topicLength + 2];
+  stream1[0] = 0x32;
+  stream1[1] = 0x80 | ((2 + topicLength + 2) & 0x7F);
+  stream1[2] = (2 + topicLength + 2) >> 7;
+  stream1[3] = 0x00;
+  stream1[4] = topicLength;
+  memset(&stream1[5], 'x', topicLength);
+  stream1[5 + topicLength] = 0x00;
+  stream1[5 + topicLength + 1] = 0x0A;
+  // second byte of topic length is the last byte of the first read
+  bytesRead = 0;
+  result = p.parse(stream1, 5, &bytesRead);
+  TEST_ASSERT_EQUAL_INT32(ParserResult::awaitData, result);
+  result = p.parse(&stream1[5], 10, &bytesRead);
+  TEST_ASSERT_EQUAL_INT32(ParserResult::awaitData, result);
+  result = p.parse(&stream1[15], sizeof(stream1) - 15, &bytesRead);
+  TEST_ASSERT_EQUAL_INT32(ParserResult::packet, result);
+  TEST_ASSERT_EQUAL_UINT32(sizeof(stream1), bytesRead);
+  TEST_ASSERT_EQUAL_UINT16(topicLength, p.getPacket().variableHeader.topicLength);
+  TEST_ASSERT_EQUAL_UINT16(10, p.getPacket().variableHeader.fixed.packetId);
+  TEST_ASSERT_EQUAL_UINT32(topicLength, strlen(p.topic()));
+  TEST_ASSERT_EQUAL_UINT8('x', p.topic()[topicLength - 1]);
+
+  // complete topic, payload continues in the next read: topic outlives the first read
+  uint8_t stream2[] = {
+    0x30, 0x07,                     // header, remaining length
+    0x00, 0x03, 'c', '/', 'd',      // topic
+    0x01                            // payload, part 1
+  };
+  bytesRead = 0;
+  result = p.parse(stream2, sizeof(stream2), &bytesRead);
+  TEST_ASSERT_EQUAL_INT32(ParserResult::packet, result);
+  memset(stream2, 0, sizeof(stream2));
+  TEST_ASSERT_EQUAL_UINT16(3, p.getPacket().variableHeader.topicLength);
+  TEST_ASSERT_EQUAL_INT(0, strncmp("c/d", p.getPacket().variableHeader.topic, 3));
+  const uint8_t stream3[] = {0x02};  // payload, part 2
+  result = p.parse(stream3, sizeof(stream3), &bytesRead);
+  TEST_ASSERT_EQUAL_INT32(ParserResult::packet, result);
+  TEST_ASSERT_EQUAL_UINT32(1, p.getPacket().payload.index);
+  TEST_ASSERT_EQUAL_STRING("c/d", p.topic());
+}
+
+void test_ready() {
+  Parser p;
+  const uint8_t stream[] = {
+    0x32, 0x09, 0x00, 0x03, 'a', '/', 'b', 0x00, 0x0A, 0x01, 0x02  // qos 1 publish
+  };
+  // packet fits in the buffer: wait for all of it
+  TEST_ASSERT_FALSE(p.ready(stream, 1, 20));
+  TEST_ASSERT_FALSE(p.ready(stream, 7, 20));
+  TEST_ASSERT_FALSE(p.ready(stream, 10, 20));
+  TEST_ASSERT_TRUE(p.ready(stream, 11, 20));
+  // packet is larger than the buffer: only wait for the header
+  TEST_ASSERT_FALSE(p.ready(stream, 3, 10));
+  TEST_ASSERT_FALSE(p.ready(stream, 8, 10));
+  TEST_ASSERT_TRUE(p.ready(stream, 9, 10));
+  // header is larger than the buffer: parse what is there
+  TEST_ASSERT_TRUE(p.ready(stream, 4, 5));
+  // in the middle of a packet: always parse
+  size_t bytesRead = 0;
+  TEST_ASSERT_EQUAL_INT32(ParserResult::awaitData, p.parse(stream, 1, &bytesRead));
+  TEST_ASSERT_TRUE(p.ready(&stream[1], 1, 20));
+}
+
 int main() {
   UNITY_BEGIN();
   RUN_TEST(test_Connack);
@@ -351,5 +481,8 @@ int main() {
   RUN_TEST(test_UnsubAck);
   RUN_TEST(test_PingResp);
   RUN_TEST(test_longStream);
+  RUN_TEST(test_publishSplitHeader);
+  RUN_TEST(test_publishTopicView);
+  RUN_TEST(test_ready);
   return UNITY_END();
 }
@@ -0,0 +1,122 @@
+#include <unity.h>
+#include <string.h>
+
+#include <TopicRouter.h>
+
+using espMqttClientInternals::TopicRouter;
+
+void setUp() {}
+void tearDown() {}
+
+static int hits[4];
+
+static espMqttClientTypes::OnMessageCallback counter(int i) {
+  return [i](const espMqttClientTypes::MessageProperties& properties, const char* topic, const uint8_t* payload, size_t len, size_t index, size_t total) {
+    (void) properties;
+    (void) topic;
+    (void) payload;
+    (void) len;
+    (void) index;
+    (void) total;
+    hits[i]++;
+  };
+}
+
+static size_t dispatch(TopicRouter* router, const char* topic) {
+  memset(hits, 0, sizeof(hits));
+  size_t matches = 0;
+  for (TopicRouter::Route* r = router->match(topic, strlen(topic)); r; r = r->nextMatch) {
+    r->callback({0, false, false, 0}, topic, nullptr, 0, 0, 0);
+    ++matches;
+  }
+  router->release();
+  return matches;
+}
+
+void test_match() {
+  TopicRouter router;
+  TEST_ASSERT_NOT_NULL(router.add("a/b/c", counter(0)));
+  TEST_ASSERT_NOT_NULL(router.add("a/+/c", counter(1)));
+  TEST_ASSERT_NOT_NULL(router.add("a/#", counter(2)));
+  TEST_ASSERT_NOT_NULL(router.add("#", counter(3)));
+
+  TEST_ASSERT_EQUAL_UINT32(4, dispatch(&router, "a/b/c"));
+  TEST_ASSERT_EQUAL_INT(1, hits[0]);
+  TEST_ASSERT_EQUAL_INT(1, hits[1]);
+  TEST_ASSERT_EQUAL_INT(1, hits[2]);
+  TEST_ASSERT_EQUAL_INT(1, hits[3]);
+
+  TEST_ASSERT_EQUAL_UINT32(3, dispatch(&router, "a/x/c"));
+  TEST_ASSERT_EQUAL_INT(0, hits[0]);
+
+  // '#' matches the parent level
+  TEST_ASSERT_EQUAL_UINT32(2, dispatch(&router, "a"));
+  TEST_ASSERT_EQUAL_INT(1, hits[2]);
+
+  TEST_ASSERT_EQUAL_UINT32(1, dispatch(&router, "b/b/c"));
+  TEST_ASSERT_EQUAL_INT(1, hits[3]);
+
+  // no wildcard match on topics starting with '$'
+  TEST_ASSERT_EQUAL_UINT32(0, dispatch(&router, "$SYS/b/c"));
+
+  // '#' has to be the last level
+  TEST_ASSERT_NULL(router.add("a/#/c", counter(0)));
+}
+
+void test_invalid() {
+  TopicRouter router;
+  TEST_ASSERT_NOT_NULL(router.add("a/b/c", counter(0)));
+  TEST_ASSERT_NOT_NULL(router.add("a/#", counter(1)));
+  TEST_ASSERT_EQUAL_UINT32(4, router.size());
+
+  // invalid filters are rejected before any node is added
+  TEST_ASSERT_NULL(router.add("a/#/b", counter(2)));
+  TEST_ASSERT_NULL(router.add("x/y/#/z", counter(2)));
+  TEST_ASSERT_NULL(router.add("x/y#", counter(2)));
+  TEST_ASSERT_NULL(router.add("x/+y/z", counter(2)));
+  TEST_ASSERT_NULL(router.add("", counter(2)));
+  TEST_ASSERT_EQUAL_UINT32(4, router.size());
+
+  TEST_ASSERT_EQUAL_UINT32(2, dispatch(&router, "a/b/c"));
+  TEST_ASSERT_EQUAL_INT(0, hits[2]);
+  TEST_ASSERT_EQUAL_UINT32(1, dispatch(&router, "a/x/b"));
+  TEST_ASSERT_EQUAL_UINT32(0, dispatch(&router, "x/y/z"));
+
+  // removing the last route frees its nodes
+  router.remove("a/b/c");
+  TEST_ASSERT_EQUAL_UINT32(2, router.size());
+}
+
+void test_remove() {
+  TopicRouter router;
+  TopicRouter::Route* route = router.add("a/+", counter(0));
+  TEST_ASSERT_NOT_NULL(router.add("a/+", counter(1)));
+  TEST_ASSERT_NOT_NULL(router.add("a/b", counter(2)));
+  TEST_ASSERT_EQUAL_UINT32(3, dispatch(&router, "a/b"));
+
+  router.remove("a/+", route);
+  TEST_ASSERT_EQUAL_UINT32(2, dispatch(&router, "a/b"));
+  TEST_ASSERT_EQUAL_INT(0, hits[0]);
+  TEST_ASSERT_EQUAL_INT(1, hits[1]);
+
+  router.remove("a/+");
+  router.remove("x/y");  // unknown filter
+  TEST_ASSERT_EQUAL_UINT32(1, dispatch(&router, "a/b"));
+  TEST_ASSERT_EQUAL_INT(1, hits[2]);
+
+  // removing while dispatching only takes effect for the next dispatch
+  TopicRouter::Route* matches = router.match("a/b", 3);
+  router.remove("a/b");
+  TEST_ASSERT_NOT_NULL(matches);
+  TEST_ASSERT_TRUE(matches->removed);
+  router.release();
+  TEST_ASSERT_EQUAL_UINT32(0, dispatch(&router, "a/b"));
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_match);
+  RUN_TEST(test_invalid);
+  RUN_TEST(test_remove);
+  return UNITY_END();
+}